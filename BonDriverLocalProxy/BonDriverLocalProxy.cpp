@@ -1,647 +1,3133 @@
-﻿#define WIN32_LEAN_AND_MEAN
-#define NOMINMAX
-#include <windows.h>
-#include <objbase.h>
-#include <shellapi.h>
-#include <string.h>
-#include <wchar.h>
-#include <algorithm>
-#include <memory>
-#include "IBonDriver3.h"
-
-namespace
-{
-const int TSDATASIZE = 48128;
-const int BDP_RING_BUFFER_NUM = 8 * 1024 * 1024 / TSDATASIZE;
-
-DWORD Write(HANDLE hPipe, BYTE (&buf)[8 + TSDATASIZE], OVERLAPPED *ol, const void *ret, const void *param = nullptr, DWORD paramSize = 0)
-{
-    if (paramSize <= 4 + TSDATASIZE) {
-        memcpy(buf, ret, 4);
-        if (paramSize != 0) {
-            memcpy(buf + 4, param, paramSize);
-        }
-        if (WriteFile(hPipe, buf, 4 + paramSize, nullptr, ol) || GetLastError() == ERROR_IO_PENDING) {
-            return 4 + paramSize;
-        }
-    }
-    return 0;
-}
-
-enum BDP_STATE {
-    BDP_ST_IDLE, BDP_ST_CONNECTING, BDP_ST_CONNECTED, BDP_ST_READING, BDP_ST_READ, BDP_ST_WRITING
-};
-
-struct BDP_CONNECTION {
-    HANDLE hPipe;
-    OVERLAPPED ol;
-    BDP_STATE state;
-    // 以下はstate>=BDP_ST_CONNECTEDのとき有効
-    bool doneOpenTuner;
-    DWORD priority;
-    // MAXDWORDは未使用を表す
-    DWORD ringBufFront;
-    DWORD bufCount;
-    BYTE buf[8 + TSDATASIZE];
-};
-
-struct BDP_RING_BUFFER {
-    DWORD bufCount;
-    BYTE buf[4 + TSDATASIZE];
-};
-
-bool SetPriority(BDP_CONNECTION &conn, DWORD priority, std::unique_ptr<BDP_CONNECTION> *connList)
-{
-    // 上位16bitは絶対優先度、下位16bitは接続順
-    priority <<= 16;
-    // 絶対優先度は重複してはならない
-    for (int i = 0; connList[i]; ++i) {
-        if (connList[i]->state >= BDP_ST_CONNECTED && (connList[i]->priority & 0xFFFF0000) == priority) {
-            return false;
-        }
-    }
-    // 接続順を整理
-    DWORD reorder = 1;
-    for (;; ++reorder) {
-        int minIndex = -1;
-        DWORD minOrder = 0xFFFF;
-        for (int i = 0; connList[i]; ++i) {
-            DWORD order = connList[i]->priority & 0xFFFF;
-            if (connList[i]->state >= BDP_ST_CONNECTED && order >= reorder && order < minOrder) {
-                minOrder = order;
-                minIndex = i;
-            }
-        }
-        if (minIndex < 0) {
-            break;
-        }
-        connList[minIndex]->priority = (connList[minIndex]->priority & 0xFFFF0000) | reorder;
-    }
-    conn.priority = priority | reorder;
-    return true;
-}
-
-bool IsHighestPriority(DWORD priority, std::unique_ptr<BDP_CONNECTION> *connList, bool forRingBuf = false)
-{
-    for (int i = 0; connList[i]; ++i) {
-        if (connList[i]->state >= BDP_ST_CONNECTED && (!forRingBuf || connList[i]->ringBufFront != MAXDWORD)) {
-            // 絶対優先度の上位8bitが大きいものを優先、下位は無視
-            if ((connList[i]->priority >> 24) > (priority >> 24)) {
-                return false;
-            }
-            else if ((connList[i]->priority >> 24) == (priority >> 24)) {
-                // 絶対優先度の上位8bitが奇数なら先行優先、偶数なら後続優先
-                if (priority & 0x01000000) {
-                    if ((connList[i]->priority & 0xFFFF) < (priority & 0xFFFF)) {
-                        return false;
-                    }
-                }
-                else {
-                    if ((connList[i]->priority & 0xFFFF) > (priority & 0xFFFF)) {
-                        return false;
-                    }
-                }
-            }
-        }
-    }
-    return true;
-}
-
-bool AnyDoneOpenTuner(std::unique_ptr<BDP_CONNECTION> *connList)
-{
-    for (int i = 0; connList[i]; ++i) {
-        if (connList[i]->state >= BDP_ST_CONNECTED && connList[i]->doneOpenTuner) {
-            return true;
-        }
-    }
-    return false;
-}
-
-void CloseTuner(BDP_CONNECTION &conn, std::unique_ptr<BDP_CONNECTION> *connList, IBonDriver *bon)
-{
-    if (conn.doneOpenTuner) {
-        conn.doneOpenTuner = false;
-        if (!AnyDoneOpenTuner(connList)) {
-            bon->CloseTuner();
-        }
-    }
-}
-
-void CloseBonDriver(std::unique_ptr<BDP_CONNECTION> *connList, HMODULE *hLib, IBonDriver **bon, IBonDriver2 **bon2, IBonDriver3 **bon3, bool *doneCreateBon)
-{
-    for (int i = 0; connList[i]; ++i) {
-        if (connList[i]->state >= BDP_ST_CONNECTED) {
-            return;
-        }
-    }
-    *doneCreateBon = false;
-    if (*bon) {
-        (*bon)->Release();
-        *bon = nullptr;
-        *bon2 = nullptr;
-        *bon3 = nullptr;
-    }
-    if (*hLib) {
-        FreeLibrary(*hLib);
-        *hLib = nullptr;
-    }
-}
-
-void RotateRingBuffer(DWORD n, std::unique_ptr<BDP_CONNECTION> *connList, std::unique_ptr<BDP_RING_BUFFER> *ringBuf, DWORD ringBufNum)
-{
-    for (int i = 0; connList[i]; ++i) {
-        if (connList[i]->state >= BDP_ST_CONNECTED && connList[i]->ringBufFront != MAXDWORD) {
-            connList[i]->ringBufFront = (connList[i]->ringBufFront + n) % ringBufNum;
-        }
-    }
-    for (; n > 0; --n) {
-        for (DWORD i = ringBufNum - 1; i > 0; --i) {
-            ringBuf[i].swap(ringBuf[i - 1]);
-        }
-    }
-}
-
-bool ExpandRingBuffer(std::unique_ptr<BDP_CONNECTION> *connList, std::unique_ptr<BDP_RING_BUFFER> *ringBuf, DWORD &ringBufNum, DWORD &ringBufRear)
-{
-   for (int i = 0; connList[i]; ++i) {
-       if (connList[i]->state >= BDP_ST_CONNECTED && (ringBufRear + 1) % ringBufNum == connList[i]->ringBufFront) {
-           // 空きがないので増やす
-           // ringBufRearが末尾に来るように回転
-           RotateRingBuffer((ringBufNum - 1 - ringBufRear) % ringBufNum, connList, ringBuf, ringBufNum);
-           ringBufRear = ringBufNum - 1;
-           ringBuf[ringBufNum++].reset(new BDP_RING_BUFFER);
-           return true;
-       }
-   }
-   return false;
-}
-
-void ShrinkRingBuffer(std::unique_ptr<BDP_CONNECTION> *connList, std::unique_ptr<BDP_RING_BUFFER> *ringBuf, DWORD &ringBufNum, DWORD &ringBufRear)
-{
-    if (ringBufNum > 1) {
-        for (int i = 0; connList[i]; ++i) {
-            if (connList[i]->state >= BDP_ST_CONNECTED && (ringBufRear + 1) % ringBufNum == connList[i]->ringBufFront) {
-                // 空きがない
-                return;
-            }
-        }
-        // ringBufRearが末尾の1つ手前に来るように回転
-        RotateRingBuffer((ringBufNum * 2 - 2 - ringBufRear) % ringBufNum, connList, ringBuf, ringBufNum);
-        ringBufRear = ringBufNum - 2;
-        ringBuf[--ringBufNum].reset();
-    }
-}
-}
-
-#ifdef __MINGW32__
-__declspec(dllexport) // ASLRを無効にしないため(CVE-2018-5392)
-int APIENTRY WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine, int nCmdShow)
-#else
-int APIENTRY wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPWSTR lpCmdLine, int nCmdShow)
-#endif
-{
-    static_cast<void>(hInstance);
-    static_cast<void>(hPrevInstance);
-    static_cast<void>(lpCmdLine);
-    static_cast<void>(nCmdShow);
-    SetDllDirectory(L"");
-
-    WCHAR origin[MAX_PATH] = {};
-    {
-        int argc;
-        LPWSTR *argv = CommandLineToArgvW(GetCommandLine(), &argc);
-        if (argv) {
-            if (argc >= 2 && wcslen(argv[1]) < MAX_PATH) {
-                wcscpy_s(origin, argv[1]);
-            }
-            LocalFree(argv);
-        }
-    }
-    if (!origin[0]) {
-        return 0;
-    }
-
-    // BonDriverがCOMを利用するかもしれないため
-    CoInitializeEx(nullptr, COINIT_APARTMENTTHREADED | COINIT_DISABLE_OLE1DDE);
-
-    IsGUIThread(TRUE);
-
-    std::unique_ptr<BDP_CONNECTION> connList[MAXIMUM_WAIT_OBJECTS];
-    HANDLE hEventList[MAXIMUM_WAIT_OBJECTS - 1];
-    int ringBufShrinkCount = 0;
-    std::unique_ptr<BDP_RING_BUFFER> ringBuf[BDP_RING_BUFFER_NUM];
-    ringBuf[0].reset(new BDP_RING_BUFFER);
-    DWORD ringBufNum = 1;
-    DWORD ringBufRear = 0;
-    HMODULE hLib = nullptr;
-    IBonDriver *bon = nullptr;
-    IBonDriver2 *bon2 = nullptr;
-    IBonDriver3 *bon3 = nullptr;
-    CBonStructAdapter bonAdapter;
-    CBonStruct2Adapter bon2Adapter;
-    CBonStruct3Adapter bon3Adapter;
-    bool doneCreateBon = false;
-    bool firstConnecting = false;
-    BOOL openTunerResult;
-    bool initChSet = false;
-
-    for (;;) {
-        DWORD connCount = 0;
-        bool anyConnected = false;
-        bool allReadingOrWriting = true;
-        bool allWaiting = true;
-
-        for (; connList[connCount]; ++connCount) {
-            BDP_CONNECTION &conn = *connList[connCount];
-            if (conn.state == BDP_ST_IDLE) {
-                conn.doneOpenTuner = false;
-                conn.priority = 0;
-                conn.ringBufFront = MAXDWORD;
-                conn.bufCount = 0;
-                OVERLAPPED olZero = {};
-                conn.ol = olZero;
-                conn.ol.hEvent = hEventList[connCount];
-                if (ConnectNamedPipe(conn.hPipe, &conn.ol)) {
-                    conn.state = BDP_ST_CONNECTED;
-                }
-                else {
-                    DWORD err = GetLastError();
-                    if (err == ERROR_PIPE_CONNECTED) {
-                        conn.state = BDP_ST_CONNECTED;
-                    }
-                    else if (err == ERROR_IO_PENDING) {
-                        conn.state = BDP_ST_CONNECTING;
-                    }
-                    else {
-                        // 失敗時の高負荷を防ぐため
-                        Sleep(1);
-                    }
-                }
-            }
-            else if (conn.state == BDP_ST_CONNECTED) {
-                OVERLAPPED olZero = {};
-                conn.ol = olZero;
-                conn.ol.hEvent = hEventList[connCount];
-                if (ReadFile(conn.hPipe, conn.buf, 12 - conn.bufCount, nullptr, &conn.ol) || GetLastError() == ERROR_IO_PENDING) {
-                    conn.state = BDP_ST_READING;
-                }
-                else {
-                    CloseTuner(conn, connList, bon);
-                    conn.state = BDP_ST_IDLE;
-                    CloseBonDriver(connList, &hLib, &bon, &bon2, &bon3, &doneCreateBon);
-                    DisconnectNamedPipe(conn.hPipe);
-                }
-            }
-            else if (conn.state == BDP_ST_READ) {
-                OVERLAPPED olZero = {};
-                conn.ol = olZero;
-                conn.ol.hEvent = hEventList[connCount];
-                union {
-                    BOOL b;
-                    DWORD n;
-                } param1, param2;
-                char cmd[5] = {};
-                memcpy(cmd, conn.buf, 4);
-                memcpy(&param1, conn.buf + 4, 4);
-                memcpy(&param2, conn.buf + 8, 4);
-                conn.bufCount = 0;
-                if (!strcmp(cmd, "Crea")) {
-                    DWORD type = 0;
-                    if (SetPriority(conn, param1.n, connList)) {
-                        if (!doneCreateBon) {
-                            doneCreateBon = true;
-                            WCHAR libPath[MAX_PATH * 2 + 64];
-                            DWORD len = GetModuleFileName(nullptr, libPath, MAX_PATH);
-                            if (len && len < MAX_PATH && wcsrchr(libPath, L'\\')) {
-                                *wcsrchr(libPath, L'\\') = L'\0';
-                                wcscat_s(libPath, L"\\BonDriver_");
-                                wcscat_s(libPath, origin);
-                                wcscat_s(libPath, L".dll");
-                                hLib = LoadLibrary(libPath);
-                                if (hLib) {
-                                    const STRUCT_IBONDRIVER *(*funcCreateBonStruct)() = reinterpret_cast<const STRUCT_IBONDRIVER*(*)()>(GetProcAddress(hLib, "CreateBonStruct"));
-                                    if (funcCreateBonStruct) {
-                                        // 特定コンパイラに依存しないI/Fを使う
-                                        const STRUCT_IBONDRIVER *st = funcCreateBonStruct();
-                                        if (st) {
-                                            if (bon3Adapter.Adapt(*st)) {
-                                                bon = bon2 = bon3 = &bon3Adapter;
-                                            }
-                                            else if (bon2Adapter.Adapt(*st)) {
-                                                bon = bon2 = &bon2Adapter;
-                                            }
-                                            else {
-                                                bonAdapter.Adapt(*st);
-                                                bon = &bonAdapter;
-                                            }
-                                        }
-                                    }
-#ifdef _MSC_VER
-                                    else {
-                                        IBonDriver *(*funcCreateBonDriver)() = reinterpret_cast<IBonDriver*(*)()>(GetProcAddress(hLib, "CreateBonDriver"));
-                                        if (funcCreateBonDriver) {
-                                            bon = funcCreateBonDriver();
-                                            if (bon) {
-                                                bon2 = dynamic_cast<IBonDriver2*>(bon);
-                                                if (bon2) {
-                                                    bon3 = dynamic_cast<IBonDriver3*>(bon2);
-                                                }
-                                            }
-                                        }
-                                    }
-#endif
-                                }
-                            }
-                            initChSet = false;
-                        }
-                        type = bon3 ? 3 : bon2 ? 2 : bon ? 1 : 0;
-                    }
-                    conn.bufCount = Write(conn.hPipe, conn.buf, &conn.ol, &type);
-                }
-                else if (!strcmp(cmd, "GTot")) {
-                    if (bon3) {
-                        DWORD n = bon3->GetTotalDeviceNum();
-                        conn.bufCount = Write(conn.hPipe, conn.buf, &conn.ol, &n);
-                    }
-                }
-                else if (!strcmp(cmd, "GAct")) {
-                    if (bon3) {
-                        DWORD n = bon3->GetActiveDeviceNum();
-                        conn.bufCount = Write(conn.hPipe, conn.buf, &conn.ol, &n);
-                    }
-                }
-                else if (!strcmp(cmd, "SLnb")) {
-                    if (bon3) {
-                        BOOL b = IsHighestPriority(conn.priority, connList) ? bon3->SetLnbPower(param1.b) : FALSE;
-                        conn.bufCount = Write(conn.hPipe, conn.buf, &conn.ol, &b);
-                    }
-                }
-                else if (!strcmp(cmd, "GTun")) {
-                    if (bon2) {
-                        LPCWSTR tunerName = bon2->GetTunerName();
-                        DWORD n = static_cast<DWORD>(tunerName ? wcslen(tunerName) + 1 : 0);
-                        n = std::min<DWORD>(n, 255);
-                        conn.bufCount = Write(conn.hPipe, conn.buf, &conn.ol, &n, tunerName, n * sizeof(WCHAR));
-                    }
-                }
-                else if (!strcmp(cmd, "ITun")) {
-                    if (bon2) {
-                        BOOL b = bon2->IsTunerOpening();
-                        conn.bufCount = Write(conn.hPipe, conn.buf, &conn.ol, &b);
-                    }
-                }
-                else if (!strcmp(cmd, "ETun")) {
-                    if (bon2) {
-                        LPCWSTR tuningSpace = bon2->EnumTuningSpace(param1.n);
-                        DWORD n = static_cast<DWORD>(tuningSpace ? wcslen(tuningSpace) + 1 : 0);
-                        n = std::min<DWORD>(n, 255);
-                        conn.bufCount = Write(conn.hPipe, conn.buf, &conn.ol, &n, tuningSpace, n * sizeof(WCHAR));
-                    }
-                }
-                else if (!strcmp(cmd, "ECha")) {
-                    if (bon2) {
-                        LPCWSTR channelName = bon2->EnumChannelName(param1.n, param2.n);
-                        DWORD n = static_cast<DWORD>(channelName ? wcslen(channelName) + 1 : 0);
-                        n = std::min<DWORD>(n, 255);
-                        conn.bufCount = Write(conn.hPipe, conn.buf, &conn.ol, &n, channelName, n * sizeof(WCHAR));
-                    }
-                }
-                else if (!strcmp(cmd, "SCh2")) {
-                    if (bon2) {
-                        BOOL b = FALSE;
-                        if (IsHighestPriority(conn.priority, connList)) {
-                            // 最初のSetChannel()までGetCurChannel()等の結果があまり信用できないため
-                            if (initChSet && bon2->GetCurChannel() == param2.n && bon2->GetCurSpace() == param1.n) {
-                                b = TRUE;
-                            }
-                            else if (bon2->SetChannel(param1.n, param2.n)) {
-                                b = TRUE;
-                                initChSet = true;
-                            }
-                        }
-                        conn.bufCount = Write(conn.hPipe, conn.buf, &conn.ol, &b);
-                    }
-                }
-                else if (!strcmp(cmd, "GCSp")) {
-                    if (bon2) {
-                        DWORD n = bon2->GetCurSpace();
-                        conn.bufCount = Write(conn.hPipe, conn.buf, &conn.ol, &n);
-                    }
-                }
-                else if (!strcmp(cmd, "GCCh")) {
-                    if (bon2) {
-                        DWORD n = bon2->GetCurChannel();
-                        conn.bufCount = Write(conn.hPipe, conn.buf, &conn.ol, &n);
-                    }
-                }
-                else if (!strcmp(cmd, "Open")) {
-                    if (bon) {
-                        if (!conn.doneOpenTuner) {
-                            if (!AnyDoneOpenTuner(connList)) {
-                                openTunerResult = bon->OpenTuner();
-                                initChSet = false;
-                            }
-                            conn.doneOpenTuner = true;
-                        }
-                        conn.bufCount = Write(conn.hPipe, conn.buf, &conn.ol, &openTunerResult);
-                    }
-                }
-                else if (!strcmp(cmd, "Clos")) {
-                    if (bon) {
-                        CloseTuner(conn, connList, bon);
-                        DWORD n = 0;
-                        conn.bufCount = Write(conn.hPipe, conn.buf, &conn.ol, &n);
-                    }
-                }
-                else if (!strcmp(cmd, "SCha")) {
-                    if (bon) {
-                        BOOL b = IsHighestPriority(conn.priority, connList) ? bon->SetChannel(static_cast<BYTE>(param1.n)) : FALSE;
-                        conn.bufCount = Write(conn.hPipe, conn.buf, &conn.ol, &b);
-                    }
-                }
-                else if (!strcmp(cmd, "GSig")) {
-                    if (bon) {
-                        float f = bon->GetSignalLevel();
-                        conn.bufCount = Write(conn.hPipe, conn.buf, &conn.ol, &f);
-                    }
-                }
-                else if (!strcmp(cmd, "GRea")) {
-                    if (bon) {
-                        DWORD n = bon->GetReadyCount() + (conn.ringBufFront == MAXDWORD || conn.ringBufFront == ringBufRear ? 0 : 1);
-                        conn.bufCount = Write(conn.hPipe, conn.buf, &conn.ol, &n);
-                    }
-                }
-                else if (!strcmp(cmd, "GTsS")) {
-                    if (bon) {
-                        if (conn.ringBufFront == MAXDWORD) {
-                            // 使用開始
-                            conn.ringBufFront = ringBufRear;
-                        }
-                        if (conn.ringBufFront == ringBufRear && IsHighestPriority(conn.priority, connList, true)) {
-                            // 定期的にリングバッファを縮める
-                            if (++ringBufShrinkCount > 100) {
-                                ShrinkRingBuffer(connList, ringBuf, ringBufNum, ringBufRear);
-                                ringBufShrinkCount = 0;
-                            }
-                            BYTE *buf;
-                            DWORD bufSize;
-                            DWORD remain;
-                            if (bon->GetTsStream(&buf, &bufSize, &remain) && buf) {
-                                while (bufSize != 0) {
-                                    if (bufSize > sizeof(ringBuf[0]->buf) - 4) {
-                                        ++remain;
-                                        memcpy(ringBuf[ringBufRear]->buf, &remain, 4);
-                                        --remain;
-                                        ringBuf[ringBufRear]->bufCount = sizeof(ringBuf[0]->buf);
-                                    }
-                                    else {
-                                        memcpy(ringBuf[ringBufRear]->buf, &remain, 4);
-                                        ringBuf[ringBufRear]->bufCount = 4 + bufSize;
-                                    }
-                                    memcpy(ringBuf[ringBufRear]->buf + 4, buf, ringBuf[ringBufRear]->bufCount - 4);
-                                    buf += ringBuf[ringBufRear]->bufCount - 4;
-                                    bufSize -= ringBuf[ringBufRear]->bufCount - 4;
-                                    // 最長でBDP_RING_BUFFER_NUMまでリングバッファを伸ばす
-                                    if (ringBufNum < BDP_RING_BUFFER_NUM && ExpandRingBuffer(connList, ringBuf, ringBufNum, ringBufRear)) {
-                                        ringBufShrinkCount = 0;
-                                    }
-                                    ringBufRear = (ringBufRear + 1) % ringBufNum;
-                                }
-                            }
-                        }
-                        if (conn.ringBufFront != ringBufRear) {
-                            conn.bufCount = Write(conn.hPipe, conn.buf, &conn.ol, &ringBuf[conn.ringBufFront]->bufCount,
-                                                  ringBuf[conn.ringBufFront]->buf, ringBuf[conn.ringBufFront]->bufCount);
-                            conn.ringBufFront = (conn.ringBufFront + 1) % ringBufNum;
-                        }
-                        else {
-                            DWORD n = 4;
-                            DWORD remain = 0;
-                            conn.bufCount = Write(conn.hPipe, conn.buf, &conn.ol, &n, &remain, 4);
-                        }
-                    }
-                }
-                else if (!strcmp(cmd, "Purg")) {
-                    if (bon) {
-                        if (IsHighestPriority(conn.priority, connList)) {
-                            bon->PurgeTsStream();
-                        }
-                        if (conn.ringBufFront != MAXDWORD) {
-                            conn.ringBufFront = ringBufRear;
-                        }
-                        DWORD n = 0;
-                        conn.bufCount = Write(conn.hPipe, conn.buf, &conn.ol, &n);
-                    }
-                }
-                if (conn.bufCount != 0) {
-                    conn.state = BDP_ST_WRITING;
-                }
-                else {
-                    CloseTuner(conn, connList, bon);
-                    conn.state = BDP_ST_IDLE;
-                    CloseBonDriver(connList, &hLib, &bon, &bon2, &bon3, &doneCreateBon);
-                    DisconnectNamedPipe(conn.hPipe);
-                }
-            }
-
-            anyConnected = anyConnected || (conn.state >= BDP_ST_CONNECTED);
-            allReadingOrWriting = allReadingOrWriting && (conn.state == BDP_ST_READING || conn.state == BDP_ST_WRITING);
-            allWaiting = allWaiting && (conn.state == BDP_ST_CONNECTING || conn.state == BDP_ST_READING || conn.state == BDP_ST_WRITING);
-        }
-
-        if (!anyConnected && connCount != 0 && !firstConnecting) {
-            // 誰も接続していないので終了
-            break;
-        }
-        firstConnecting = false;
-        if (allReadingOrWriting && connCount < MAXIMUM_WAIT_OBJECTS - 1) {
-            // パイプを増やす
-            hEventList[connCount] = CreateEvent(nullptr, TRUE, FALSE, nullptr);
-            if (hEventList[connCount]) {
-                connList[connCount].reset(new BDP_CONNECTION);
-                WCHAR pipeName[MAX_PATH + 64];
-                wcscpy_s(pipeName, L"\\\\.\\pipe\\BonDriverLocalProxy_");
-                wcscat_s(pipeName, origin);
-                connList[connCount]->hPipe = CreateNamedPipe(pipeName, PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | (connCount == 0 ? FILE_FLAG_FIRST_PIPE_INSTANCE : 0),
-                                                             0, PIPE_UNLIMITED_INSTANCES, TSDATASIZE + 256, 256, 0, nullptr);
-                if (connList[connCount]->hPipe == INVALID_HANDLE_VALUE) {
-                    CloseHandle(hEventList[connCount]);
-                    connList[connCount].reset();
-                    if (connCount == 0) {
-                        break;
-                    }
-                }
-                else {
-                    if (connCount == 0) {
-                        firstConnecting = true;
-                    }
-                    connList[connCount++]->state = BDP_ST_IDLE;
-                    allWaiting = false;
-                }
-            }
-            else if (connCount == 0) {
-                break;
-            }
-        }
-
-        if (allWaiting) {
-            DWORD ret = MsgWaitForMultipleObjects(connCount, hEventList, FALSE, INFINITE, QS_ALLINPUT);
-            if (WAIT_OBJECT_0 <= ret && ret < WAIT_OBJECT_0 + connCount) {
-                BDP_CONNECTION &conn = *connList[ret - WAIT_OBJECT_0];
-                DWORD xferred;
-                if (GetOverlappedResult(conn.hPipe, &conn.ol, &xferred, TRUE)) {
-                    if (conn.state == BDP_ST_CONNECTING) {
-                        conn.doneOpenTuner = false;
-                        conn.priority = 0;
-                        conn.ringBufFront = MAXDWORD;
-                        conn.bufCount = 0;
-                        conn.state = BDP_ST_CONNECTED;
-                    }
-                    else if (conn.state == BDP_ST_READING) {
-                        conn.bufCount += xferred;
-                        conn.state = conn.bufCount >= 12 ? BDP_ST_READ : BDP_ST_CONNECTED;
-                    }
-                    else {
-                        if (conn.bufCount == xferred) {
-                            conn.bufCount = 0;
-                            conn.state = BDP_ST_CONNECTED;
-                        }
-                        else {
-                            CloseTuner(conn, connList, bon);
-                            conn.state = BDP_ST_IDLE;
-                            CloseBonDriver(connList, &hLib, &bon, &bon2, &bon3, &doneCreateBon);
-                            DisconnectNamedPipe(conn.hPipe);
-                        }
-                    }
-                }
-                else {
-                    if (conn.state >= BDP_ST_CONNECTED) {
-                        CloseTuner(conn, connList, bon);
-                        conn.state = BDP_ST_IDLE;
-                        CloseBonDriver(connList, &hLib, &bon, &bon2, &bon3, &doneCreateBon);
-                        DisconnectNamedPipe(conn.hPipe);
-                    }
-                    conn.state = BDP_ST_IDLE;
-                }
-            }
-            else if (ret == WAIT_OBJECT_0 + connCount) {
-                MSG msg;
-                while (PeekMessage(&msg, nullptr, 0, 0, PM_REMOVE)) {
-                    TranslateMessage(&msg);
-                    DispatchMessage(&msg);
-                }
-            }
-            else {
-                // 失敗時の高負荷を防ぐため
-                Sleep(1);
-            }
-        }
-    }
-
-    for (int i = 0; connList[i]; ++i) {
-        CloseHandle(connList[i]->hPipe);
-        CloseHandle(hEventList[i]);
-    }
-    CoUninitialize();
-    return 0;
-}
+﻿#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <objbase.h>
+#include <shellapi.h>
+#include <process.h>
+#include <string.h>
+#include <wchar.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <type_traits>
+#include <vector>
+#include "IBonDriver3.h"
+#include "BonDriverLocalProxyCommand.h"
+#include "BonDriverLocalProxyStatFormat.h"
+#include "BonDriverLocalProxyRing.h"
+#include "BonDriverLocalProxyTs.h"
+#include "BonDriverLocalProxySharedRing.h"
+
+namespace
+{
+// TSパケットちょうど256個分
+const int TSDATASIZE = TS_PACKET_SIZE * 256;
+// リングバッファの最大バイト数の既定値と上限
+const DWORD BDP_RING_BUFFER_BYTES = 8 * 1024 * 1024;
+const DWORD BDP_RING_BUFFER_BYTES_MAX = 1024 * 1024 * 1024;
+// リングバッファのスロット数は、チャンクの平均がこのバイト数でも足りるように決める
+const DWORD BDP_RING_SLOT_MIN_BYTES = 4096;
+// リングバッファを縮めるかどうかを判断する期間の既定値
+const DWORD BDP_SHRINK_WINDOW_MSEC = 10000;
+// クライアントがCreaの第2引数で要求できる機能(応答の8bit以降に受理したものが返る)
+const DWORD BDP_FEATURE_SHARED_RING = 0x01;
+const DWORD BDP_FEATURE_PUSH = 0x02;
+// Crea以降のコマンドと応答を長さ付きのフレームで送受する(プロトコルv2)
+const DWORD BDP_FEATURE_FRAMED = 0x04;
+// チューナ名とチャンネル表をGTblで一括取得できる
+const DWORD BDP_FEATURE_CHANNEL_TABLE = 0x08;
+// FPidでPIDごとに送るかどうかを指定できる
+const DWORD BDP_FEATURE_PID_FILTER = 0x10;
+// SLagで遅れたときの方針を指定でき、GDrpで読み飛ばした量を取得できる
+const DWORD BDP_FEATURE_LAG_POLICY = 0x20;
+// GEvtで新しいデータが届いたことを知らせるイベントを取得できる
+const DWORD BDP_FEATURE_DATA_EVENT = 0x40;
+// TnWtで選局して新しいチャンクが届くまで待てる
+const DWORD BDP_FEATURE_TUNE_WAIT = 0x80;
+// GStbでシグナルレベル等を定期的に書き込む共有メモリを取得できる
+const DWORD BDP_FEATURE_STATUS_BLOCK = 0x100;
+// 一括取得するチャンネル表の最大バイト数
+const DWORD BDP_CHANNEL_TABLE_MAX = 1024 * 1024;
+// 1フレームに含められるコマンドの最大数
+const int BDP_FRAME_CMD_MAX = 16;
+// フレーム長、GTsSの応答1つ、残りのコマンドが文字列を返す場合の応答を収められる大きさ
+const int BDP_REPLY_BUF_SIZE = 4 + 8 + TSDATASIZE + BDP_FRAME_CMD_MAX * (4 + 255 * 2);
+// プッシュ配信でクライアントが一度に受け取れる最大数
+const int BDP_PUSH_CREDIT_MAX = 32;
+// 取得スレッドから代理元のスレッドへ受け渡す途中で保持できる数
+const int BDP_CAPTURE_QUEUE_NUM = 64;
+// 取得スレッドがデータのないドライバを読む間隔
+const DWORD BDP_CAPTURE_INTERVAL = 10;
+// 小さな取得結果をまとめるときに最初の取得から保持する時間の既定値
+const DWORD BDP_MAX_HOLD_MSEC = 100;
+// 遅れすぎた接続を最新のチャンクまで読み飛ばさせる
+const DWORD BDP_LAG_POLICY_SKIP = 0;
+// 遅れすぎた接続を切断する
+const DWORD BDP_LAG_POLICY_DISCONNECT = 1;
+// 1つのプロセスで代理する代理元(デバイスプールを含む)の最大数
+const size_t BDP_HOSTED_MAX = 32;
+// TnWtで選局後の最初のチャンクを待つ最大時間
+const DWORD BDP_TUNE_WAIT_MSEC = 10000;
+// 参照中のまま読み飛ばされたチャンクを上書きしないよう、取り込みを止めておく最大時間
+const DWORD BDP_PIN_TIMEOUT_MSEC = 3000;
+// シグナルレベル等を共有メモリに書き込む間隔の既定値
+const DWORD BDP_STATUS_INTERVAL_MSEC = 500;
+
+class CBlockLock
+{
+public:
+    CBlockLock(CRITICAL_SECTION *cs) : m_cs(cs) { EnterCriticalSection(m_cs); }
+    ~CBlockLock() { LeaveCriticalSection(m_cs); }
+private:
+    CBlockLock(const CBlockLock&);
+    CBlockLock &operator=(const CBlockLock&);
+    CRITICAL_SECTION *m_cs;
+};
+
+enum BDP_STATE {
+    BDP_ST_IDLE, BDP_ST_CONNECTING, BDP_ST_CONNECTED, BDP_ST_READING, BDP_ST_READ, BDP_ST_WRITING, BDP_ST_PUSH_WAIT, BDP_ST_TUNE_WAIT, BDP_ST_DRIVER_WAIT
+};
+
+struct BDP_CONNECTION;
+struct BDP_HOSTED_ORIGIN;
+
+// 接続の待ち行列(代理元ごとのスレッドだけが触る)
+struct BDP_CONN_QUEUE {
+    BDP_CONNECTION *head;
+    BDP_CONNECTION *tail;
+};
+
+// ドライバのスレッドでの呼び出し結果
+struct BDP_DRIVER_RESULT {
+    BOOL b;
+    DWORD n;
+    float f;
+    // 文字列は複写する(nullptrならstrValidがfalse)
+    bool strValid;
+    WCHAR str[256];
+    // 選局したときの通し番号と、選局を始めたときのQueryPerformanceCounter()の値
+    bool tuned;
+    DWORD epoch;
+    LONGLONG tuneTime;
+};
+
+struct BDP_CONNECTION {
+    HANDLE hPipe;
+    // ReadFileEx()等ではhEventにこの構造体を指させる
+    OVERLAPPED ol;
+    BDP_STATE state;
+    // I/Oが完了したときに追加される待ち行列
+    BDP_CONN_QUEUE *readyQueue;
+    // いずれかの待ち行列に入っているかどうかと、その次の要素
+    bool queued;
+    BDP_CONNECTION *queueNext;
+    // 完了したI/Oの結果
+    DWORD ioError;
+    DWORD ioXferred;
+    // 以下はstate>=BDP_ST_CONNECTEDのとき有効
+    bool doneOpenTuner;
+    DWORD priority;
+    // MAXDWORDは未使用を表す
+    DWORD ringBufFront;
+    // ringBufFrontの位置をクライアントが共有メモリ上で参照中
+    bool ringBufHeld;
+    // 参照中のまま遅れて読み飛ばされたチャンクのdata上の通し位置(~0ULLはなし)。次のコマンドまで上書きしない
+    ULONGLONG ringBufPinned;
+    // 0以外ならプッシュ配信用の接続から参照される識別子
+    DWORD id;
+    // 以下はプッシュ配信用の接続のとき有効
+    // 配信元の接続(識別子が一致しなくなれば無効)
+    BDP_CONNECTION *pushOwner;
+    DWORD pushOwnerId;
+    // 共有メモリのスロット番号を送るかどうか
+    bool pushShared;
+    // 次に送る位置(MAXDWORDは未使用)
+    DWORD pushCursor;
+    DWORD pushCredits;
+    // 送ったがクライアントが解放していないスロット番号(ringBufFrontはこの先頭かpushCursor)
+    DWORD pushSent[BDP_PUSH_CREDIT_MAX];
+    DWORD pushSentHead;
+    DWORD pushSentCount;
+    // デバイスプールから振り分けられた接続ならそのプール
+    const BDP_HOSTED_ORIGIN *pool;
+    // Creaで受理したv2の接続かどうか
+    bool framed;
+    // pidMapで1のPIDのパケットだけを送る(共有メモリを介するものは対象外)
+    bool pidFilter;
+    BYTE pidMap[8192 / 8];
+    // 未送信のバイト数がこれを超えるか、リングバッファに上書きされそうになるとlagPolicyに従う(0は上書きされるときだけ)
+    DWORD maxLagBytes;
+    DWORD lagPolicy;
+    // BDP_LAG_POLICY_DISCONNECTに従って次の機会に切断する
+    bool lagExceeded;
+    // 最後にPurgしたときのPurgの通し番号(これより前に取得しはじめたスロットは送らない)
+    DWORD purgeSeq;
+    // 遅れすぎて読み飛ばした回数とバイト数
+    DWORD dropCount;
+    ULONGLONG dropBytes;
+    // GEvtで渡したイベント。dataEventArmedのときに新しいデータが届けばセットする
+    HANDLE hDataEvent;
+    DWORD dataEventId;
+    bool dataEventArmed;
+    // TnWtで待っている選局の通し番号と、待ちはじめたときのGetTickCount()の値
+    DWORD tuneWaitEpoch;
+    DWORD tuneWaitTick;
+    // v1では12バイトのコマンド、v2ではフレーム長に続くコマンド列
+    DWORD cmdCount;
+    BYTE cmdBuf[4 + 12 * BDP_FRAME_CMD_MAX];
+    // 処理中のフレームで次に処理するコマンドの位置(MAXDWORDは未着手)。ドライバの呼び出しを待つとここから再開する
+    DWORD cmdPos;
+    // ドライバのスレッドに依頼した呼び出しが完了した
+    bool driverDone;
+    // 依頼したのはチューナの状態を変える呼び出しで、ほかの同種の呼び出しを待たせている
+    bool driverSerial;
+    BDP_DRIVER_RESULT driverResult;
+    // bufに続けて書き込む一括応答(nullptrは無し)
+    const BYTE *bulkData;
+    DWORD bulkSize;
+    // Statの一括応答の実体
+    std::vector<BYTE> bulkBuf;
+    // 以下はStatで返す統計(接続ごとにリセット)
+    ULONGLONG statBytes;
+    DWORD statChunks;
+    // 送ったチャンクが最新から何個遅れていたかの最大値
+    DWORD statMaxLag;
+    DWORD statLatencyHist[BDP_LATENCY_HIST_NUM];
+    // 送信する応答(v2では先頭4バイトがフレーム長)
+    DWORD bufCount;
+    BYTE buf[BDP_REPLY_BUF_SIZE];
+};
+
+// 応答を追加する
+bool AppendReply(BDP_CONNECTION &conn, const void *ret, const void *param = nullptr, DWORD paramSize = 0)
+{
+    if (paramSize <= sizeof(conn.buf) - 4 && conn.bufCount <= sizeof(conn.buf) - 4 - paramSize) {
+        memcpy(conn.buf + conn.bufCount, ret, 4);
+        if (paramSize != 0) {
+            memcpy(conn.buf + conn.bufCount + 4, param, paramSize);
+        }
+        conn.bufCount += 4 + paramSize;
+        return true;
+    }
+    return false;
+}
+
+bool AppendResultData(BDP_CONNECTION &conn, DWORD ret) { return AppendReply(conn, &ret); }
+bool AppendResultData(BDP_CONNECTION &conn, BOOL ret) { return AppendReply(conn, &ret); }
+bool AppendResultData(BDP_CONNECTION &conn, float ret) { return AppendReply(conn, &ret); }
+bool AppendResultData(BDP_CONNECTION &conn, const BDP_DROP_RESULT &ret) { return AppendReply(conn, &ret.count, &ret.bytes, 8); }
+bool AppendResultData(BDP_CONNECTION &conn, const BDP_TUNE_RESULT &ret) { return AppendReply(conn, &ret.result, &ret.latencyUsec, 4); }
+
+// 文字列は終端を含む文字数に続けて返す
+bool AppendResultData(BDP_CONNECTION &conn, LPCWSTR ret)
+{
+    DWORD n = static_cast<DWORD>(ret ? wcslen(ret) + 1 : 0);
+    n = std::min<DWORD>(n, 255);
+    return AppendReply(conn, &n, ret, n * sizeof(WCHAR));
+}
+
+// コマンドの応答を追加する。型がBDP_COMMAND_LISTの定義と合わなければコンパイルエラーになる
+template<BDP_COMMAND Cmd, class T>
+bool AppendResult(BDP_CONNECTION &conn, const T &ret)
+{
+    static_assert(std::is_same<T, typename BDP_COMMAND_TRAITS<Cmd>::ServerResult>::value, "result type mismatch");
+    return AppendResultData(conn, ret);
+}
+
+// FourCCからコマンドの通し番号を引く表(開番地法)
+struct BDP_COMMAND_TABLE {
+    BYTE slot[64];
+};
+
+DWORD HashCommand(DWORD fourcc)
+{
+    return (fourcc * 0x9E3779B1) >> 26;
+}
+
+void InitCommandTable(BDP_COMMAND_TABLE &table)
+{
+    static_assert(BDP_COMMAND_NUM * 2 <= sizeof(table.slot), "too many commands");
+    memset(table.slot, BDP_COMMAND_NUM, sizeof(table.slot));
+    for (int i = 0; i < BDP_COMMAND_NUM; ++i) {
+        DWORD h = HashCommand(BDP_COMMAND_FOURCC[i]);
+        for (; table.slot[h] != BDP_COMMAND_NUM; h = (h + 1) % sizeof(table.slot));
+        table.slot[h] = static_cast<BYTE>(i);
+    }
+}
+
+// 見つからなければBDP_COMMAND_NUM
+BDP_COMMAND FindCommand(const BDP_COMMAND_TABLE &table, DWORD fourcc)
+{
+    for (DWORD h = HashCommand(fourcc); table.slot[h] != BDP_COMMAND_NUM; h = (h + 1) % sizeof(table.slot)) {
+        if (BDP_COMMAND_FOURCC[table.slot[h]] == fourcc) {
+            return static_cast<BDP_COMMAND>(table.slot[h]);
+        }
+    }
+    return BDP_COMMAND_NUM;
+}
+
+typedef std::vector<std::unique_ptr<BDP_CONNECTION>> BDP_CONNECTION_LIST;
+
+void PushQueue(BDP_CONN_QUEUE &queue, BDP_CONNECTION &conn)
+{
+    if (!conn.queued) {
+        conn.queued = true;
+        conn.queueNext = nullptr;
+        if (queue.tail) {
+            queue.tail->queueNext = &conn;
+        }
+        else {
+            queue.head = &conn;
+        }
+        queue.tail = &conn;
+    }
+}
+
+BDP_CONNECTION *PopQueue(BDP_CONN_QUEUE &queue)
+{
+    BDP_CONNECTION *conn = queue.head;
+    if (conn) {
+        queue.head = conn->queueNext;
+        if (!queue.head) {
+            queue.tail = nullptr;
+        }
+        conn->queued = false;
+    }
+    return conn;
+}
+
+// ReadFileEx()とWriteFileEx()の完了ルーチン。代理元のスレッドの警告可能な待機中に呼ばれる
+VOID CALLBACK OnPipeIoCompleted(DWORD err, DWORD xferred, LPOVERLAPPED ol)
+{
+    BDP_CONNECTION &conn = *static_cast<BDP_CONNECTION*>(ol->hEvent);
+    conn.ioError = err;
+    conn.ioXferred = xferred;
+    PushQueue(*conn.readyQueue, conn);
+}
+
+bool WriteReply(BDP_CONNECTION &conn, const BYTE *data = nullptr)
+{
+    OVERLAPPED olZero = {};
+    conn.ol = olZero;
+    conn.ol.hEvent = &conn;
+    return WriteFileEx(conn.hPipe, data ? data : conn.buf, conn.bufCount, &conn.ol, OnPipeIoCompleted) != FALSE;
+}
+
+// 次に読むべきコマンドの長さ(v2ではフレーム長を読んでから本体を読む)。0は異常
+DWORD GetCommandSize(const BDP_CONNECTION &conn)
+{
+    if (!conn.framed) {
+        return 12;
+    }
+    if (conn.cmdCount < 4) {
+        return 4;
+    }
+    DWORD frameSize;
+    memcpy(&frameSize, conn.cmdBuf, 4);
+    return frameSize != 0 && frameSize % 12 == 0 && frameSize <= 12 * BDP_FRAME_CMD_MAX ? 4 + frameSize : 0;
+}
+
+// v2ではフレーム長と本体を1回で読めるように、バッファの空きの分だけ読む(続くフレームの先頭まで読めばそれも残す)
+bool ReadCommand(BDP_CONNECTION &conn)
+{
+    DWORD cmdSize = GetCommandSize(conn);
+    DWORD readSize = conn.framed ? sizeof(conn.cmdBuf) : cmdSize;
+    OVERLAPPED olZero = {};
+    conn.ol = olZero;
+    conn.ol.hEvent = &conn;
+    return cmdSize > conn.cmdCount && ReadFileEx(conn.hPipe, conn.cmdBuf + conn.cmdCount, readSize - conn.cmdCount, &conn.ol, OnPipeIoCompleted);
+}
+
+struct BDP_RING_BUFFER {
+    DWORD bufCount;
+    BYTE buf[4 + TSDATASIZE];
+};
+
+// スロットのつなぎかたはBDP_RING_LINKS。スロットは起動時に確保したslot[maxNum]に対応する
+// チャンクの実体は大きさに応じてdataに詰めて書き込む
+struct BDP_RING : BDP_RING_LINKS {
+    BDP_RING_SLOT *slot;
+    // 書き込み中のチャンクの終わりの通し位置の下位32bit(共有メモリ上にあり、書き込む前に更新する)
+    volatile LONG *writeEnd;
+    // 2重にマップされていればチャンクが末尾をまたいでも連続して読み書きできる
+    BYTE *data;
+    DWORD dataSize;
+    bool dataMirrored;
+    // 次に書き込むdata上の通し位置
+    ULONGLONG writePos;
+    // 以下の配列の大きさはmaxNum
+    // そのスロットのdata上の通し位置
+    std::vector<ULONGLONG> pos;
+    // rearBytesがこれを超えたら、未送信のバイト数が上限を超えた接続がないか調べる
+    ULONGLONG lagCheckBytes;
+    // ringBufPinnedを持つ接続の数と、それを上書きしないよう取り込みを止めているか、止めはじめたときのGetTickCount()の値
+    DWORD pinnedCount;
+    bool ingestStalled;
+    DWORD stallTick;
+    // 縮めるかどうかを判断する期間と、期間中に接続が使っていたスロットの数の最大値
+    DWORD shrinkWindowMsec;
+    DWORD shrinkWindowTick;
+    DWORD peakUsed;
+    // そのスロットの内容を取得スレッドが取得しはじめたときのQueryPerformanceCounter()の値
+    std::vector<LONGLONG> captureTime;
+    LONGLONG perfFreq;
+    // そのスロットの内容を取得したときの選局の通し番号と、現在のもの(これと異なるスロットは送らない)
+    std::vector<DWORD> epoch;
+    DWORD curEpoch;
+    // そのスロットの内容を取得しはじめたときのPurgの通し番号と、現在のもの
+    std::vector<DWORD> purge;
+    DWORD curPurge;
+    // curEpochの選局を始めたときのQueryPerformanceCounter()の値と、最初のチャンクを取得するまでの時間(未着はMAXDWORD)
+    LONGLONG tuneTime;
+    DWORD tuneLatencyUsec;
+    // 以下はStatで返す統計(ほかにexpandEventsとshrinkEvents)
+    DWORD ingestChunks;
+    ULONGLONG ingestBytes;
+};
+
+// ドライバからの取得を専用スレッドで行う
+struct BDP_CAPTURE {
+    HANDLE hThread;
+    HANDLE hStopEvent;
+    // 取得スレッドがqueueに追加するたびにセットされる
+    HANDLE hEvent;
+    IBonDriver *bon;
+    // 取得スレッドのGetTsStream()やPurgeTsStream()とドライバのスレッドのSetChannel()等を排他する
+    CRITICAL_SECTION lock;
+    // 代理元のスレッドがセットし、取得スレッドが次のGetTsStream()の前にPurgeTsStream()する
+    std::atomic<bool> purgeRequested;
+    // 代理元のスレッドがPurgのたびに進める通し番号(purgeRequestedより先に進める)。変わればまとめかけのものを区切る
+    std::atomic<DWORD> purgeSeq;
+    // 単一生産者単一消費者のキュー。tailは取得スレッド、headは代理元のスレッドだけが進める
+    std::atomic<DWORD> head;
+    std::atomic<DWORD> tail;
+    // キューに空きがなく捨てたバイト数
+    std::atomic<DWORD> dropCount;
+    // 小さな取得結果をまとめて保持する最大時間(0はまとめない)
+    DWORD maxHoldMsec;
+    // 以下はlockで保護する
+    // PurgeTsStream()したのでまとめかけのものを捨てる
+    bool purged;
+    // 選局の通し番号と、その選局を始めたときのQueryPerformanceCounter()の値。変わればまとめかけのものを捨てる
+    DWORD epoch;
+    LONGLONG tuneTime;
+    // 以下は取得スレッドだけが書き換える(統計として参照する)
+    std::atomic<DWORD> chunkCount;
+    std::atomic<ULONGLONG> chunkBytes;
+    // 同期バイトを見失って読み飛ばしたバイト数
+    std::atomic<ULONGLONG> resyncBytes;
+    // queueのそれぞれを取得しはじめたときのQueryPerformanceCounter()の値
+    LONGLONG queueTime[BDP_CAPTURE_QUEUE_NUM];
+    // queueのそれぞれを取得したときの選局の通し番号と、その選局を始めたときのQueryPerformanceCounter()の値
+    DWORD queueEpoch[BDP_CAPTURE_QUEUE_NUM];
+    LONGLONG queueTuneTime[BDP_CAPTURE_QUEUE_NUM];
+    // queueのそれぞれを取得しはじめたときのPurgの通し番号
+    DWORD queuePurge[BDP_CAPTURE_QUEUE_NUM];
+    BDP_RING_BUFFER queue[BDP_CAPTURE_QUEUE_NUM];
+};
+
+// シグナルレベル等を定期的に書き込む共有メモリ。クライアントは読み取り専用でマップする
+// 書き込み中はseqが奇数になり、読む側は前後でseqが一致する偶数ならその内容を使う
+struct BDP_SHARED_STATUS {
+    LONG seq;
+    // 書き込む間隔と、最後に書き込んだときのGetTickCount()の値
+    DWORD intervalMsec;
+    DWORD sampleTick;
+    // チューナが開いていて以下が有効かどうか
+    BOOL active;
+    float signalLevel;
+    DWORD curSpace;
+    DWORD curChannel;
+    BOOL tunerOpening;
+    BYTE reserved[32];
+};
+
+
+// 設定ファイルの[代理元のドライバ名]、なければ[Default]セクションから読む
+DWORD GetSettingInt(LPCWSTR iniPath, LPCWSTR origin, LPCWSTR key, DWORD def)
+{
+    if (!iniPath[0]) {
+        return def;
+    }
+    return GetPrivateProfileInt(origin, key, GetPrivateProfileInt(L"Default", key, def, iniPath), iniPath);
+}
+
+bool SetPriority(BDP_CONNECTION &conn, DWORD priority, const BDP_CONNECTION_LIST &connList)
+{
+    // 上位16bitは絶対優先度、下位16bitは接続順
+    priority <<= 16;
+    // 絶対優先度は重複してはならない
+    for (size_t i = 0; i < connList.size(); ++i) {
+        if (connList[i]->state >= BDP_ST_CONNECTED && (connList[i]->priority & 0xFFFF0000) == priority) {
+            return false;
+        }
+    }
+    // 接続順を整理
+    DWORD reorder = 1;
+    for (;; ++reorder) {
+        int minIndex = -1;
+        DWORD minOrder = 0xFFFF;
+        for (size_t i = 0; i < connList.size(); ++i) {
+            DWORD order = connList[i]->priority & 0xFFFF;
+            if (connList[i]->state >= BDP_ST_CONNECTED && order >= reorder && order < minOrder) {
+                minOrder = order;
+                minIndex = static_cast<int>(i);
+            }
+        }
+        if (minIndex < 0) {
+            break;
+        }
+        connList[minIndex]->priority = (connList[minIndex]->priority & 0xFFFF0000) | reorder;
+    }
+    conn.priority = priority | reorder;
+    return true;
+}
+
+BDP_CONNECTION *GetPushOwner(const BDP_CONNECTION &conn)
+{
+    if (conn.pushOwner && conn.pushOwner->state >= BDP_ST_CONNECTED && conn.pushOwner->id == conn.pushOwnerId) {
+        return conn.pushOwner;
+    }
+    return nullptr;
+}
+
+bool IsHighestPriority(DWORD priority, const BDP_CONNECTION_LIST &connList)
+{
+    for (size_t i = 0; i < connList.size(); ++i) {
+        if (connList[i]->state >= BDP_ST_CONNECTED) {
+            DWORD connPriority = connList[i]->priority;
+            // 絶対優先度の上位8bitが大きいものを優先、下位は無視
+            if ((connPriority >> 24) > (priority >> 24)) {
+                return false;
+            }
+            else if ((connPriority >> 24) == (priority >> 24)) {
+                // 絶対優先度の上位8bitが奇数なら先行優先、偶数なら後続優先
+                if (priority & 0x01000000) {
+                    if ((connPriority & 0xFFFF) < (priority & 0xFFFF)) {
+                        return false;
+                    }
+                }
+                else {
+                    if ((connPriority & 0xFFFF) > (priority & 0xFFFF)) {
+                        return false;
+                    }
+                }
+            }
+        }
+    }
+    return true;
+}
+
+bool AnyDoneOpenTuner(const BDP_CONNECTION_LIST &connList)
+{
+    for (size_t i = 0; i < connList.size(); ++i) {
+        if (connList[i]->state >= BDP_ST_CONNECTED && connList[i]->doneOpenTuner) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// リングバッファのスロットを送ったときの統計を取る
+void RecordChunkSent(BDP_CONNECTION &conn, DWORD front, DWORD bytes, const BDP_RING &ring)
+{
+    ++conn.statChunks;
+    conn.statBytes += bytes;
+    conn.statMaxLag = std::max<DWORD>(conn.statMaxLag, ring.rearSeq - ring.seq[front]);
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    ULONGLONG usec = now.QuadPart > ring.captureTime[front] && ring.perfFreq > 0 ?
+                     static_cast<ULONGLONG>(now.QuadPart - ring.captureTime[front]) * 1000000 / ring.perfFreq : 0;
+    AddLatencyHist(conn.statLatencyHist, usec);
+}
+
+// リングバッファのスロットを応答に追加する
+bool AppendChunk(BDP_CONNECTION &conn, const BDP_CONNECTION &filterConn, DWORD front, const BDP_RING &ring)
+{
+    DWORD bufCount = ring.slot[front].bufCount;
+    const BYTE *buf = ring.data + ring.slot[front].offset;
+    if (!filterConn.pidFilter) {
+        if (AppendReply(conn, &bufCount, buf, bufCount)) {
+            RecordChunkSent(conn, front, bufCount - 4, ring);
+            return true;
+        }
+        return false;
+    }
+    if (conn.bufCount <= sizeof(conn.buf) - 4 - bufCount) {
+        BYTE *p = conn.buf + conn.bufCount;
+        // 先頭4バイトは残り数
+        DWORD n = 4 + FilterTsPackets(buf + 4, bufCount - 4, p + 8, filterConn.pidMap);
+        memcpy(p, &n, 4);
+        memcpy(p + 4, buf, 4);
+        conn.bufCount += 4 + n;
+        RecordChunkSent(conn, front, n - 4, ring);
+        return true;
+    }
+    return false;
+}
+
+// まとめかけのqueue[tail]を代理元のスレッドに渡す
+void PublishCapture(BDP_CAPTURE &cap, DWORD &tail, DWORD &fillCount, DWORD remain)
+{
+    BDP_RING_BUFFER &rb = cap.queue[tail % BDP_CAPTURE_QUEUE_NUM];
+    memcpy(rb.buf, &remain, 4);
+    rb.bufCount = 4 + fillCount;
+    ++cap.chunkCount;
+    cap.chunkBytes += fillCount;
+    fillCount = 0;
+    cap.tail.store(++tail, std::memory_order_release);
+    SetEvent(cap.hEvent);
+}
+
+unsigned int __stdcall CaptureThread(void *param)
+{
+    BDP_CAPTURE &cap = *static_cast<BDP_CAPTURE*>(param);
+    DWORD interval = 0;
+    // queue[tail]にまとめかけているバイト数と、その最初の取得時刻
+    DWORD fillCount = 0;
+    DWORD fillTick = 0;
+    // 前回の取得結果の末尾にあったパケットの端数
+    BYTE carry[TS_PACKET_SIZE];
+    DWORD carryCount = 0;
+    // まとめかけているものの選局の通し番号と、その選局を始めたときの値
+    DWORD fillEpoch;
+    LONGLONG fillTuneTime;
+    // まとめかけているものを取得しはじめたときのPurgの通し番号
+    DWORD fillPurge = cap.purgeSeq.load(std::memory_order_acquire);
+    {
+        CBlockLock lock(&cap.lock);
+        fillEpoch = cap.epoch;
+        fillTuneTime = cap.tuneTime;
+    }
+    while (WaitForSingleObject(cap.hStopEvent, interval) == WAIT_TIMEOUT) {
+        DWORD tail = cap.tail.load(std::memory_order_relaxed);
+        if (fillCount == 0 && tail - cap.head.load(std::memory_order_acquire) >= BDP_CAPTURE_QUEUE_NUM) {
+            // 代理元のスレッドが取り出すまで待つ
+            interval = BDP_CAPTURE_INTERVAL;
+            continue;
+        }
+        DWORD remain = 0;
+        {
+            CBlockLock lock(&cap.lock);
+            if (cap.purgeRequested.exchange(false)) {
+                cap.bon->PurgeTsStream();
+                cap.purged = true;
+            }
+            // purgeRequestedを読んだ後に読む
+            DWORD purgeSeq = cap.purgeSeq.load(std::memory_order_acquire);
+            if (cap.purged || cap.epoch != fillEpoch) {
+                cap.purged = false;
+                fillEpoch = cap.epoch;
+                fillTuneTime = cap.tuneTime;
+                fillCount = 0;
+                carryCount = 0;
+            }
+            else if (purgeSeq != fillPurge && fillCount != 0) {
+                // Purgより前に取得したものとして区切って渡す
+                PublishCapture(cap, tail, fillCount, 0);
+            }
+            fillPurge = purgeSeq;
+            BYTE *buf;
+            DWORD bufSize;
+            if (cap.bon->GetTsStream(&buf, &bufSize, &remain) && buf) {
+                while (bufSize != 0) {
+                    // パケット単位でqueue[tail]に追加する
+                    const BYTE *src;
+                    DWORD srcSize;
+                    if (carryCount != 0) {
+                        // 端数を補う(端数は同期バイトから始まっている)
+                        DWORD n = std::min<DWORD>(bufSize, TS_PACKET_SIZE - carryCount);
+                        memcpy(carry + carryCount, buf, n);
+                        carryCount += n;
+                        buf += n;
+                        bufSize -= n;
+                        if (carryCount < TS_PACKET_SIZE) {
+                            break;
+                        }
+                        carryCount = 0;
+                        src = carry;
+                        srcSize = TS_PACKET_SIZE;
+                    }
+                    else if (buf[0] != 0x47) {
+                        // 同期を取り直す
+                        DWORD n = static_cast<DWORD>(FindTsSync(buf, bufSize));
+                        cap.resyncBytes += n;
+                        buf += n;
+                        bufSize -= n;
+                        continue;
+                    }
+                    else if (bufSize < TS_PACKET_SIZE) {
+                        memcpy(carry, buf, bufSize);
+                        carryCount = bufSize;
+                        break;
+                    }
+                    else {
+                        DWORD n = CountSyncedPackets(buf, std::min<DWORD>(bufSize, TSDATASIZE - fillCount) / TS_PACKET_SIZE);
+                        src = buf;
+                        srcSize = n * TS_PACKET_SIZE;
+                        buf += srcSize;
+                        bufSize -= srcSize;
+                    }
+                    if (fillCount == 0) {
+                        if (tail - cap.head.load(std::memory_order_acquire) >= BDP_CAPTURE_QUEUE_NUM) {
+                            cap.dropCount += srcSize;
+                            continue;
+                        }
+                        fillTick = GetTickCount();
+                        LARGE_INTEGER now;
+                        QueryPerformanceCounter(&now);
+                        cap.queueTime[tail % BDP_CAPTURE_QUEUE_NUM] = now.QuadPart;
+                        cap.queueEpoch[tail % BDP_CAPTURE_QUEUE_NUM] = fillEpoch;
+                        cap.queueTuneTime[tail % BDP_CAPTURE_QUEUE_NUM] = fillTuneTime;
+                        cap.queuePurge[tail % BDP_CAPTURE_QUEUE_NUM] = fillPurge;
+                    }
+                    BDP_RING_BUFFER &rb = cap.queue[tail % BDP_CAPTURE_QUEUE_NUM];
+                    memcpy(rb.buf + 4 + fillCount, src, srcSize);
+                    fillCount += srcSize;
+                    if (fillCount == TSDATASIZE || cap.maxHoldMsec == 0) {
+                        // 分割したときは続きがあることを示す
+                        PublishCapture(cap, tail, fillCount, bufSize != 0 ? remain + 1 : remain);
+                    }
+                }
+            }
+            else {
+                remain = 0;
+            }
+            if (fillCount != 0 && GetTickCount() - fillTick >= cap.maxHoldMsec) {
+                // 保持時間を過ぎたので満たなくても渡す
+                PublishCapture(cap, tail, fillCount, remain);
+            }
+        }
+        // 残りがあればすぐに読む。まとめかけがあれば保持時間を過ぎないように読む
+        interval = remain != 0 ? 0 : BDP_CAPTURE_INTERVAL;
+        if (fillCount != 0) {
+            interval = std::min(interval, cap.maxHoldMsec - std::min(GetTickCount() - fillTick, cap.maxHoldMsec));
+        }
+    }
+    return 0;
+}
+
+void StartCapture(BDP_CAPTURE &cap, IBonDriver *bon)
+{
+    if (!cap.hThread) {
+        cap.bon = bon;
+        cap.head = 0;
+        cap.tail = 0;
+        cap.purged = false;
+        cap.purgeRequested = false;
+        cap.chunkCount = 0;
+        cap.chunkBytes = 0;
+        cap.resyncBytes = 0;
+        ResetEvent(cap.hStopEvent);
+        cap.hThread = reinterpret_cast<HANDLE>(_beginthreadex(nullptr, 0, CaptureThread, &cap, 0, nullptr));
+        if (cap.hThread) {
+            SetThreadPriority(cap.hThread, THREAD_PRIORITY_ABOVE_NORMAL);
+        }
+    }
+}
+
+void StopCapture(BDP_CAPTURE &cap)
+{
+    if (cap.hThread) {
+        SetEvent(cap.hStopEvent);
+        WaitForSingleObject(cap.hThread, INFINITE);
+        CloseHandle(cap.hThread);
+        cap.hThread = nullptr;
+    }
+}
+
+// ドライバのスレッドで呼ぶもの
+enum BDP_DRIVER_CALL {
+    BDP_CALL_CREATE,
+    BDP_CALL_RELEASE,
+    BDP_CALL_OPEN_TUNER,
+    BDP_CALL_CLOSE_TUNER,
+    // SCha(param1はチャンネル)
+    BDP_CALL_SET_CHANNEL,
+    // SCh2とTnWt(param1は空間、param2はチャンネル)
+    BDP_CALL_SET_CHANNEL2,
+    BDP_CALL_SET_LNB_POWER,
+    BDP_CALL_GET_ACTIVE_DEVICE_NUM,
+    BDP_CALL_GET_TUNER_NAME,
+    BDP_CALL_IS_TUNER_OPENING,
+    BDP_CALL_ENUM_TUNING_SPACE,
+    BDP_CALL_ENUM_CHANNEL_NAME,
+    BDP_CALL_GET_CUR_SPACE,
+    BDP_CALL_GET_CUR_CHANNEL,
+    BDP_CALL_GET_SIGNAL_LEVEL,
+    BDP_CALL_PURGE_TS_STREAM,
+};
+
+struct BDP_BON_DRIVER;
+struct BDP_PRELOAD;
+
+// BonDriverを呼ぶ専用のスレッドへの依頼。確保を伴わないよう、呼ぶものと引数だけを渡す
+struct BDP_DRIVER_JOB {
+    BDP_DRIVER_CALL call;
+    DWORD param1;
+    DWORD param2;
+    BDP_DRIVER_RESULT *result;
+    // 完了を知らせる接続(nullptrならhSyncEventをセットする)
+    BDP_CONNECTION *conn;
+};
+
+// BonDriverはこのスレッドのアパートメントで作成し、取得スレッドのGetTsStream()を除いてこのスレッドから呼ぶ
+// 選局などに時間がかかっても、代理元のスレッドはその間ほかの接続への配信を続ける
+struct BDP_DRIVER_THREAD {
+    HANDLE hThread;
+    // 完了を知らせるAPCの宛先
+    HANDLE hOriginThread;
+    HANDLE hJobEvent;
+    HANDLE hSyncEvent;
+    // 以下はlockで保護する
+    CRITICAL_SECTION lock;
+    std::vector<BDP_DRIVER_JOB> jobs;
+    bool stop;
+    // 以下はドライバのスレッドだけが触る
+    // 状態を書き込む共有メモリ(nullptrなら書き込まない)とその間隔
+    BDP_SHARED_STATUS *status;
+    DWORD statusIntervalMsec;
+    // チューナが開いている間だけ状態を書き込む
+    IBonDriver *statusBon;
+    IBonDriver2 *statusBon2;
+    DWORD statusTick;
+    // 依頼を呼ぶのに使う(最初の依頼までに代理元のスレッドが設定する)
+    BDP_BON_DRIVER *driver;
+    BDP_CAPTURE *cap;
+    BDP_PRELOAD *preload;
+    // 最初のSetChannel()までGetCurChannel()等の結果があまり信用できないため、SCh2で選局したかを覚えておく
+    bool initChSet;
+};
+
+// 状態をまとめて書き込む(ドライバのスレッドで呼ぶ)
+void WriteSharedStatus(BDP_SHARED_STATUS &st, BOOL active, float signalLevel, DWORD space, DWORD ch, BOOL opening)
+{
+    // ほかのプロセスが読むので、前後のseqの更新で内容の書き込みを挟む
+    InterlockedIncrement(&st.seq);
+    st.sampleTick = GetTickCount();
+    st.active = active;
+    st.signalLevel = signalLevel;
+    st.curSpace = space;
+    st.curChannel = ch;
+    st.tunerOpening = opening;
+    InterlockedIncrement(&st.seq);
+}
+
+// 書き込まれた状態を読む(代理元のスレッドで呼ぶ)。チューナが開いていて内容が有効ならtrue
+bool ReadSharedStatus(const BDP_SHARED_STATUS *st, BDP_SHARED_STATUS &status)
+{
+    if (!st) {
+        return false;
+    }
+    const volatile LONG &seq = st->seq;
+    for (int retry = 0; retry < 100; ++retry) {
+        LONG before = seq;
+        if (before & 1) {
+            // 書き込みはすぐに終わる
+            Sleep(0);
+            continue;
+        }
+        MemoryBarrier();
+        memcpy(&status, st, sizeof(status));
+        MemoryBarrier();
+        if (seq == before) {
+            return status.active != FALSE;
+        }
+    }
+    return false;
+}
+
+// 利用者の数によらず、ドライバを呼ぶのは1回の書き込みにつき1回ずつ
+void SampleStatus(BDP_DRIVER_THREAD &drv)
+{
+    if (drv.status && drv.statusBon) {
+        float signalLevel = drv.statusBon->GetSignalLevel();
+        DWORD space = drv.statusBon2 ? drv.statusBon2->GetCurSpace() : MAXDWORD;
+        DWORD ch = drv.statusBon2 ? drv.statusBon2->GetCurChannel() : MAXDWORD;
+        BOOL opening = drv.statusBon2 ? drv.statusBon2->IsTunerOpening() : FALSE;
+        WriteSharedStatus(*drv.status, TRUE, signalLevel, space, ch, opening);
+        drv.statusTick = GetTickCount();
+    }
+}
+
+// OpenTuner()して、成功すれば状態の書き込みを始める(ドライバのスレッドで呼ぶ)
+void OpenTunerOnDriver(BDP_DRIVER_RESULT &r, BDP_DRIVER_THREAD &drv, IBonDriver *bon, IBonDriver2 *bon2)
+{
+    r.b = bon->OpenTuner();
+    if (r.b && drv.status) {
+        drv.statusBon = bon;
+        drv.statusBon2 = bon2;
+        SampleStatus(drv);
+    }
+}
+
+// 状態の書き込みをやめてCloseTuner()する(ドライバのスレッドで呼ぶ)
+void CloseTunerOnDriver(BDP_DRIVER_THREAD &drv, IBonDriver *bon)
+{
+    if (drv.status && drv.statusBon) {
+        WriteSharedStatus(*drv.status, FALSE, 0, MAXDWORD, MAXDWORD, FALSE);
+    }
+    drv.statusBon = nullptr;
+    drv.statusBon2 = nullptr;
+    bon->CloseTuner();
+}
+
+// 依頼した呼び出しの完了ルーチン。代理元のスレッドの警告可能な待機中に呼ばれる
+VOID CALLBACK OnDriverJobCompleted(ULONG_PTR param)
+{
+    BDP_CONNECTION &conn = *reinterpret_cast<BDP_CONNECTION*>(param);
+    conn.driverDone = true;
+    conn.state = BDP_ST_READ;
+    PushQueue(*conn.readyQueue, conn);
+}
+
+void CallOnDriver(BDP_DRIVER_THREAD &drv, const BDP_DRIVER_JOB &job);
+
+unsigned int __stdcall DriverThread(void *param)
+{
+    BDP_DRIVER_THREAD &drv = *static_cast<BDP_DRIVER_THREAD*>(param);
+    // BonDriverがCOMを利用するかもしれないため
+    CoInitializeEx(nullptr, COINIT_APARTMENTTHREADED | COINIT_DISABLE_OLE1DDE);
+
+    IsGUIThread(TRUE);
+
+    // drv.jobsと入れ替えて使い、どちらの容量も使いまわす
+    std::vector<BDP_DRIVER_JOB> jobs;
+    for (;;) {
+        bool stop;
+        {
+            CBlockLock lock(&drv.lock);
+            jobs.swap(drv.jobs);
+            stop = drv.stop;
+        }
+        // 依頼された順に呼ぶ
+        for (size_t i = 0; i < jobs.size(); ++i) {
+            CallOnDriver(drv, jobs[i]);
+            if (jobs[i].conn) {
+                QueueUserAPC(OnDriverJobCompleted, drv.hOriginThread, reinterpret_cast<ULONG_PTR>(jobs[i].conn));
+            }
+            else {
+                SetEvent(drv.hSyncEvent);
+            }
+        }
+        if (drv.statusBon && GetTickCount() - drv.statusTick >= drv.statusIntervalMsec) {
+            SampleStatus(drv);
+        }
+        bool idle = jobs.empty();
+        jobs.clear();
+        if (idle) {
+            if (stop) {
+                break;
+            }
+            // 依頼を待つ間もメッセージを処理する。状態を書き込んでいれば次の書き込みまで
+            DWORD timeout = INFINITE;
+            if (drv.statusBon) {
+                DWORD elapsed = GetTickCount() - drv.statusTick;
+                timeout = elapsed < drv.statusIntervalMsec ? drv.statusIntervalMsec - elapsed : 0;
+            }
+            if (MsgWaitForMultipleObjects(1, &drv.hJobEvent, FALSE, timeout, QS_ALLINPUT) == WAIT_OBJECT_0 + 1) {
+                MSG msg;
+                while (PeekMessage(&msg, nullptr, 0, 0, PM_REMOVE)) {
+                    TranslateMessage(&msg);
+                    DispatchMessage(&msg);
+                }
+            }
+        }
+    }
+    CoUninitialize();
+    return 0;
+}
+
+// statusがnullptrでなければ、チューナが開いている間intervalMsecごとに状態を書き込む
+bool StartDriverThread(BDP_DRIVER_THREAD &drv, BDP_SHARED_STATUS *status, DWORD intervalMsec)
+{
+    InitializeCriticalSection(&drv.lock);
+    drv.stop = false;
+    drv.status = status;
+    drv.statusIntervalMsec = intervalMsec;
+    drv.statusBon = nullptr;
+    drv.statusBon2 = nullptr;
+    drv.statusTick = 0;
+    drv.driver = nullptr;
+    drv.cap = nullptr;
+    drv.preload = nullptr;
+    drv.initChSet = false;
+    drv.hThread = nullptr;
+    drv.hOriginThread = nullptr;
+    drv.hJobEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+    drv.hSyncEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+    if (drv.hJobEvent && drv.hSyncEvent &&
+        DuplicateHandle(GetCurrentProcess(), GetCurrentThread(), GetCurrentProcess(), &drv.hOriginThread, 0, FALSE, DUPLICATE_SAME_ACCESS)) {
+        drv.hThread = reinterpret_cast<HANDLE>(_beginthreadex(nullptr, 0, DriverThread, &drv, 0, nullptr));
+    }
+    return drv.hThread != nullptr;
+}
+
+// 依頼済みのものをすべて呼んでから終了させる
+void StopDriverThread(BDP_DRIVER_THREAD &drv)
+{
+    if (drv.hThread) {
+        {
+            CBlockLock lock(&drv.lock);
+            drv.stop = true;
+        }
+        SetEvent(drv.hJobEvent);
+        WaitForSingleObject(drv.hThread, INFINITE);
+        CloseHandle(drv.hThread);
+        drv.hThread = nullptr;
+        // 残っている完了ルーチンを呼んでおく
+        while (SleepEx(0, TRUE) == WAIT_IO_COMPLETION);
+    }
+    if (drv.hOriginThread) {
+        CloseHandle(drv.hOriginThread);
+    }
+    if (drv.hJobEvent) {
+        CloseHandle(drv.hJobEvent);
+    }
+    if (drv.hSyncEvent) {
+        CloseHandle(drv.hSyncEvent);
+    }
+    DeleteCriticalSection(&drv.lock);
+}
+
+// connを指定すれば完了ルーチンで知らせ、そうでなければhSyncEventをセットする
+void PostDriverJob(BDP_DRIVER_THREAD &drv, BDP_DRIVER_CALL call, DWORD param1, DWORD param2, BDP_DRIVER_RESULT *result, BDP_CONNECTION *conn)
+{
+    BDP_DRIVER_JOB job;
+    job.call = call;
+    job.param1 = param1;
+    job.param2 = param2;
+    job.result = result;
+    job.conn = conn;
+    {
+        CBlockLock lock(&drv.lock);
+        drv.jobs.push_back(job);
+    }
+    SetEvent(drv.hJobEvent);
+}
+
+// ドライバのスレッドで呼んで完了を待つ(切断時など、接続を待機させられないときに使う)
+void RunDriverJob(BDP_DRIVER_THREAD &drv, BDP_DRIVER_CALL call)
+{
+    BDP_DRIVER_RESULT result = {};
+    PostDriverJob(drv, call, 0, 0, &result, nullptr);
+    WaitForSingleObject(drv.hSyncEvent, INFINITE);
+}
+
+void SetDriverString(BDP_DRIVER_RESULT &r, LPCWSTR str)
+{
+    r.strValid = str != nullptr;
+    if (str) {
+        wcsncpy_s(r.str, str, _TRUNCATE);
+    }
+}
+
+LPCWSTR GetDriverString(const BDP_DRIVER_RESULT &r)
+{
+    return r.strValid ? r.str : nullptr;
+}
+
+// cap.lockを取得したまま選局の直後に呼ぶ。以降に取得するものを新しい通し番号で区別する
+void StartTuneEpoch(BDP_CAPTURE &cap, LONGLONG tuneTime, BDP_DRIVER_RESULT &r)
+{
+    cap.tuneTime = tuneTime;
+    r.tuned = true;
+    r.epoch = ++cap.epoch;
+    r.tuneTime = tuneTime;
+}
+
+// SCh2とTnWtの選局(ドライバのスレッドで呼ぶ)
+void SetDriverChannel(BDP_DRIVER_RESULT &r, BDP_DRIVER_THREAD &drv, IBonDriver2 *bon2, BDP_CAPTURE &cap, bool initChSet, DWORD space, DWORD ch)
+{
+    r.b = FALSE;
+    r.tuned = false;
+    // 最初のSetChannel()までGetCurChannel()等の結果があまり信用できないため
+    if (initChSet && bon2->GetCurChannel() == ch && bon2->GetCurSpace() == space) {
+        r.b = TRUE;
+        return;
+    }
+    {
+        // 選局中は取得スレッドを待たせる
+        CBlockLock lock(&cap.lock);
+        LARGE_INTEGER tuneTime;
+        QueryPerformanceCounter(&tuneTime);
+        if (bon2->SetChannel(space, ch)) {
+            r.b = TRUE;
+            StartTuneEpoch(cap, tuneTime.QuadPart, r);
+        }
+    }
+    if (r.tuned) {
+        // 選局した結果をすぐに見せる
+        SampleStatus(drv);
+    }
+}
+
+// SChaの選局(ドライバのスレッドで呼ぶ)
+void SetDriverChannel(BDP_DRIVER_RESULT &r, BDP_DRIVER_THREAD &drv, IBonDriver *bon, BDP_CAPTURE &cap, BYTE ch)
+{
+    r.tuned = false;
+    {
+        CBlockLock lock(&cap.lock);
+        LARGE_INTEGER tuneTime;
+        QueryPerformanceCounter(&tuneTime);
+        r.b = bon->SetChannel(ch);
+        if (r.b) {
+            StartTuneEpoch(cap, tuneTime.QuadPart, r);
+        }
+    }
+    if (r.tuned) {
+        SampleStatus(drv);
+    }
+}
+
+// lingerTunerがnullptrでなければ、最後の利用者が閉じてもチューナを開いたままにしてtrueを格納する
+void CloseTuner(BDP_CONNECTION &conn, const BDP_CONNECTION_LIST &connList, BDP_CAPTURE &cap, BDP_DRIVER_THREAD &drv, bool *lingerTuner)
+{
+    if (conn.doneOpenTuner) {
+        conn.doneOpenTuner = false;
+        if (!AnyDoneOpenTuner(connList)) {
+            if (lingerTuner) {
+                *lingerTuner = true;
+            }
+            else {
+                StopCapture(cap);
+                RunDriverJob(drv, BDP_CALL_CLOSE_TUNER);
+            }
+        }
+    }
+}
+
+bool AnyConnected(const BDP_CONNECTION_LIST &connList)
+{
+    for (size_t i = 0; i < connList.size(); ++i) {
+        if (connList[i]->state >= BDP_ST_CONNECTED) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// BonDriverの実体。ドライバのスレッドが作成と破棄を行い、代理元のスレッドは作成の完了後にbon等を複写して使う
+struct BDP_BON_DRIVER {
+    HMODULE hLib;
+    IBonDriver *bon;
+    IBonDriver2 *bon2;
+    IBonDriver3 *bon3;
+    CBonStructAdapter bonAdapter;
+    CBonStruct2Adapter bon2Adapter;
+    CBonStruct3Adapter bon3Adapter;
+    // 列挙の往復を減らすため、ロード直後の内容を一括で返せるようにしておく
+    std::vector<BYTE> channelTable;
+    // 総デバイス数は変わらないので、ロード直後に取得しておく
+    DWORD totalDeviceNum;
+};
+
+void CloseBonDriver(const BDP_CONNECTION_LIST &connList, BDP_DRIVER_THREAD &drv,
+                    IBonDriver **bon, IBonDriver2 **bon2, IBonDriver3 **bon3, bool *doneCreateBon)
+{
+    for (size_t i = 0; i < connList.size(); ++i) {
+        if (connList[i]->state >= BDP_ST_CONNECTED) {
+            return;
+        }
+    }
+    if (*doneCreateBon) {
+        *doneCreateBon = false;
+        *bon = nullptr;
+        *bon2 = nullptr;
+        *bon3 = nullptr;
+        RunDriverJob(drv, BDP_CALL_RELEASE);
+    }
+}
+
+// 最初のCreaを待たずに別スレッドで読み込んでおくBonDriver
+struct BDP_PRELOAD {
+    WCHAR libPath[MAX_PATH * 2 + 64];
+    HMODULE hLib;
+    HANDLE hThread;
+};
+
+bool GetBonDriverPath(WCHAR (&libPath)[MAX_PATH * 2 + 64], LPCWSTR origin)
+{
+    DWORD len = GetModuleFileName(nullptr, libPath, MAX_PATH);
+    if (len && len < MAX_PATH && wcsrchr(libPath, L'\\')) {
+        *wcsrchr(libPath, L'\\') = L'\0';
+        wcscat_s(libPath, L"\\BonDriver_");
+        wcscat_s(libPath, origin);
+        wcscat_s(libPath, L".dll");
+        return true;
+    }
+    libPath[0] = L'\0';
+    return false;
+}
+
+unsigned int __stdcall PreloadThread(void *param)
+{
+    BDP_PRELOAD &preload = *static_cast<BDP_PRELOAD*>(param);
+    preload.hLib = LoadLibrary(preload.libPath);
+    return 0;
+}
+
+// 先読みが終わるのを待って結果を引き取る(先読みしていなければここで読み込む)
+HMODULE TakePreloadedLibrary(BDP_PRELOAD &preload)
+{
+    if (preload.hThread) {
+        WaitForSingleObject(preload.hThread, INFINITE);
+        CloseHandle(preload.hThread);
+        preload.hThread = nullptr;
+        HMODULE hLib = preload.hLib;
+        preload.hLib = nullptr;
+        return hLib;
+    }
+    return preload.libPath[0] ? LoadLibrary(preload.libPath) : nullptr;
+}
+
+// クライアントが代理元プロセスの準備を待つためのイベント(パイプを用意するとセットする)
+HANDLE CreateReadyEvent(LPCWSTR origin)
+{
+    WCHAR name[MAX_PATH + 64];
+    wcscpy_s(name, L"BonDriverLocalProxy_Ready_");
+    wcscat_s(name, origin);
+    return CreateEvent(nullptr, TRUE, FALSE, name);
+}
+
+void CloseReadyEvent(HANDLE hReadyEvent)
+{
+    if (hReadyEvent) {
+        // 終了後に接続しようとするクライアントを待たせない
+        ResetEvent(hReadyEvent);
+        CloseHandle(hReadyEvent);
+    }
+}
+
+void InitRingBuffer(BDP_RING &ring, BDP_RING_SLOT *slot, volatile LONG *writeEnd, DWORD maxNum, BYTE *data, DWORD dataSize, bool dataMirrored,
+                    DWORD shrinkWindowMsec)
+{
+    InitRingLinks(ring, maxNum);
+    ring.slot = slot;
+    ring.writeEnd = writeEnd;
+    ring.data = data;
+    ring.dataSize = dataSize;
+    ring.dataMirrored = dataMirrored;
+    ring.writePos = 0;
+    ring.pos.assign(maxNum, 0);
+    ring.captureTime.assign(maxNum, 0);
+    ring.epoch.assign(maxNum, 0);
+    ring.purge.assign(maxNum, 0);
+    ring.curPurge = 0;
+    ring.lagCheckBytes = ~0ULL;
+    ring.pinnedCount = 0;
+    ring.ingestStalled = false;
+    ring.stallTick = 0;
+    ring.shrinkWindowMsec = shrinkWindowMsec;
+    ring.shrinkWindowTick = GetTickCount();
+    ring.peakUsed = 0;
+    LARGE_INTEGER freq;
+    ring.perfFreq = QueryPerformanceFrequency(&freq) ? freq.QuadPart : 0;
+    ring.curEpoch = 0;
+    ring.tuneTime = 0;
+    ring.tuneLatencyUsec = MAXDWORD;
+    ring.ingestChunks = 0;
+    ring.ingestBytes = 0;
+}
+
+void SetRingBufFront(BDP_CONNECTION &conn, DWORD front, BDP_RING &ring)
+{
+    MoveRingReader(ring, conn.ringBufFront, front);
+    conn.ringBufFront = front;
+    if (front != MAXDWORD) {
+        if (conn.maxLagBytes != 0) {
+            // 位置が進んだときは遅めに調べることになるが、戻ることはないので見逃さない
+            ring.lagCheckBytes = std::min(ring.lagCheckBytes, ring.byteSeq[front] + conn.maxLagBytes);
+        }
+    }
+}
+
+// 遅れすぎた接続を方針に従って最新のチャンク(rear)まで読み飛ばさせるか、切断させる
+void ApplyLagPolicy(BDP_CONNECTION &conn, BDP_RING &ring)
+{
+    // プッシュ配信では送ったものは数えない
+    DWORD front = conn.pushCursor != MAXDWORD ? conn.pushCursor : conn.ringBufFront;
+    if (front != ring.rear) {
+        conn.dropBytes += ring.byteSeq[ring.rear] - ring.byteSeq[front];
+    }
+    ++conn.dropCount;
+    if (conn.ringBufHeld && conn.ringBufPinned == ~0ULL) {
+        // クライアントが読み終えるまで、位置を移しても上書きはさせない
+        conn.ringBufPinned = ring.pos[conn.ringBufFront];
+        ++ring.pinnedCount;
+    }
+    conn.ringBufHeld = false;
+    conn.pushSentCount = 0;
+    if (conn.lagPolicy == BDP_LAG_POLICY_DISCONNECT) {
+        conn.lagExceeded = true;
+        conn.pushCursor = MAXDWORD;
+        SetRingBufFront(conn, MAXDWORD, ring);
+    }
+    else {
+        if (conn.pushCursor != MAXDWORD) {
+            conn.pushCursor = ring.rear;
+        }
+        SetRingBufFront(conn, ring.rear, ring);
+    }
+}
+
+// 次のコマンドを受け取ったので、読み飛ばしたときに参照中だったチャンクを上書きさせる
+void UnpinRingBuf(BDP_CONNECTION &conn, BDP_RING &ring)
+{
+    if (conn.ringBufPinned != ~0ULL) {
+        conn.ringBufPinned = ~0ULL;
+        if (--ring.pinnedCount == 0) {
+            ring.ingestStalled = false;
+        }
+    }
+}
+
+// 参照中のまま読み飛ばされたチャンクを、writeEndまでの書き込みで上書きしてしまうか
+// 止めはじめてからBDP_PIN_TIMEOUT_MSECを過ぎれば、その接続は応答しないものとして次の機会に切断させる
+bool IsPinnedChunkOverwritten(BDP_RING &ring, const BDP_CONNECTION_LIST &connList, ULONGLONG writeEnd)
+{
+    DWORD tick = GetTickCount();
+    bool timedOut = ring.ingestStalled && tick - ring.stallTick >= BDP_PIN_TIMEOUT_MSEC;
+    bool overwritten = false;
+    for (size_t i = 0; i < connList.size() && ring.pinnedCount != 0; ++i) {
+        BDP_CONNECTION &conn = *connList[i];
+        if (conn.ringBufPinned != ~0ULL && IsRingChunkOverwritten(conn.ringBufPinned, ring.dataSize, writeEnd)) {
+            if (timedOut) {
+                UnpinRingBuf(conn, ring);
+                conn.lagExceeded = true;
+            }
+            else {
+                overwritten = true;
+            }
+        }
+    }
+    if (overwritten && !ring.ingestStalled) {
+        ring.stallTick = tick;
+    }
+    ring.ingestStalled = overwritten;
+    return overwritten;
+}
+
+// slotを位置とするすべての接続を方針に従わせる。readers[slot]が0でないときだけ呼ぶ
+void ApplyLagPolicyToSlot(DWORD slot, BDP_RING &ring, const BDP_CONNECTION_LIST &connList)
+{
+    for (size_t i = 0; i < connList.size() && ring.readers[slot] != 0; ++i) {
+        if (connList[i]->ringBufFront == slot) {
+            ApplyLagPolicy(*connList[i], ring);
+        }
+    }
+}
+
+// 未送信のバイト数が上限を超えた接続を方針に従わせて、次に調べるrearBytesを求めなおす
+void CheckLagBytes(BDP_RING &ring, const BDP_CONNECTION_LIST &connList)
+{
+    ring.lagCheckBytes = ~0ULL;
+    for (size_t i = 0; i < connList.size(); ++i) {
+        BDP_CONNECTION &conn = *connList[i];
+        if (conn.ringBufFront != MAXDWORD && conn.maxLagBytes != 0) {
+            if (conn.ringBufFront != ring.rear && ring.rearBytes - ring.byteSeq[conn.ringBufFront] > conn.maxLagBytes) {
+                // SetRingBufFront()がlagCheckBytesを更新する
+                ApplyLagPolicy(conn, ring);
+            }
+            else {
+                ring.lagCheckBytes = std::min(ring.lagCheckBytes, ring.byteSeq[conn.ringBufFront] + conn.maxLagBytes);
+            }
+        }
+    }
+}
+
+// 代理元のスレッドが新しい選局に切り替える(選局の完了と、その選局で取得したものを移すときの早いほうで呼ばれる)
+void AdoptTuneEpoch(BDP_RING &ring, DWORD epoch, LONGLONG tuneTime)
+{
+    if (static_cast<LONG>(epoch - ring.curEpoch) > 0) {
+        ring.curEpoch = epoch;
+        ring.tuneTime = tuneTime;
+        ring.tuneLatencyUsec = MAXDWORD;
+    }
+}
+
+// 取得スレッドやほかの接続を待たせないよう、遅れた接続はリングバッファに追い越させる
+void ReadCaptureToRingBuffer(BDP_CAPTURE &cap, BDP_RING &ring, const BDP_CONNECTION_LIST &connList)
+{
+    DWORD head = cap.head.load(std::memory_order_relaxed);
+    DWORD tail = cap.tail.load(std::memory_order_acquire);
+    if (head == tail) {
+        return;
+    }
+    for (; head != tail; ++head) {
+        // 選局の完了を知る前に新しい選局のものが届くことがある
+        AdoptTuneEpoch(ring, cap.queueEpoch[head % BDP_CAPTURE_QUEUE_NUM], cap.queueTuneTime[head % BDP_CAPTURE_QUEUE_NUM]);
+        if (cap.queueEpoch[head % BDP_CAPTURE_QUEUE_NUM] != ring.curEpoch) {
+            // 選局前に取得したものは捨てる
+            cap.head.store(head + 1, std::memory_order_release);
+            continue;
+        }
+        const BDP_RING_BUFFER &item = cap.queue[head % BDP_CAPTURE_QUEUE_NUM];
+        // 2重にマップしていなければ末尾をまたがないように先頭から書き込む
+        ULONGLONG writePos = PlaceRingChunk(ring.writePos, ring.dataSize, ring.dataMirrored, item.bufCount);
+        // 書き込みで上書きされるものは先に方針に従わせる。古いスロットほど先に上書きされる
+        AdvanceRingOldest(ring);
+        while (ring.oldest != ring.rear && IsRingChunkOverwritten(ring.pos[ring.oldest], ring.dataSize, writePos + item.bufCount)) {
+            ApplyLagPolicyToSlot(ring.oldest, ring, connList);
+            AdvanceRingOldest(ring);
+        }
+        if (ring.pinnedCount != 0 && IsPinnedChunkOverwritten(ring, connList, writePos + item.bufCount)) {
+            // 参照中のものを解放するまで取得スレッドに溜めさせる
+            break;
+        }
+        WriteSharedRingChunk(ring.writeEnd, ring.slot[ring.rear], ring.data, ring.dataSize, writePos, item.buf, item.bufCount);
+        ring.pos[ring.rear] = writePos;
+        ring.writePos = GetNextRingWritePos(writePos, item.bufCount);
+        ring.captureTime[ring.rear] = cap.queueTime[head % BDP_CAPTURE_QUEUE_NUM];
+        ring.epoch[ring.rear] = ring.curEpoch;
+        ring.purge[ring.rear] = cap.queuePurge[head % BDP_CAPTURE_QUEUE_NUM];
+        if (ring.tuneLatencyUsec == MAXDWORD && ring.tuneTime != 0) {
+            // 選局後の最初のチャンク
+            LONGLONG elapsed = ring.captureTime[ring.rear] - ring.tuneTime;
+            ULONGLONG usec = elapsed > 0 && ring.perfFreq > 0 ? static_cast<ULONGLONG>(elapsed) * 1000000 / ring.perfFreq : 0;
+            ring.tuneLatencyUsec = static_cast<DWORD>(std::min<ULONGLONG>(usec, MAXDWORD - 1));
+        }
+        ++ring.ingestChunks;
+        ring.ingestBytes += item.bufCount - 4;
+        cap.head.store(head + 1, std::memory_order_release);
+        CommitRingRear(ring, item.bufCount - 4);
+        // 最長でmaxNumまでリングバッファを伸ばす
+        ExpandRingBuffer(ring);
+        // 伸ばせずに次で上書きされるもの(上と同じく最も古いスロットから調べる)
+        if (ring.oldest != ring.rear && ring.oldest == ring.next[ring.rear]) {
+            ApplyLagPolicyToSlot(ring.oldest, ring, connList);
+        }
+        // 未送信のバイト数が上限を超えたもの(超えうるときだけ調べる)
+        if (ring.rearBytes > ring.lagCheckBytes) {
+            CheckLagBytes(ring, connList);
+        }
+        AdvanceRingOldest(ring);
+        if (ring.oldest != ring.rear) {
+            // 書き込み先の分を加えて、最も遅れた接続のために必要なスロットの数
+            ring.peakUsed = std::max<DWORD>(ring.peakUsed, GetRingDistance(ring, ring.oldest) + 1);
+        }
+        AdvanceRingRear(ring);
+    }
+    // 期間中に必要だった数より十分に多ければ縮める。伸ばすのは必要になったとき
+    DWORD tick = GetTickCount();
+    if (tick - ring.shrinkWindowTick >= ring.shrinkWindowMsec) {
+        DWORD keep = std::max<DWORD>(ring.peakUsed + ring.peakUsed / 4 + 1, 2);
+        while (ring.num > keep && ShrinkRingBuffer(ring));
+        ring.shrinkWindowTick = tick;
+        ring.peakUsed = 0;
+    }
+}
+
+// 選局前と、通し番号がpurgeSeqのPurgの前に取得したスロットを読み飛ばした位置(チャンクは選局順、Purg順に並んでいる)
+DWORD SkipStaleChunks(DWORD front, const BDP_RING &ring, DWORD purgeSeq)
+{
+    while (front != ring.rear && (ring.epoch[front] != ring.curEpoch || static_cast<LONG>(ring.purge[front] - purgeSeq) < 0)) {
+        front = ring.next[front];
+    }
+    return front;
+}
+
+void ReleasePushSent(BDP_CONNECTION &conn, DWORD n, BDP_RING &ring)
+{
+    n = std::min(n, conn.pushSentCount);
+    conn.pushSentHead = (conn.pushSentHead + n) % BDP_PUSH_CREDIT_MAX;
+    conn.pushSentCount -= n;
+    // 解放されていない最古のものより後ろを上書きさせない
+    SetRingBufFront(conn, conn.pushSentCount != 0 ? conn.pushSent[conn.pushSentHead] : conn.pushCursor, ring);
+}
+
+DWORD GetReadyRingBufferCount(const BDP_CONNECTION &conn, const BDP_RING &ring)
+{
+    if (conn.ringBufFront == MAXDWORD) {
+        return 0;
+    }
+    // 選局前とPurg前のものと参照中のものは数えない
+    DWORD front = SkipStaleChunks(conn.ringBufFront, ring, conn.purgeSeq);
+    if (front == ring.rear) {
+        return 0;
+    }
+    return GetRingDistance(ring, front) - (conn.ringBufHeld && front == conn.ringBufFront ? 1 : 0);
+}
+
+// すべての接続の統計をまとめる
+void SnapshotStat(std::vector<BYTE> &stat, const BDP_CONNECTION_LIST &connList, const BDP_RING &ring, const BDP_CAPTURE &cap)
+{
+    BDP_STAT_HEADER header = {};
+    header.headerSize = sizeof(header);
+    header.connSize = sizeof(BDP_STAT_CONNECTION);
+    header.ringNum = ring.num;
+    header.ringMax = ring.maxNum;
+    header.expandCount = ring.expandEvents;
+    header.shrinkCount = ring.shrinkEvents;
+    header.ingestChunks = ring.ingestChunks;
+    header.ingestBytes = ring.ingestBytes;
+    header.dropBytes = cap.dropCount;
+    header.tuneLatencyUsec = ring.tuneLatencyUsec;
+    header.chunkBytes = cap.chunkBytes;
+    header.resyncBytes = cap.resyncBytes;
+    header.chunkCount = cap.chunkCount;
+    stat.assign(sizeof(header), 0);
+    for (size_t i = 0; i < connList.size(); ++i) {
+        const BDP_CONNECTION &conn = *connList[i];
+        if (conn.state >= BDP_ST_CONNECTED) {
+            BDP_STAT_CONNECTION sc = {};
+            sc.index = static_cast<DWORD>(i);
+            sc.state = conn.state;
+            sc.priority = conn.priority;
+            sc.flags = (conn.doneOpenTuner ? BDP_STAT_FLAG_OPEN_TUNER : 0) |
+                       (conn.framed ? BDP_STAT_FLAG_FRAMED : 0) |
+                       (conn.pushOwner ? BDP_STAT_FLAG_PUSH : 0) |
+                       (conn.pushOwner && conn.pushShared ? BDP_STAT_FLAG_SHARED : 0) |
+                       (conn.pidFilter ? BDP_STAT_FLAG_PID_FILTER : 0);
+            if (conn.pushCursor != MAXDWORD) {
+                sc.lag = GetRingDistance(ring, conn.pushCursor);
+            }
+            else {
+                sc.lag = GetReadyRingBufferCount(conn, ring);
+            }
+            sc.maxLag = conn.statMaxLag;
+            sc.chunks = conn.statChunks;
+            sc.dropCount = conn.dropCount;
+            sc.bytes = conn.statBytes;
+            memcpy(sc.latencyHist, conn.statLatencyHist, sizeof(sc.latencyHist));
+            sc.dropBytes = conn.dropBytes;
+            const BYTE *p = reinterpret_cast<const BYTE*>(&sc);
+            stat.insert(stat.end(), p, p + sizeof(sc));
+            ++header.connNum;
+        }
+    }
+    memcpy(stat.data(), &header, sizeof(header));
+}
+
+void ResetConnection(BDP_CONNECTION &conn, BDP_RING &ring)
+{
+    conn.doneOpenTuner = false;
+    conn.priority = 0;
+    SetRingBufFront(conn, MAXDWORD, ring);
+    conn.ringBufHeld = false;
+    UnpinRingBuf(conn, ring);
+    conn.id = 0;
+    conn.pushOwner = nullptr;
+    conn.pushCursor = MAXDWORD;
+    conn.pushCredits = 0;
+    conn.pushSentCount = 0;
+    conn.pool = nullptr;
+    conn.framed = false;
+    conn.pidFilter = false;
+    conn.maxLagBytes = 0;
+    conn.lagPolicy = BDP_LAG_POLICY_SKIP;
+    conn.lagExceeded = false;
+    conn.purgeSeq = ring.curPurge;
+    conn.dropCount = 0;
+    conn.dropBytes = 0;
+    if (conn.hDataEvent) {
+        CloseHandle(conn.hDataEvent);
+        conn.hDataEvent = nullptr;
+    }
+    conn.dataEventArmed = false;
+    conn.cmdCount = 0;
+    conn.cmdPos = MAXDWORD;
+    conn.driverDone = false;
+    conn.driverSerial = false;
+    conn.bulkData = nullptr;
+    conn.bulkSize = 0;
+    conn.statBytes = 0;
+    conn.statChunks = 0;
+    conn.statMaxLag = 0;
+    memset(conn.statLatencyHist, 0, sizeof(conn.statLatencyHist));
+    conn.bufCount = 0;
+}
+
+bool AppendTableString(std::vector<BYTE> &table, LPCWSTR str)
+{
+    // 文字数の上限はETun等の応答と同じ
+    size_t len = str ? std::min<size_t>(wcslen(str), 254) : 0;
+    if (table.size() + (len + 1) * sizeof(WCHAR) > BDP_CHANNEL_TABLE_MAX) {
+        return false;
+    }
+    const BYTE *p = reinterpret_cast<const BYTE*>(str);
+    table.insert(table.end(), p, p + len * sizeof(WCHAR));
+    table.insert(table.end(), sizeof(WCHAR), 0);
+    return true;
+}
+
+// チューナ名とすべてのチューニング空間、チャンネル名をまとめる
+// 形式は[完全なら1][チューナ名]{[空間名]{[チャンネル名]}[空]}[空]で、文字列はNUL終端
+void SnapshotChannelTable(IBonDriver2 *bon2, std::vector<BYTE> &table)
+{
+    table.assign(4, 0);
+    if (AppendTableString(table, bon2->GetTunerName())) {
+        for (DWORD space = 0;; ++space) {
+            LPCWSTR tuningSpace = bon2->EnumTuningSpace(space);
+            if (!tuningSpace || !tuningSpace[0]) {
+                if (AppendTableString(table, nullptr)) {
+                    table[0] = 1;
+                }
+                break;
+            }
+            if (!AppendTableString(table, tuningSpace)) {
+                break;
+            }
+            bool full = false;
+            for (DWORD ch = 0;; ++ch) {
+                LPCWSTR channelName = bon2->EnumChannelName(space, ch);
+                if (!channelName || !channelName[0]) {
+                    full = !AppendTableString(table, nullptr);
+                    break;
+                }
+                if (!AppendTableString(table, channelName)) {
+                    full = true;
+                    break;
+                }
+            }
+            if (full) {
+                break;
+            }
+        }
+    }
+}
+
+// BonDriverを読み込んで作成する(ドライバのスレッドで呼ぶ)
+void CreateBonDriverOnDriver(BDP_BON_DRIVER &driver, BDP_PRELOAD &preload)
+{
+    // 先読みしていれば終わるのを待つ
+    driver.hLib = TakePreloadedLibrary(preload);
+    if (driver.hLib) {
+        const STRUCT_IBONDRIVER *(*funcCreateBonStruct)() = reinterpret_cast<const STRUCT_IBONDRIVER*(*)()>(GetProcAddress(driver.hLib, "CreateBonStruct"));
+        if (funcCreateBonStruct) {
+            // 特定コンパイラに依存しないI/Fを使う
+            const STRUCT_IBONDRIVER *st = funcCreateBonStruct();
+            if (st) {
+                if (driver.bon3Adapter.Adapt(*st)) {
+                    driver.bon = driver.bon2 = driver.bon3 = &driver.bon3Adapter;
+                }
+                else if (driver.bon2Adapter.Adapt(*st)) {
+                    driver.bon = driver.bon2 = &driver.bon2Adapter;
+                }
+                else {
+                    driver.bonAdapter.Adapt(*st);
+                    driver.bon = &driver.bonAdapter;
+                }
+            }
+        }
+#ifdef _MSC_VER
+        else {
+            IBonDriver *(*funcCreateBonDriver)() = reinterpret_cast<IBonDriver*(*)()>(GetProcAddress(driver.hLib, "CreateBonDriver"));
+            if (funcCreateBonDriver) {
+                driver.bon = funcCreateBonDriver();
+                if (driver.bon) {
+                    driver.bon2 = dynamic_cast<IBonDriver2*>(driver.bon);
+                    if (driver.bon2) {
+                        driver.bon3 = dynamic_cast<IBonDriver3*>(driver.bon2);
+                    }
+                }
+            }
+        }
+#endif
+    }
+    if (driver.bon2) {
+        SnapshotChannelTable(driver.bon2, driver.channelTable);
+    }
+    driver.totalDeviceNum = driver.bon3 ? driver.bon3->GetTotalDeviceNum() : 0;
+}
+
+// 依頼されたものを呼ぶ(ドライバのスレッドで呼ぶ)
+void CallOnDriver(BDP_DRIVER_THREAD &drv, const BDP_DRIVER_JOB &job)
+{
+    BDP_BON_DRIVER &driver = *drv.driver;
+    BDP_DRIVER_RESULT &r = *job.result;
+    switch (job.call) {
+    case BDP_CALL_CREATE:
+        CreateBonDriverOnDriver(driver, *drv.preload);
+        drv.initChSet = false;
+        break;
+    case BDP_CALL_RELEASE:
+        if (driver.bon) {
+            driver.bon->Release();
+            driver.bon = nullptr;
+            driver.bon2 = nullptr;
+            driver.bon3 = nullptr;
+        }
+        if (driver.hLib) {
+            FreeLibrary(driver.hLib);
+            driver.hLib = nullptr;
+        }
+        break;
+    case BDP_CALL_OPEN_TUNER:
+        OpenTunerOnDriver(r, drv, driver.bon, driver.bon2);
+        drv.initChSet = false;
+        break;
+    case BDP_CALL_CLOSE_TUNER:
+        CloseTunerOnDriver(drv, driver.bon);
+        break;
+    case BDP_CALL_SET_CHANNEL:
+        SetDriverChannel(r, drv, driver.bon, *drv.cap, static_cast<BYTE>(job.param1));
+        break;
+    case BDP_CALL_SET_CHANNEL2:
+        SetDriverChannel(r, drv, driver.bon2, *drv.cap, drv.initChSet, job.param1, job.param2);
+        if (r.tuned) {
+            drv.initChSet = true;
+        }
+        break;
+    case BDP_CALL_SET_LNB_POWER:
+        r.b = driver.bon3->SetLnbPower(static_cast<BOOL>(job.param1));
+        break;
+    case BDP_CALL_GET_ACTIVE_DEVICE_NUM:
+        r.n = driver.bon3->GetActiveDeviceNum();
+        break;
+    case BDP_CALL_GET_TUNER_NAME:
+        SetDriverString(r, driver.bon2->GetTunerName());
+        break;
+    case BDP_CALL_IS_TUNER_OPENING:
+        r.b = driver.bon2->IsTunerOpening();
+        break;
+    case BDP_CALL_ENUM_TUNING_SPACE:
+        SetDriverString(r, driver.bon2->EnumTuningSpace(job.param1));
+        break;
+    case BDP_CALL_ENUM_CHANNEL_NAME:
+        SetDriverString(r, driver.bon2->EnumChannelName(job.param1, job.param2));
+        break;
+    case BDP_CALL_GET_CUR_SPACE:
+        r.n = driver.bon2->GetCurSpace();
+        break;
+    case BDP_CALL_GET_CUR_CHANNEL:
+        r.n = driver.bon2->GetCurChannel();
+        break;
+    case BDP_CALL_GET_SIGNAL_LEVEL:
+        r.f = driver.bon->GetSignalLevel();
+        break;
+    case BDP_CALL_PURGE_TS_STREAM: {
+        CBlockLock lock(&drv.cap->lock);
+        driver.bon->PurgeTsStream();
+        drv.cap->purged = true;
+        break;
+    }
+    }
+}
+
+struct BDP_HOST;
+
+// このプロセスで代理する代理元。membersが空でなければデバイスプールで、接続を構成員に振り分ける
+struct BDP_HOSTED_ORIGIN {
+    BDP_HOST *host;
+    WCHAR origin[MAX_PATH];
+    std::vector<BDP_HOSTED_ORIGIN*> members;
+    // 以下はデバイスプールでないとき有効
+    // 所属するデバイスプール(なければnullptr)
+    const BDP_HOSTED_ORIGIN *pool;
+    // 接続しているクライアントの数(デバイスプールが振り分けて、まだ受け入れていないものを含む)
+    std::atomic<DWORD> load;
+    // デバイスプールから渡されたパイプ。aliveでなくなれば渡せない
+    CRITICAL_SECTION adoptLock;
+    std::vector<HANDLE> adoptPipes;
+    std::atomic<bool> alive;
+    HANDLE hAdoptEvent;
+    HANDLE hThread;
+};
+
+// プロセス全体で共有する状態
+struct BDP_HOST {
+    WCHAR iniPath[MAX_PATH + 64];
+    // すべての代理元の接続数と、接続がなくなってもBonDriverを保持している代理元の数。最初の接続後に
+    // どちらも0になればhExitEventをセットして全体を終了する
+    std::atomic<DWORD> connectedCount;
+    std::atomic<DWORD> lingerCount;
+    HANDLE hExitEvent;
+};
+
+void AddHostConnection(BDP_HOSTED_ORIGIN &hosted)
+{
+    ++hosted.load;
+    ++hosted.host->connectedCount;
+}
+
+void RemoveHostConnection(BDP_HOSTED_ORIGIN &hosted)
+{
+    --hosted.load;
+    if (--hosted.host->connectedCount == 0 && hosted.host->lingerCount == 0) {
+        SetEvent(hosted.host->hExitEvent);
+    }
+}
+
+void EndHostLinger(BDP_HOST &host)
+{
+    if (--host.lingerCount == 0 && host.connectedCount == 0) {
+        SetEvent(host.hExitEvent);
+    }
+}
+
+// デバイスプールの構成員のうち使用中のものの数
+DWORD GetActivePoolMemberNum(const BDP_HOSTED_ORIGIN &pool)
+{
+    DWORD n = 0;
+    for (size_t i = 0; i < pool.members.size(); ++i) {
+        if (pool.members[i]->load != 0) {
+            ++n;
+        }
+    }
+    return n;
+}
+
+// 接続数の最も少ない(0なら空いている)構成員にパイプを渡す
+bool HandOverToPoolMember(const BDP_HOSTED_ORIGIN &pool, HANDLE hPipe)
+{
+    for (;;) {
+        BDP_HOSTED_ORIGIN *member = nullptr;
+        for (size_t i = 0; i < pool.members.size(); ++i) {
+            if (pool.members[i]->alive && (!member || pool.members[i]->load < member->load)) {
+                member = pool.members[i];
+            }
+        }
+        if (!member) {
+            return false;
+        }
+        CBlockLock lock(&member->adoptLock);
+        if (member->alive) {
+            member->adoptPipes.push_back(hPipe);
+            AddHostConnection(*member);
+            SetEvent(member->hAdoptEvent);
+            return true;
+        }
+    }
+}
+
+void CreatePipeName(WCHAR (&pipeName)[MAX_PATH + 64], LPCWSTR origin)
+{
+    wcscpy_s(pipeName, L"\\\\.\\pipe\\BonDriverLocalProxy_");
+    wcscat_s(pipeName, origin);
+}
+
+// デバイスプールへの接続を受け付けて構成員に渡す
+void RunPool(BDP_HOSTED_ORIGIN &pool)
+{
+    HANDLE hConnectEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+    if (!hConnectEvent) {
+        return;
+    }
+    WCHAR pipeName[MAX_PATH + 64];
+    CreatePipeName(pipeName, pool.origin);
+    HANDLE hReadyEvent = nullptr;
+    bool firstInstance = true;
+    for (;;) {
+        HANDLE hPipe = CreateNamedPipe(pipeName, PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | (firstInstance ? FILE_FLAG_FIRST_PIPE_INSTANCE : 0),
+                                       0, PIPE_UNLIMITED_INSTANCES, TSDATASIZE + 256, 256, 0, nullptr);
+        if (hPipe == INVALID_HANDLE_VALUE && firstInstance) {
+            // ほかのプロセスが代理している
+            break;
+        }
+        if (firstInstance) {
+            hReadyEvent = CreateReadyEvent(pool.origin);
+            if (hReadyEvent) {
+                SetEvent(hReadyEvent);
+            }
+        }
+        firstInstance = false;
+        bool connected = false;
+        if (hPipe != INVALID_HANDLE_VALUE) {
+            OVERLAPPED ol = {};
+            ol.hEvent = hConnectEvent;
+            ResetEvent(hConnectEvent);
+            if (ConnectNamedPipe(hPipe, &ol)) {
+                connected = true;
+            }
+            else {
+                DWORD err = GetLastError();
+                if (err == ERROR_PIPE_CONNECTED) {
+                    connected = true;
+                }
+                else if (err == ERROR_IO_PENDING) {
+                    HANDLE hWaitList[] = { hConnectEvent, pool.host->hExitEvent };
+                    DWORD xferred;
+                    if (WaitForMultipleObjects(2, hWaitList, FALSE, INFINITE) != WAIT_OBJECT_0) {
+                        CancelIo(hPipe);
+                        GetOverlappedResult(hPipe, &ol, &xferred, TRUE);
+                        CloseHandle(hPipe);
+                        break;
+                    }
+                    connected = GetOverlappedResult(hPipe, &ol, &xferred, FALSE) != FALSE;
+                }
+            }
+            if (connected && HandOverToPoolMember(pool, hPipe)) {
+                continue;
+            }
+            CloseHandle(hPipe);
+        }
+        // 失敗時の高負荷を防ぐため、少し待って再試行する
+        if (WaitForSingleObject(pool.host->hExitEvent, connected ? 0 : 1) == WAIT_OBJECT_0) {
+            break;
+        }
+    }
+    CloseReadyEvent(hReadyEvent);
+    CloseHandle(hConnectEvent);
+}
+
+void RunOrigin(BDP_HOSTED_ORIGIN &hosted);
+
+unsigned int __stdcall HostedOriginThread(void *param)
+{
+    BDP_HOSTED_ORIGIN &hosted = *static_cast<BDP_HOSTED_ORIGIN*>(param);
+    if (!hosted.members.empty()) {
+        RunPool(hosted);
+        return 0;
+    }
+    RunOrigin(hosted);
+    // 受け入れられなかった接続を閉じる
+    std::vector<HANDLE> pipes;
+    {
+        CBlockLock lock(&hosted.adoptLock);
+        hosted.alive = false;
+        pipes.swap(hosted.adoptPipes);
+    }
+    for (size_t i = 0; i < pipes.size(); ++i) {
+        CloseHandle(pipes[i]);
+        RemoveHostConnection(hosted);
+    }
+    return 0;
+}
+
+void RunOrigin(BDP_HOSTED_ORIGIN &hosted)
+{
+    LPCWSTR origin = hosted.origin;
+    LPCWSTR iniPath = hosted.host->iniPath;
+
+    // リングバッファの実体はクライアントが直接読めるように共有メモリに置く
+    // チャンクの実体は少なくとも最大のものが2つ収まる大きさにする
+    DWORD ringDataSize = std::min(GetSettingInt(iniPath, origin, L"RingBufferBytes", BDP_RING_BUFFER_BYTES), BDP_RING_BUFFER_BYTES_MAX);
+    ringDataSize = std::max<DWORD>(ringDataSize, sizeof(BDP_RING_BUFFER) * 2);
+    ringDataSize = (ringDataSize + BDP_MAP_GRANULARITY - 1) / BDP_MAP_GRANULARITY * BDP_MAP_GRANULARITY;
+    DWORD ringBufNum = ringDataSize / BDP_RING_SLOT_MIN_BYTES;
+    DWORD ringDataOffset = GetSharedRingDataOffset(ringBufNum);
+    SIZE_T ringViewSize = static_cast<SIZE_T>(ringDataOffset) + ringDataSize;
+    WCHAR ringName[MAX_PATH + 64];
+    swprintf_s(ringName, sizeof(ringName) / sizeof(ringName[0]), L"BonDriverLocalProxy_%ls_%lu", origin, GetCurrentProcessId());
+    HANDLE hRingMap = CreateSharedMap(ringName, ringViewSize);
+    if (!hRingMap) {
+        return;
+    }
+    size_t ringMappedSize;
+    BYTE *ringView = MapSharedView(hRingMap, true, ringMappedSize);
+    if (!ringView) {
+        CloseSharedMap(hRingMap);
+        return;
+    }
+    InitSharedRingHeader(ringView, ringBufNum, ringDataOffset, ringDataSize);
+    BDP_SHARED_RING_HEADER &ringHeader = *reinterpret_cast<BDP_SHARED_RING_HEADER*>(ringView);
+    BDP_RING_SLOT *ringSlot = GetSharedRingSlots(ringView);
+    // できればチャンクの実体を2重にマップして、末尾をまたぐものも連続して読み書きできるようにする
+    BYTE *ringMirror = MapMirroredView(hRingMap, ringDataOffset, ringDataSize, true);
+    if (GetSettingInt(iniPath, origin, L"LockRingBuffer", 0)) {
+        // ページアウトされないようにする(失敗しても続ける)
+        SIZE_T minSize;
+        SIZE_T maxSize;
+        if (GetProcessWorkingSetSize(GetCurrentProcess(), &minSize, &maxSize)) {
+            SetProcessWorkingSetSize(GetCurrentProcess(), minSize + ringViewSize, maxSize + ringViewSize);
+        }
+        if (!VirtualLock(ringView, ringViewSize)) {
+            OutputDebugString(L"BonDriverLocalProxy: VirtualLock() failed\n");
+        }
+    }
+
+    std::unique_ptr<BDP_RING> ring(new BDP_RING);
+    InitRingBuffer(*ring, ringSlot, &ringHeader.writeEnd, ringBufNum, ringMirror ? ringMirror : ringView + ringDataOffset, ringDataSize, ringMirror != nullptr,
+                   GetSettingInt(iniPath, origin, L"ShrinkWindowMsec", BDP_SHRINK_WINDOW_MSEC));
+    std::unique_ptr<BDP_CAPTURE> cap(new BDP_CAPTURE);
+    cap->hThread = nullptr;
+    cap->hStopEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+    cap->hEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+    // 接続待ちのパイプは常に1つだけで、このイベントで待つ
+    HANDLE hConnectEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+    // シグナルレベル等はドライバのスレッドが定期的にこの共有メモリに書き込み、クライアントはそれを読む
+    DWORD statusIntervalMsec = GetSettingInt(iniPath, origin, L"StatusIntervalMsec", BDP_STATUS_INTERVAL_MSEC);
+    WCHAR statusName[MAX_PATH + 96];
+    swprintf_s(statusName, L"%ls_Status", ringName);
+    HANDLE hStatusMap = nullptr;
+    BDP_SHARED_STATUS *status = nullptr;
+    if (statusIntervalMsec != 0) {
+        hStatusMap = CreateFileMapping(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, sizeof(BDP_SHARED_STATUS), statusName);
+        if (hStatusMap) {
+            status = static_cast<BDP_SHARED_STATUS*>(MapViewOfFile(hStatusMap, FILE_MAP_WRITE, 0, 0, 0));
+            if (status) {
+                status->intervalMsec = statusIntervalMsec;
+                status->curSpace = MAXDWORD;
+                status->curChannel = MAXDWORD;
+            }
+            else {
+                CloseHandle(hStatusMap);
+                hStatusMap = nullptr;
+            }
+        }
+    }
+    // 最初のパイプを作れなければほかのプロセスが代理しているので、BonDriverを読み込む前に確かめる
+    WCHAR pipeName[MAX_PATH + 64];
+    CreatePipeName(pipeName, origin);
+    HANDLE hFirstPipe = CreateNamedPipe(pipeName, PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+                                        0, PIPE_UNLIMITED_INSTANCES, TSDATASIZE + 256, 256, 0, nullptr);
+    // BonDriverの作成や選局などはこのスレッドで呼ぶ
+    std::unique_ptr<BDP_DRIVER_THREAD> drv(new BDP_DRIVER_THREAD);
+    if (hFirstPipe == INVALID_HANDLE_VALUE || !StartDriverThread(*drv, status, statusIntervalMsec) || !cap->hStopEvent || !cap->hEvent || !hConnectEvent) {
+        StopDriverThread(*drv);
+        if (hFirstPipe != INVALID_HANDLE_VALUE) {
+            CloseHandle(hFirstPipe);
+        }
+        if (status) {
+            UnmapViewOfFile(status);
+            CloseHandle(hStatusMap);
+        }
+        if (cap->hStopEvent) {
+            CloseHandle(cap->hStopEvent);
+        }
+        if (cap->hEvent) {
+            CloseHandle(cap->hEvent);
+        }
+        if (hConnectEvent) {
+            CloseHandle(hConnectEvent);
+        }
+        if (ringMirror) {
+            UnmapMirroredView(ringMirror, ringDataSize);
+        }
+        UnmapSharedView(ringView, ringMappedSize);
+        CloseSharedMap(hRingMap);
+        return;
+    }
+    // 最初のCreaを待たずに、接続を待つのと並行してBonDriverを読み込んでおく
+    BDP_PRELOAD preload = {};
+    if (GetBonDriverPath(preload.libPath, origin) && GetSettingInt(iniPath, origin, L"PreloadBonDriver", 1)) {
+        preload.hThread = reinterpret_cast<HANDLE>(_beginthreadex(nullptr, 0, PreloadThread, &preload, 0, nullptr));
+    }
+    HANDLE hReadyEvent = nullptr;
+    cap->head = 0;
+    cap->tail = 0;
+    cap->dropCount = 0;
+    cap->epoch = 0;
+    cap->tuneTime = 0;
+    cap->purgeSeq = 0;
+    cap->maxHoldMsec = GetSettingInt(iniPath, origin, L"MaxHoldMsec", BDP_MAX_HOLD_MSEC);
+    // 接続ごとにSLagで変更できる
+    DWORD defaultMaxLagBytes = GetSettingInt(iniPath, origin, L"MaxLagBytes", 0);
+    DWORD defaultLagPolicy = GetSettingInt(iniPath, origin, L"LagPolicy", BDP_LAG_POLICY_SKIP);
+    // 最後の接続が切断されても、この期間はBonDriverを(LingerKeepTunerならチューナも)保持して再接続に備える
+    DWORD lingerMsec = GetSettingInt(iniPath, origin, L"LingerMsec", 0);
+    bool lingerKeepTuner = lingerMsec != 0 && GetSettingInt(iniPath, origin, L"LingerKeepTuner", 0) != 0;
+    // 誰も開いていないチューナを開いたままにしているか、誰も接続していないBonDriverを保持しているか
+    bool tunerLingering = false;
+    bool driverLingering = false;
+    DWORD lingerTick = 0;
+    InitializeCriticalSection(&cap->lock);
+    // ドライバのスレッドが作成を完了すれば、以下のbon等にdriverの内容を複写する
+    std::unique_ptr<BDP_BON_DRIVER> driver(new BDP_BON_DRIVER);
+    driver->hLib = nullptr;
+    driver->bon = nullptr;
+    driver->bon2 = nullptr;
+    driver->bon3 = nullptr;
+    driver->totalDeviceNum = 0;
+    drv->driver = driver.get();
+    drv->cap = cap.get();
+    drv->preload = &preload;
+    IBonDriver *bon = nullptr;
+    IBonDriver2 *bon2 = nullptr;
+    IBonDriver3 *bon3 = nullptr;
+    bool doneCreateBon = false;
+    BOOL openTunerResult = FALSE;
+    DWORD nextConnId = 1;
+    DWORD nextDataEventId = 0;
+    // ドライバのスレッドに依頼中のチューナの状態を変える呼び出しがあるか
+    bool driverBusy = false;
+    // GActの結果はしばらく使いまわす(開閉すれば取得しなおす)
+    DWORD activeDeviceNum = 0;
+    DWORD activeDeviceTick = 0;
+    bool activeDeviceCached = false;
+    DWORD activeDeviceCacheMsec = statusIntervalMsec != 0 ? statusIntervalMsec : BDP_STATUS_INTERVAL_MSEC;
+    BDP_COMMAND_TABLE cmdTable;
+    InitCommandTable(cmdTable);
+    BDP_CONNECTION_LIST connList;
+    BDP_CONNECTION *listener = nullptr;
+    // I/Oが完了するなどして処理を進めるべき接続
+    BDP_CONN_QUEUE readyQueue = {};
+    // 配信するものがなくて待っているプッシュ配信用の接続
+    BDP_CONN_QUEUE dataWaitQueue = {};
+    // TnWtで選局後の最初のチャンクを待っている接続(待ちはじめた順)
+    BDP_CONN_QUEUE tuneWaitQueue = {};
+    // 依頼中のチューナの状態を変える呼び出しが完了するのを待っている接続
+    BDP_CONN_QUEUE driverWaitQueue = {};
+    // 切断されて再利用を待つ接続
+    BDP_CONN_QUEUE idleQueue = {};
+    // デバイスプールから渡されたパイプを閉じて再利用を待つ接続
+    BDP_CONN_QUEUE adoptIdleQueue = {};
+
+    auto createConnection = [&]() -> BDP_CONNECTION & {
+        std::unique_ptr<BDP_CONNECTION> conn(new BDP_CONNECTION);
+        conn->hPipe = INVALID_HANDLE_VALUE;
+        conn->state = BDP_ST_IDLE;
+        conn->readyQueue = &readyQueue;
+        conn->queued = false;
+        conn->ringBufFront = MAXDWORD;
+        conn->ringBufPinned = ~0ULL;
+        conn->hDataEvent = nullptr;
+        ResetConnection(*conn, *ring);
+        connList.push_back(std::move(conn));
+        return *connList.back();
+    };
+
+    // 接続数は数え終えていなければならない
+    auto startConnection = [&](BDP_CONNECTION &conn, const BDP_HOSTED_ORIGIN *pool) {
+        if (driverLingering) {
+            // 保持していたBonDriverをそのまま使う
+            driverLingering = false;
+            EndHostLinger(*hosted.host);
+        }
+        ResetConnection(conn, *ring);
+        conn.pool = pool;
+        conn.maxLagBytes = defaultMaxLagBytes;
+        conn.lagPolicy = std::min<DWORD>(defaultLagPolicy, BDP_LAG_POLICY_DISCONNECT);
+        conn.state = BDP_ST_CONNECTED;
+        PushQueue(readyQueue, conn);
+    };
+
+    auto closeTuner = [&](BDP_CONNECTION &conn) {
+        activeDeviceCached = false;
+        bool wasLingering = tunerLingering;
+        CloseTuner(conn, connList, *cap, *drv, lingerKeepTuner && openTunerResult ? &tunerLingering : nullptr);
+        if (tunerLingering && !wasLingering) {
+            lingerTick = GetTickCount();
+        }
+    };
+
+    auto disconnect = [&](BDP_CONNECTION &conn) {
+        closeTuner(conn);
+        conn.state = BDP_ST_IDLE;
+        if (lingerMsec == 0 || !doneCreateBon) {
+            CloseBonDriver(connList, *drv, &bon, &bon2, &bon3, &doneCreateBon);
+        }
+        else if (!driverLingering && !AnyConnected(connList)) {
+            // 再接続に備えて保持する(接続数が0になる前に数える)
+            driverLingering = true;
+            lingerTick = GetTickCount();
+            ++hosted.host->lingerCount;
+        }
+        DisconnectNamedPipe(conn.hPipe);
+        bool adopted = conn.pool != nullptr;
+        ResetConnection(conn, *ring);
+        if (adopted) {
+            CloseHandle(conn.hPipe);
+            conn.hPipe = INVALID_HANDLE_VALUE;
+            PushQueue(adoptIdleQueue, conn);
+        }
+        else {
+            PushQueue(idleQueue, conn);
+        }
+        RemoveHostConnection(hosted);
+        // 配信元を失ったものがあれば切断させる
+        while (BDP_CONNECTION *waiting = PopQueue(dataWaitQueue)) {
+            PushQueue(readyQueue, *waiting);
+        }
+    };
+
+    // ドライバのスレッドでcallを呼ぶ。完了していればtrueを返し、結果はconn.driverResultにある
+    // そうでなければ接続を待機させてfalseを返す。依頼はドライバのスレッドで順に呼ばれる
+    // serialがtrueのチューナの状態を変える呼び出しは一度に1つだけ依頼し、ほかは完了を待って再評価させる
+    auto callDriver = [&](BDP_CONNECTION &conn, BDP_DRIVER_CALL call, DWORD param1, DWORD param2, bool serial) -> bool {
+        if (conn.driverDone) {
+            conn.driverDone = false;
+            return true;
+        }
+        conn.state = BDP_ST_DRIVER_WAIT;
+        if (serial && driverBusy) {
+            PushQueue(driverWaitQueue, conn);
+        }
+        else {
+            driverBusy = driverBusy || serial;
+            conn.driverSerial = serial;
+            PostDriverJob(*drv, call, param1, param2, &conn.driverResult, &conn);
+        }
+        return false;
+    };
+
+    // SCh2とTnWtの選局。実際に選局すれば以降に取得するものを新しい通し番号で区別する
+    auto setChannel2 = [&](BDP_CONNECTION &conn, DWORD space, DWORD ch) -> bool {
+        BDP_DRIVER_RESULT &r = conn.driverResult;
+        if (!IsHighestPriority(conn.priority, connList)) {
+            r.b = FALSE;
+            r.tuned = false;
+            return true;
+        }
+        if (!callDriver(conn, BDP_CALL_SET_CHANNEL2, space, ch, true)) {
+            return false;
+        }
+        if (r.tuned) {
+            AdoptTuneEpoch(*ring, r.epoch, r.tuneTime);
+        }
+        return true;
+    };
+
+    for (;;) {
+        // 取得スレッドが溜めたものをリングバッファに移す
+        DWORD lastRear = ring->rear;
+        ReadCaptureToRingBuffer(*cap, *ring, connList);
+        if (ring->rear != lastRear) {
+            while (BDP_CONNECTION *waiting = PopQueue(dataWaitQueue)) {
+                PushQueue(readyQueue, *waiting);
+            }
+            // 読み尽くして待っているクライアントに知らせる
+            for (size_t i = 0; i < connList.size(); ++i) {
+                if (connList[i]->dataEventArmed) {
+                    connList[i]->dataEventArmed = false;
+                    SetEvent(connList[i]->hDataEvent);
+                }
+            }
+        }
+
+        // TnWtで待っている接続に、最初のチャンクが届くか、ほかの選局に上書きされるか、時間切れになれば応答する
+        if (tuneWaitQueue.head) {
+            BDP_CONN_QUEUE waitQueue = tuneWaitQueue;
+            tuneWaitQueue = BDP_CONN_QUEUE();
+            while (BDP_CONNECTION *waiting = PopQueue(waitQueue)) {
+                BDP_CONNECTION &conn = *waiting;
+                bool superseded = conn.tuneWaitEpoch != ring->curEpoch;
+                if (!superseded && ring->tuneLatencyUsec == MAXDWORD && GetTickCount() - conn.tuneWaitTick < BDP_TUNE_WAIT_MSEC) {
+                    PushQueue(tuneWaitQueue, conn);
+                    continue;
+                }
+                BDP_TUNE_RESULT tune;
+                tune.result = TRUE;
+                tune.latencyUsec = superseded ? MAXDWORD : ring->tuneLatencyUsec;
+                AppendResult<BDP_CMD_TnWt>(conn, tune);
+                // TnWtはフレームの最後なので、保留していた応答と合わせて書き込む
+                if (conn.framed) {
+                    DWORD frameSize = conn.bufCount - 4;
+                    memcpy(conn.buf, &frameSize, 4);
+                }
+                if (WriteReply(conn)) {
+                    conn.state = BDP_ST_WRITING;
+                }
+                else {
+                    disconnect(conn);
+                }
+            }
+        }
+
+        // 処理を進めるべき接続だけを処理する
+        while (BDP_CONNECTION *ready = PopQueue(readyQueue)) {
+            BDP_CONNECTION &conn = *ready;
+            if (conn.state == BDP_ST_READING || conn.state == BDP_ST_WRITING) {
+                // 完了ルーチンが結果を格納している
+                if (conn.ioError != ERROR_SUCCESS) {
+                    disconnect(conn);
+                }
+                else if (conn.state == BDP_ST_READING) {
+                    conn.cmdCount += conn.ioXferred;
+                    DWORD cmdSize = GetCommandSize(conn);
+                    conn.state = cmdSize != 0 && conn.cmdCount >= cmdSize ? BDP_ST_READ : BDP_ST_CONNECTED;
+                    PushQueue(readyQueue, conn);
+                }
+                else if (conn.bufCount == conn.ioXferred) {
+                    conn.bufCount = 0;
+                    if (conn.bulkData) {
+                        // 続けて一括応答を書き込む
+                        const BYTE *data = conn.bulkData;
+                        conn.bulkData = nullptr;
+                        conn.bufCount = conn.bulkSize;
+                        if (!WriteReply(conn, data)) {
+                            disconnect(conn);
+                        }
+                    }
+                    else {
+                        conn.state = conn.pushCredits != 0 ? BDP_ST_PUSH_WAIT : BDP_ST_CONNECTED;
+                        PushQueue(readyQueue, conn);
+                    }
+                }
+                else {
+                    disconnect(conn);
+                }
+            }
+            else if (conn.state == BDP_ST_CONNECTED) {
+                DWORD cmdSize = GetCommandSize(conn);
+                if (cmdSize != 0 && conn.cmdCount >= cmdSize) {
+                    // 前回読んだ中に次のフレームがある
+                    conn.state = BDP_ST_READ;
+                    PushQueue(readyQueue, conn);
+                }
+                else if (ReadCommand(conn)) {
+                    conn.state = BDP_ST_READING;
+                }
+                else {
+                    disconnect(conn);
+                }
+            }
+            else if (conn.state == BDP_ST_READ) {
+                // v2ではフレーム内のコマンドを順に処理し、応答を1つのフレームにまとめて返す
+                bool framed = conn.framed;
+                DWORD cmdSize = GetCommandSize(conn);
+                if (conn.driverDone && conn.driverSerial) {
+                    // 依頼した呼び出しが完了したので、待っていた接続にも再評価させる
+                    conn.driverSerial = false;
+                    driverBusy = false;
+                    while (BDP_CONNECTION *waiting = PopQueue(driverWaitQueue)) {
+                        waiting->state = BDP_ST_READ;
+                        PushQueue(readyQueue, *waiting);
+                    }
+                }
+                // 途中のコマンドでドライバの呼び出しを待っていれば、そのコマンドから再開する
+                bool resumed = conn.cmdPos != MAXDWORD;
+                if (!resumed) {
+                    conn.bufCount = framed ? 4 : 0;
+                    conn.cmdPos = framed ? 4 : 0;
+                }
+                // 遅れすぎて切断すべきものはコマンドを処理しない
+                bool failed = conn.lagExceeded;
+                for (; !failed && conn.cmdPos + 12 <= cmdSize; conn.cmdPos += 12, resumed = false) {
+                    DWORD cmdPos = conn.cmdPos;
+                    union {
+                        BOOL b;
+                        DWORD n;
+                    } param1, param2;
+                    DWORD fourcc;
+                    memcpy(&fourcc, conn.cmdBuf + cmdPos, 4);
+                    memcpy(&param1, conn.cmdBuf + cmdPos + 4, 4);
+                    memcpy(&param2, conn.cmdBuf + cmdPos + 8, 4);
+                    DWORD lastBufCount = conn.bufCount;
+                    switch (FindCommand(cmdTable, fourcc)) {
+                    case BDP_CMD_Crea: {
+                        DWORD type = 0;
+                        // 再開したときは優先度を設定済み
+                        if (resumed || SetPriority(conn, param1.n, connList)) {
+                            if (!doneCreateBon) {
+                                if (!callDriver(conn, BDP_CALL_CREATE, 0, 0, true)) {
+                                    break;
+                                }
+                                doneCreateBon = true;
+                                bon = driver->bon;
+                                bon2 = driver->bon2;
+                                bon3 = driver->bon3;
+                            }
+                            type = bon3 ? 3 : bon2 ? 2 : bon ? 1 : 0;
+                            if (type != 0) {
+                                // 対応する機能を通知
+                                type |= (param2.n & (BDP_FEATURE_SHARED_RING | BDP_FEATURE_PUSH | BDP_FEATURE_FRAMED |
+                                                      BDP_FEATURE_CHANNEL_TABLE | BDP_FEATURE_PID_FILTER | BDP_FEATURE_LAG_POLICY |
+                                                      BDP_FEATURE_DATA_EVENT | BDP_FEATURE_TUNE_WAIT |
+                                                      (status ? BDP_FEATURE_STATUS_BLOCK : 0))) << 8;
+                            }
+                        }
+                        // この応答の次から
+                        conn.framed = (type & (BDP_FEATURE_FRAMED << 8)) != 0;
+                        AppendResult<BDP_CMD_Crea>(conn, type);
+                        break;
+                    }
+                    case BDP_CMD_GRng: {
+                        AppendResult<BDP_CMD_GRng>(conn, static_cast<LPCWSTR>(ringName));
+                        break;
+                    }
+                    case BDP_CMD_GEvt: {
+                        // イベントの名前を返す。以降はGTsS等が空を返したときに待機状態にする
+                        if (!conn.hDataEvent) {
+                            conn.dataEventId = nextDataEventId++;
+                        }
+                        WCHAR eventName[MAX_PATH + 96];
+                        swprintf_s(eventName, L"%ls_Data%lu", ringName, conn.dataEventId);
+                        if (!conn.hDataEvent) {
+                            conn.hDataEvent = CreateEvent(nullptr, FALSE, FALSE, eventName);
+                        }
+                        if (conn.hDataEvent) {
+                            conn.dataEventArmed = true;
+                        }
+                        AppendResult<BDP_CMD_GEvt>(conn, conn.hDataEvent ? static_cast<LPCWSTR>(eventName) : nullptr);
+                        break;
+                    }
+                    case BDP_CMD_GStb: {
+                        // 状態を書き込む共有メモリの名前を返す
+                        AppendResult<BDP_CMD_GStb>(conn, status ? static_cast<LPCWSTR>(statusName) : nullptr);
+                        break;
+                    }
+                    case BDP_CMD_GStm: {
+                        // プッシュ配信用の接続から参照するための識別子を返す
+                        if (conn.id == 0) {
+                            conn.id = nextConnId++;
+                            nextConnId += nextConnId == 0 ? 1 : 0;
+                        }
+                        AppendResult<BDP_CMD_GStm>(conn, conn.id);
+                        break;
+                    }
+                    case BDP_CMD_Strm: {
+                        // この接続をプッシュ配信用にする
+                        BOOL b = FALSE;
+                        if (!conn.pushOwner && param1.n != 0) {
+                            for (size_t i = 0; i < connList.size(); ++i) {
+                                if (connList[i]->state >= BDP_ST_CONNECTED && connList[i]->id == param1.n && !connList[i]->pushOwner) {
+                                    conn.pushOwner = connList[i].get();
+                                    conn.pushOwnerId = param1.n;
+                                    conn.pushShared = param2.b != FALSE;
+                                    b = TRUE;
+                                    break;
+                                }
+                            }
+                        }
+                        AppendResult<BDP_CMD_Strm>(conn, b);
+                        break;
+                    }
+                    case BDP_CMD_Subs: {
+                        // 第1引数は解放したもの、第2引数は追加で受け取れるものの数。応答はない
+                        if (bon && !framed && GetPushOwner(conn)) {
+                            if (conn.pushCursor == MAXDWORD) {
+                                // 使用開始
+                                conn.pushCursor = ring->rear;
+                            }
+                            ReleasePushSent(conn, param1.n, *ring);
+                            conn.pushCredits = std::min<DWORD>(conn.pushCredits + param2.n, BDP_PUSH_CREDIT_MAX - conn.pushSentCount);
+                            conn.state = BDP_ST_PUSH_WAIT;
+                        }
+                        break;
+                    }
+                    case BDP_CMD_FPid: {
+                        // 第1引数のPID(MAXDWORDはすべて)を送るかどうかを第2引数で指定する
+                        BOOL b = FALSE;
+                        if (param1.n == MAXDWORD) {
+                            memset(conn.pidMap, param2.b ? 0xFF : 0, sizeof(conn.pidMap));
+                            conn.pidFilter = !param2.b;
+                            b = TRUE;
+                        }
+                        else if (param1.n < 8192) {
+                            if (!conn.pidFilter) {
+                                memset(conn.pidMap, 0xFF, sizeof(conn.pidMap));
+                                conn.pidFilter = true;
+                            }
+                            if (param2.b) {
+                                conn.pidMap[param1.n >> 3] |= 1 << (param1.n & 7);
+                            }
+                            else {
+                                conn.pidMap[param1.n >> 3] &= ~(1 << (param1.n & 7));
+                            }
+                            b = TRUE;
+                        }
+                        AppendResult<BDP_CMD_FPid>(conn, b);
+                        break;
+                    }
+                    case BDP_CMD_SLag: {
+                        // 第1引数は未送信のバイト数の上限、第2引数は方針(それぞれMAXDWORDは変更しない)
+                        BOOL b = FALSE;
+                        if (param2.n == MAXDWORD || param2.n <= BDP_LAG_POLICY_DISCONNECT) {
+                            if (param1.n != MAXDWORD) {
+                                conn.maxLagBytes = param1.n;
+                                // 次のチャンクで調べなおす
+                                ring->lagCheckBytes = 0;
+                            }
+                            if (param2.n != MAXDWORD) {
+                                conn.lagPolicy = param2.n;
+                            }
+                            b = TRUE;
+                        }
+                        AppendResult<BDP_CMD_SLag>(conn, b);
+                        break;
+                    }
+                    case BDP_CMD_GDrp: {
+                        // 読み飛ばした回数と、続く8バイトでバイト数を返す(プッシュ配信用の接続の分も含む)
+                        BDP_DROP_RESULT drop;
+                        drop.count = conn.dropCount;
+                        drop.bytes = conn.dropBytes;
+                        for (size_t i = 0; i < connList.size(); ++i) {
+                            if (GetPushOwner(*connList[i]) == &conn) {
+                                drop.count += connList[i]->dropCount;
+                                drop.bytes += connList[i]->dropBytes;
+                            }
+                        }
+                        AppendResult<BDP_CMD_GDrp>(conn, drop);
+                        break;
+                    }
+                    case BDP_CMD_GTot: {
+                        if (conn.pool) {
+                            // デバイスプールの構成員の数
+                            DWORD n = static_cast<DWORD>(conn.pool->members.size());
+                            AppendResult<BDP_CMD_GTot>(conn, n);
+                        }
+                        else if (bon3) {
+                            AppendResult<BDP_CMD_GTot>(conn, driver->totalDeviceNum);
+                        }
+                        break;
+                    }
+                    case BDP_CMD_GAct: {
+                        if (conn.pool) {
+                            DWORD n = GetActivePoolMemberNum(*conn.pool);
+                            AppendResult<BDP_CMD_GAct>(conn, n);
+                        }
+                        else if (bon3) {
+                            if (!activeDeviceCached || GetTickCount() - activeDeviceTick >= activeDeviceCacheMsec) {
+                                if (!callDriver(conn, BDP_CALL_GET_ACTIVE_DEVICE_NUM, 0, 0, false)) {
+                                    break;
+                                }
+                                activeDeviceNum = conn.driverResult.n;
+                                activeDeviceTick = GetTickCount();
+                                activeDeviceCached = true;
+                            }
+                            AppendResult<BDP_CMD_GAct>(conn, activeDeviceNum);
+                        }
+                        break;
+                    }
+                    case BDP_CMD_SLnb: {
+                        if (bon3) {
+                            if (IsHighestPriority(conn.priority, connList)) {
+                                if (callDriver(conn, BDP_CALL_SET_LNB_POWER, param1.n, 0, true)) {
+                                    AppendResult<BDP_CMD_SLnb>(conn, conn.driverResult.b);
+                                }
+                            }
+                            else {
+                                BOOL b = FALSE;
+                                AppendResult<BDP_CMD_SLnb>(conn, b);
+                            }
+                        }
+                        break;
+                    }
+                    case BDP_CMD_GTun: {
+                        if (bon2) {
+                            if (callDriver(conn, BDP_CALL_GET_TUNER_NAME, 0, 0, false)) {
+                                AppendResult<BDP_CMD_GTun>(conn, GetDriverString(conn.driverResult));
+                            }
+                        }
+                        break;
+                    }
+                    case BDP_CMD_GTbl: {
+                        // 応答はバッファを介さずに書き込むため、フレームの最後でなければならない
+                        if (bon2 && cmdPos + 12 == cmdSize) {
+                            DWORD n = static_cast<DWORD>(driver->channelTable.size());
+                            if (AppendResult<BDP_CMD_GTbl>(conn, n)) {
+                                conn.bulkData = driver->channelTable.data();
+                                conn.bulkSize = n;
+                            }
+                        }
+                        break;
+                    }
+                    case BDP_CMD_Stat: {
+                        // すべての接続の統計を返す。GTblと同じくフレームの最後でなければならない
+                        if (cmdPos + 12 == cmdSize) {
+                            SnapshotStat(conn.bulkBuf, connList, *ring, *cap);
+                            DWORD n = static_cast<DWORD>(conn.bulkBuf.size());
+                            if (AppendResult<BDP_CMD_Stat>(conn, n)) {
+                                conn.bulkData = conn.bulkBuf.data();
+                                conn.bulkSize = n;
+                            }
+                        }
+                        break;
+                    }
+                    case BDP_CMD_ITun: {
+                        if (bon2) {
+                            // 書き込まれた状態があればドライバのスレッドを待たない
+                            BDP_SHARED_STATUS st;
+                            if (ReadSharedStatus(status, st)) {
+                                AppendResult<BDP_CMD_ITun>(conn, st.tunerOpening);
+                            }
+                            else {
+                                if (callDriver(conn, BDP_CALL_IS_TUNER_OPENING, 0, 0, false)) {
+                                    AppendResult<BDP_CMD_ITun>(conn, conn.driverResult.b);
+                                }
+                            }
+                        }
+                        break;
+                    }
+                    case BDP_CMD_ETun: {
+                        if (bon2) {
+                            if (callDriver(conn, BDP_CALL_ENUM_TUNING_SPACE, param1.n, 0, false)) {
+                                AppendResult<BDP_CMD_ETun>(conn, GetDriverString(conn.driverResult));
+                            }
+                        }
+                        break;
+                    }
+                    case BDP_CMD_ECha: {
+                        if (bon2) {
+                            if (callDriver(conn, BDP_CALL_ENUM_CHANNEL_NAME, param1.n, param2.n, false)) {
+                                AppendResult<BDP_CMD_ECha>(conn, GetDriverString(conn.driverResult));
+                            }
+                        }
+                        break;
+                    }
+                    case BDP_CMD_SCh2: {
+                        if (bon2 && setChannel2(conn, param1.n, param2.n)) {
+                            AppendResult<BDP_CMD_SCh2>(conn, conn.driverResult.b);
+                        }
+                        break;
+                    }
+                    case BDP_CMD_TnWt: {
+                        // SCh2と同じく選局し、新しい選局で最初のチャンクが届くまで応答を保留する。フレームの最後でなければならない
+                        if (bon2 && cmdPos + 12 == cmdSize && setChannel2(conn, param1.n, param2.n)) {
+                            BDP_TUNE_RESULT tune;
+                            tune.result = conn.driverResult.b;
+                            if (conn.driverResult.tuned) {
+                                conn.tuneWaitEpoch = conn.driverResult.epoch;
+                                conn.tuneWaitTick = GetTickCount();
+                                conn.state = BDP_ST_TUNE_WAIT;
+                            }
+                            else {
+                                // 選局済みなら待たない
+                                tune.latencyUsec = tune.result ? 0 : MAXDWORD;
+                                AppendResult<BDP_CMD_TnWt>(conn, tune);
+                            }
+                        }
+                        break;
+                    }
+                    case BDP_CMD_GCSp: {
+                        if (bon2) {
+                            BDP_SHARED_STATUS st;
+                            if (ReadSharedStatus(status, st)) {
+                                AppendResult<BDP_CMD_GCSp>(conn, st.curSpace);
+                            }
+                            else {
+                                if (callDriver(conn, BDP_CALL_GET_CUR_SPACE, 0, 0, false)) {
+                                    AppendResult<BDP_CMD_GCSp>(conn, conn.driverResult.n);
+                                }
+                            }
+                        }
+                        break;
+                    }
+                    case BDP_CMD_GCCh: {
+                        if (bon2) {
+                            BDP_SHARED_STATUS st;
+                            if (ReadSharedStatus(status, st)) {
+                                AppendResult<BDP_CMD_GCCh>(conn, st.curChannel);
+                            }
+                            else {
+                                if (callDriver(conn, BDP_CALL_GET_CUR_CHANNEL, 0, 0, false)) {
+                                    AppendResult<BDP_CMD_GCCh>(conn, conn.driverResult.n);
+                                }
+                            }
+                        }
+                        break;
+                    }
+                    case BDP_CMD_Open: {
+                        if (bon) {
+                            if (!conn.doneOpenTuner) {
+                                if (tunerLingering) {
+                                    // 開いたままのチューナをそのまま使う
+                                    tunerLingering = false;
+                                }
+                                else if (!AnyDoneOpenTuner(connList)) {
+                                    if (!callDriver(conn, BDP_CALL_OPEN_TUNER, 0, 0, true)) {
+                                        break;
+                                    }
+                                    openTunerResult = conn.driverResult.b;
+                                    activeDeviceCached = false;
+                                    if (openTunerResult) {
+                                        // 以降はクライアントの要求とは無関係にドライバから取得する
+                                        StartCapture(*cap, bon);
+                                    }
+                                }
+                                conn.doneOpenTuner = true;
+                            }
+                            AppendResult<BDP_CMD_Open>(conn, openTunerResult);
+                        }
+                        break;
+                    }
+                    case BDP_CMD_Clos: {
+                        if (bon) {
+                            closeTuner(conn);
+                            DWORD n = 0;
+                            AppendResult<BDP_CMD_Clos>(conn, n);
+                        }
+                        break;
+                    }
+                    case BDP_CMD_SCha: {
+                        if (bon) {
+                            BOOL b = FALSE;
+                            if (IsHighestPriority(conn.priority, connList)) {
+                                if (!callDriver(conn, BDP_CALL_SET_CHANNEL, param1.n, 0, true)) {
+                                    break;
+                                }
+                                b = conn.driverResult.b;
+                                if (conn.driverResult.tuned) {
+                                    AdoptTuneEpoch(*ring, conn.driverResult.epoch, conn.driverResult.tuneTime);
+                                }
+                            }
+                            AppendResult<BDP_CMD_SCha>(conn, b);
+                        }
+                        break;
+                    }
+                    case BDP_CMD_GSig: {
+                        if (bon) {
+                            BDP_SHARED_STATUS st;
+                            if (ReadSharedStatus(status, st)) {
+                                AppendResult<BDP_CMD_GSig>(conn, st.signalLevel);
+                            }
+                            else {
+                                if (callDriver(conn, BDP_CALL_GET_SIGNAL_LEVEL, 0, 0, false)) {
+                                    AppendResult<BDP_CMD_GSig>(conn, conn.driverResult.f);
+                                }
+                            }
+                        }
+                        break;
+                    }
+                    case BDP_CMD_GRea: {
+                        if (bon) {
+                            // この接続がまだ受け取っていないチャンクの数
+                            DWORD n = GetReadyRingBufferCount(conn, *ring);
+                            AppendResult<BDP_CMD_GRea>(conn, n);
+                        }
+                        break;
+                    }
+                    case BDP_CMD_GTsS:
+                    case BDP_CMD_GTsP: {
+                        if (bon) {
+                            // GTsPはデータの代わりに共有メモリ上のスロット番号を返す
+                            bool shared = fourcc == BDP_COMMAND_TRAITS<BDP_CMD_GTsP>::FOURCC;
+                            UnpinRingBuf(conn, *ring);
+                            if (conn.ringBufFront == MAXDWORD) {
+                                // 使用開始
+                                SetRingBufFront(conn, ring->rear, *ring);
+                            }
+                            else if (conn.ringBufHeld) {
+                                // 前回参照させたものを解放
+                                SetRingBufFront(conn, ring->next[conn.ringBufFront], *ring);
+                            }
+                            conn.ringBufHeld = false;
+                            // 選局やPurgをまたいで混ざらないようにする
+                            SetRingBufFront(conn, SkipStaleChunks(conn.ringBufFront, *ring, conn.purgeSeq), *ring);
+                            conn.dataEventArmed = conn.hDataEvent && conn.ringBufFront == ring->rear;
+                            if (conn.ringBufFront != ring->rear) {
+                                if (shared) {
+                                    // 次のコマンドまで上書きされないように位置を保持する
+                                    conn.ringBufHeld = true;
+                                    if (AppendResult<BDP_CMD_GTsP>(conn, conn.ringBufFront)) {
+                                        RecordChunkSent(conn, conn.ringBufFront, ring->slot[conn.ringBufFront].bufCount - 4, *ring);
+                                    }
+                                }
+                                else {
+                                    AppendChunk(conn, conn, conn.ringBufFront, *ring);
+                                    SetRingBufFront(conn, ring->next[conn.ringBufFront], *ring);
+                                }
+                            }
+                            else if (shared) {
+                                DWORD n = MAXDWORD;
+                                AppendResult<BDP_CMD_GTsP>(conn, n);
+                            }
+                            else {
+                                DWORD n = 4;
+                                DWORD remain = 0;
+                                AppendReply(conn, &n, &remain, 4);
+                            }
+                        }
+                        break;
+                    }
+                    case BDP_CMD_Purg: {
+                        if (bon) {
+                            bool highest = IsHighestPriority(conn.priority, connList);
+                            if (highest && !cap->hThread && !callDriver(conn, BDP_CALL_PURGE_TS_STREAM, 0, 0, false)) {
+                                break;
+                            }
+                            // 取得スレッドのキュー等に残っているものも含めて、これより前に取得しはじめたものは送らない
+                            conn.purgeSeq = ++ring->curPurge;
+                            cap->purgeSeq = ring->curPurge;
+                            if (highest && cap->hThread) {
+                                // 選局中でも待たないよう、取得スレッドに任せる
+                                cap->purgeRequested = true;
+                            }
+                            if (conn.ringBufFront != MAXDWORD) {
+                                SetRingBufFront(conn, ring->rear, *ring);
+                                conn.ringBufHeld = false;
+                            }
+                            UnpinRingBuf(conn, *ring);
+                            conn.dataEventArmed = conn.hDataEvent != nullptr;
+                            // プッシュ配信中のものも読み飛ばす
+                            for (size_t i = 0; i < connList.size(); ++i) {
+                                if (connList[i]->pushCursor != MAXDWORD && GetPushOwner(*connList[i]) == &conn) {
+                                    connList[i]->pushCursor = ring->rear;
+                                    ReleasePushSent(*connList[i], 0, *ring);
+                                }
+                            }
+                            DWORD n = 0;
+                            AppendResult<BDP_CMD_Purg>(conn, n);
+                        }
+                        break;
+                    }
+                    default:
+                        // Rele等の未知のコマンドには応答しない
+                        break;
+                    }
+                    if (conn.state == BDP_ST_DRIVER_WAIT) {
+                        break;
+                    }
+                    // 再評価で呼び出しが不要になった結果は捨てる
+                    conn.driverDone = false;
+                    // 応答がなければ失敗
+                    failed = conn.bufCount == lastBufCount && conn.state != BDP_ST_PUSH_WAIT && conn.state != BDP_ST_TUNE_WAIT;
+                }
+                if (conn.state == BDP_ST_DRIVER_WAIT) {
+                    // 完了ルーチンがreadyQueueに戻す
+                    continue;
+                }
+                conn.cmdPos = MAXDWORD;
+                conn.driverDone = false;
+                // 処理したフレームを取り除く
+                conn.cmdCount -= cmdSize;
+                memmove(conn.cmdBuf, conn.cmdBuf + cmdSize, conn.cmdCount);
+                if (!failed && conn.state != BDP_ST_PUSH_WAIT && conn.state != BDP_ST_TUNE_WAIT) {
+                    if (framed) {
+                        DWORD frameSize = conn.bufCount - 4 + (conn.bulkData ? conn.bulkSize : 0);
+                        memcpy(conn.buf, &frameSize, 4);
+                    }
+                    if (WriteReply(conn)) {
+                        conn.state = BDP_ST_WRITING;
+                    }
+                    else {
+                        failed = true;
+                    }
+                }
+                if (failed) {
+                    disconnect(conn);
+                }
+                else if (conn.state == BDP_ST_PUSH_WAIT) {
+                    PushQueue(readyQueue, conn);
+                }
+                else if (conn.state == BDP_ST_TUNE_WAIT) {
+                    PushQueue(tuneWaitQueue, conn);
+                }
+            }
+            else if (conn.state == BDP_ST_PUSH_WAIT) {
+                const BDP_CONNECTION *owner = GetPushOwner(conn);
+                if (bon && owner && !conn.lagExceeded) {
+                    // 選局や配信元のPurgをまたいで混ざらないようにする
+                    DWORD cursor = SkipStaleChunks(conn.pushCursor, *ring, owner->purgeSeq);
+                    if (cursor != conn.pushCursor) {
+                        conn.pushCursor = cursor;
+                        ReleasePushSent(conn, 0, *ring);
+                    }
+                    if (conn.pushCredits == 0) {
+                        // 次のSubsを待つ
+                        conn.state = BDP_ST_CONNECTED;
+                        PushQueue(readyQueue, conn);
+                    }
+                    else if (conn.pushCursor != ring->rear) {
+                        conn.bufCount = 0;
+                        if (conn.pushShared) {
+                            AppendReply(conn, &conn.pushCursor);
+                            RecordChunkSent(conn, conn.pushCursor, ring->slot[conn.pushCursor].bufCount - 4, *ring);
+                        }
+                        else {
+                            // フィルタは配信元の接続のもの
+                            AppendChunk(conn, *owner, conn.pushCursor, *ring);
+                        }
+                        // クライアントが解放するまで保持する
+                        conn.pushSent[(conn.pushSentHead + conn.pushSentCount++) % BDP_PUSH_CREDIT_MAX] = conn.pushCursor;
+                        conn.pushCursor = ring->next[conn.pushCursor];
+                        --conn.pushCredits;
+                        ReleasePushSent(conn, 0, *ring);
+                        if (WriteReply(conn)) {
+                            conn.state = BDP_ST_WRITING;
+                        }
+                        else {
+                            disconnect(conn);
+                        }
+                    }
+                    else {
+                        // リングバッファに追加されるまで待つ
+                        PushQueue(dataWaitQueue, conn);
+                    }
+                }
+                else {
+                    disconnect(conn);
+                }
+            }
+        }
+
+        if ((tunerLingering || driverLingering) && GetTickCount() - lingerTick >= lingerMsec) {
+            // 再接続されなかった
+            if (tunerLingering) {
+                tunerLingering = false;
+                StopCapture(*cap);
+                RunDriverJob(*drv, BDP_CALL_CLOSE_TUNER);
+            }
+            if (driverLingering) {
+                driverLingering = false;
+                CloseBonDriver(connList, *drv, &bon, &bon2, &bon3, &doneCreateBon);
+                EndHostLinger(*hosted.host);
+            }
+        }
+
+        if (WaitForSingleObject(hosted.host->hExitEvent, 0) == WAIT_OBJECT_0) {
+            // どの代理元にも誰も接続していないので終了
+            break;
+        }
+
+        if (!listener) {
+            // 接続待ちのパイプを用意する(切断されたものがあれば再利用する)
+            listener = PopQueue(idleQueue);
+            if (!listener) {
+                // 最初のパイプは作成済みのものを使う
+                HANDLE hPipe = hFirstPipe;
+                hFirstPipe = INVALID_HANDLE_VALUE;
+                if (hPipe == INVALID_HANDLE_VALUE) {
+                    hPipe = CreateNamedPipe(pipeName, PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED,
+                                            0, PIPE_UNLIMITED_INSTANCES, TSDATASIZE + 256, 256, 0, nullptr);
+                }
+                if (hPipe != INVALID_HANDLE_VALUE) {
+                    if (connList.empty()) {
+                        hReadyEvent = CreateReadyEvent(origin);
+                        if (hReadyEvent) {
+                            SetEvent(hReadyEvent);
+                        }
+                    }
+                    listener = &createConnection();
+                    listener->hPipe = hPipe;
+                }
+                else if (connList.empty()) {
+                    break;
+                }
+            }
+        }
+        bool connected = false;
+        if (listener && listener->state == BDP_ST_IDLE) {
+            OVERLAPPED olZero = {};
+            listener->ol = olZero;
+            listener->ol.hEvent = hConnectEvent;
+            ResetEvent(hConnectEvent);
+            if (ConnectNamedPipe(listener->hPipe, &listener->ol)) {
+                connected = true;
+            }
+            else {
+                DWORD err = GetLastError();
+                if (err == ERROR_PIPE_CONNECTED) {
+                    connected = true;
+                }
+                else if (err == ERROR_IO_PENDING) {
+                    listener->state = BDP_ST_CONNECTING;
+                }
+            }
+        }
+
+        if (!connected) {
+            // 失敗時の高負荷を防ぐため、接続待ちできていなければ少し待って再試行する
+            DWORD timeout = listener && listener->state == BDP_ST_CONNECTING ? INFINITE : 1;
+            if (tunerLingering || driverLingering) {
+                // 保持の期限まで
+                DWORD lingerElapsed = GetTickCount() - lingerTick;
+                timeout = std::min(timeout, lingerElapsed < lingerMsec ? lingerMsec - lingerElapsed : 0);
+            }
+            if (tuneWaitQueue.head) {
+                // 最も古いTnWtの期限まで
+                DWORD tuneWaitElapsed = GetTickCount() - tuneWaitQueue.head->tuneWaitTick;
+                timeout = std::min(timeout, tuneWaitElapsed < BDP_TUNE_WAIT_MSEC ? BDP_TUNE_WAIT_MSEC - tuneWaitElapsed : 0);
+            }
+            if (ring->ingestStalled) {
+                // 参照中のチャンクを解放させる期限まで
+                DWORD stallElapsed = GetTickCount() - ring->stallTick;
+                timeout = std::min(timeout, stallElapsed < BDP_PIN_TIMEOUT_MSEC ? BDP_PIN_TIMEOUT_MSEC - stallElapsed : 0);
+            }
+            HANDLE hWaitList[] = { hConnectEvent, cap->hEvent, hosted.host->hExitEvent, hosted.hAdoptEvent };
+            DWORD ret = MsgWaitForMultipleObjectsEx(4, hWaitList, timeout, QS_ALLINPUT, MWMO_ALERTABLE);
+            if (ret == WAIT_OBJECT_0) {
+                DWORD xferred;
+                if (listener && listener->state == BDP_ST_CONNECTING) {
+                    if (GetOverlappedResult(listener->hPipe, &listener->ol, &xferred, FALSE)) {
+                        connected = true;
+                    }
+                    else {
+                        DisconnectNamedPipe(listener->hPipe);
+                        listener->state = BDP_ST_IDLE;
+                    }
+                }
+            }
+            else if (ret == WAIT_OBJECT_0 + 1) {
+                // 次のループの先頭でリングバッファに移す
+            }
+            else if (ret == WAIT_OBJECT_0 + 2) {
+                // 次のループの先頭で終了する
+            }
+            else if (ret == WAIT_OBJECT_0 + 3) {
+                // デバイスプールから渡された接続を受け入れる(接続数は渡したときに数えている)
+                std::vector<HANDLE> pipes;
+                {
+                    CBlockLock lock(&hosted.adoptLock);
+                    pipes.swap(hosted.adoptPipes);
+                }
+                for (size_t i = 0; i < pipes.size(); ++i) {
+                    BDP_CONNECTION *conn = PopQueue(adoptIdleQueue);
+                    if (!conn) {
+                        conn = &createConnection();
+                    }
+                    conn->hPipe = pipes[i];
+                    startConnection(*conn, hosted.pool);
+                }
+            }
+            else if (ret == WAIT_OBJECT_0 + 4) {
+                MSG msg;
+                while (PeekMessage(&msg, nullptr, 0, 0, PM_REMOVE)) {
+                    TranslateMessage(&msg);
+                    DispatchMessage(&msg);
+                }
+            }
+            else if (ret == WAIT_IO_COMPLETION || ret == WAIT_TIMEOUT) {
+                // 完了ルーチンがreadyQueueに追加している
+            }
+            else {
+                Sleep(1);
+            }
+        }
+        if (connected) {
+            AddHostConnection(hosted);
+            startConnection(*listener, nullptr);
+            listener = nullptr;
+        }
+    }
+
+    for (size_t i = 0; i < connList.size(); ++i) {
+        if (connList[i]->hPipe != INVALID_HANDLE_VALUE) {
+            CloseHandle(connList[i]->hPipe);
+        }
+    }
+    if (tunerLingering) {
+        StopCapture(*cap);
+        RunDriverJob(*drv, BDP_CALL_CLOSE_TUNER);
+    }
+    if (driverLingering) {
+        CloseBonDriver(connList, *drv, &bon, &bon2, &bon3, &doneCreateBon);
+    }
+    // 依頼済みのものを呼び終えてから、先読みしたものを片付ける
+    StopDriverThread(*drv);
+    if (status) {
+        UnmapViewOfFile(status);
+        CloseHandle(hStatusMap);
+    }
+    if (hFirstPipe != INVALID_HANDLE_VALUE) {
+        CloseHandle(hFirstPipe);
+    }
+    CloseHandle(hConnectEvent);
+    CloseReadyEvent(hReadyEvent);
+    if (preload.hThread) {
+        // 使われなかった
+        HMODULE hPreloaded = TakePreloadedLibrary(preload);
+        if (hPreloaded) {
+            FreeLibrary(hPreloaded);
+        }
+    }
+    StopCapture(*cap);
+    CloseHandle(cap->hStopEvent);
+    CloseHandle(cap->hEvent);
+    DeleteCriticalSection(&cap->lock);
+    if (ringMirror) {
+        UnmapMirroredView(ringMirror, ringDataSize);
+    }
+    UnmapSharedView(ringView, ringMappedSize);
+    CloseSharedMap(hRingMap);
+}
+}
+
+#ifdef __MINGW32__
+__declspec(dllexport) // ASLRを無効にしないため(CVE-2018-5392)
+int APIENTRY WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine, int nCmdShow)
+#else
+int APIENTRY wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPWSTR lpCmdLine, int nCmdShow)
+#endif
+{
+    static_cast<void>(hInstance);
+    static_cast<void>(hPrevInstance);
+    static_cast<void>(lpCmdLine);
+    static_cast<void>(nCmdShow);
+    SetDllDirectory(L"");
+
+    WCHAR origin[MAX_PATH] = {};
+    {
+        int argc;
+        LPWSTR *argv = CommandLineToArgvW(GetCommandLine(), &argc);
+        if (argv) {
+            if (argc >= 2 && wcslen(argv[1]) < MAX_PATH) {
+                wcscpy_s(origin, argv[1]);
+            }
+            LocalFree(argv);
+        }
+    }
+    if (!origin[0]) {
+        return 0;
+    }
+
+    WCHAR iniPath[MAX_PATH + 64] = {};
+    {
+        DWORD len = GetModuleFileName(nullptr, iniPath, MAX_PATH);
+        if (len && len < MAX_PATH && wcsrchr(iniPath, L'.')) {
+            wcscpy_s(wcsrchr(iniPath, L'.'), 5, L".ini");
+        }
+        else {
+            iniPath[0] = L'\0';
+        }
+    }
+
+    std::unique_ptr<BDP_HOST> host(new BDP_HOST);
+    wcscpy_s(host->iniPath, iniPath);
+    host->connectedCount = 0;
+    host->lingerCount = 0;
+    host->hExitEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+    if (!host->hExitEvent) {
+        return 0;
+    }
+
+    // 代理する代理元を列挙する。HostOriginsに挙げたものは同じプロセスで代理する
+    std::vector<std::unique_ptr<BDP_HOSTED_ORIGIN>> hostedList;
+    auto addHosted = [&](LPCWSTR name) -> BDP_HOSTED_ORIGIN * {
+        for (size_t i = 0; i < hostedList.size(); ++i) {
+            if (_wcsicmp(hostedList[i]->origin, name) == 0) {
+                return hostedList[i].get();
+            }
+        }
+        if (!name[0] || wcslen(name) >= MAX_PATH || hostedList.size() >= BDP_HOSTED_MAX) {
+            return nullptr;
+        }
+        std::unique_ptr<BDP_HOSTED_ORIGIN> hosted(new BDP_HOSTED_ORIGIN);
+        hosted->host = host.get();
+        wcscpy_s(hosted->origin, name);
+        hosted->pool = nullptr;
+        hosted->load = 0;
+        hosted->alive = true;
+        hosted->hAdoptEvent = nullptr;
+        hosted->hThread = nullptr;
+        hostedList.push_back(std::move(hosted));
+        return hostedList.back().get();
+    };
+    addHosted(origin);
+    if (iniPath[0]) {
+        WCHAR list[4096];
+        WCHAR defaultList[4096];
+        GetPrivateProfileString(L"Default", L"HostOrigins", L"", defaultList, 4096, iniPath);
+        GetPrivateProfileString(origin, L"HostOrigins", defaultList, list, 4096, iniPath);
+        WCHAR *context;
+        for (WCHAR *name = wcstok_s(list, L", ", &context); name; name = wcstok_s(nullptr, L", ", &context)) {
+            addHosted(name);
+        }
+        // PoolDevicesがあればデバイスプールで、構成員も代理する
+        for (size_t i = 0; i < hostedList.size(); ++i) {
+            BDP_HOSTED_ORIGIN *pool = hostedList[i].get();
+            GetPrivateProfileString(pool->origin, L"PoolDevices", L"", list, 4096, iniPath);
+            for (WCHAR *name = wcstok_s(list, L", ", &context); name; name = wcstok_s(nullptr, L", ", &context)) {
+                BDP_HOSTED_ORIGIN *member = addHosted(name);
+                // 構成員は1つのデバイスプールにだけ属する
+                if (member && member != pool && !member->pool && member->members.empty() && !pool->pool) {
+                    member->pool = pool;
+                    pool->members.push_back(member);
+                }
+            }
+        }
+    }
+
+    std::vector<HANDLE> threads;
+    for (size_t i = 0; i < hostedList.size(); ++i) {
+        BDP_HOSTED_ORIGIN &hosted = *hostedList[i];
+        InitializeCriticalSection(&hosted.adoptLock);
+        hosted.hAdoptEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+        if (hosted.hAdoptEvent) {
+            hosted.hThread = reinterpret_cast<HANDLE>(_beginthreadex(nullptr, 0, HostedOriginThread, &hosted, 0, nullptr));
+        }
+        if (hosted.hThread) {
+            threads.push_back(hosted.hThread);
+        }
+        else {
+            hosted.alive = false;
+        }
+    }
+    if (!threads.empty()) {
+        WaitForMultipleObjects(static_cast<DWORD>(threads.size()), threads.data(), TRUE, INFINITE);
+    }
+    for (size_t i = 0; i < hostedList.size(); ++i) {
+        BDP_HOSTED_ORIGIN &hosted = *hostedList[i];
+        if (hosted.hThread) {
+            CloseHandle(hosted.hThread);
+        }
+        if (hosted.hAdoptEvent) {
+            CloseHandle(hosted.hAdoptEvent);
+        }
+        DeleteCriticalSection(&hosted.adoptLock);
+    }
+    CloseHandle(host->hExitEvent);
+    return 0;
+}
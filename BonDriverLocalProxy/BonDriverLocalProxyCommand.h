@@ -0,0 +1,110 @@
+﻿#pragma once
+
+// BonDriverLocalProxyとBonDriver_Proxyの間のコマンドの定義(両方からインクルードする)
+
+#include <string.h>
+
+// 引数や応答がないことを表す
+struct BDP_NONE {};
+// 応答がDWORDの文字数(最大255)とそれに続くWCHAR列であることを表す
+struct BDP_STRING {};
+// 応答がDWORDのバイト数とそれに続くデータであることを表す(データは個別に読み書きする)
+struct BDP_BULK {};
+
+// GDrpの応答(続く8バイトでバイト数を返す)
+struct BDP_DROP_RESULT {
+    DWORD count;
+    ULONGLONG bytes;
+};
+
+// TnWtの応答(続く4バイトで選局から最初のチャンクを取得するまでのマイクロ秒を返す。届かなければMAXDWORD)
+struct BDP_TUNE_RESULT {
+    BOOL result;
+    DWORD latencyUsec;
+};
+
+// X(名前, 第1引数, 第2引数, 応答)の並び。名前はそのままFourCCになる
+#define BDP_COMMAND_LIST(X) \
+    X(Crea, DWORD, DWORD, DWORD) \
+    X(GRng, BDP_NONE, BDP_NONE, BDP_STRING) \
+    X(GEvt, BDP_NONE, BDP_NONE, BDP_STRING) \
+    X(GStb, BDP_NONE, BDP_NONE, BDP_STRING) \
+    X(GStm, BDP_NONE, BDP_NONE, DWORD) \
+    X(Strm, DWORD, BOOL, BOOL) \
+    X(Subs, DWORD, DWORD, BDP_NONE) \
+    X(FPid, DWORD, BOOL, BOOL) \
+    X(SLag, DWORD, DWORD, BOOL) \
+    X(GDrp, BDP_NONE, BDP_NONE, BDP_DROP_RESULT) \
+    X(GTot, BDP_NONE, BDP_NONE, DWORD) \
+    X(GAct, BDP_NONE, BDP_NONE, DWORD) \
+    X(SLnb, BOOL, BDP_NONE, BOOL) \
+    X(GTun, BDP_NONE, BDP_NONE, BDP_STRING) \
+    X(GTbl, BDP_NONE, BDP_NONE, BDP_BULK) \
+    X(Stat, BDP_NONE, BDP_NONE, BDP_BULK) \
+    X(ITun, BDP_NONE, BDP_NONE, BOOL) \
+    X(ETun, DWORD, BDP_NONE, BDP_STRING) \
+    X(ECha, DWORD, DWORD, BDP_STRING) \
+    X(SCh2, DWORD, DWORD, BOOL) \
+    X(TnWt, DWORD, DWORD, BDP_TUNE_RESULT) \
+    X(GCSp, BDP_NONE, BDP_NONE, DWORD) \
+    X(GCCh, BDP_NONE, BDP_NONE, DWORD) \
+    X(Open, BDP_NONE, BDP_NONE, BOOL) \
+    X(Clos, BDP_NONE, BDP_NONE, DWORD) \
+    X(SCha, DWORD, BDP_NONE, BOOL) \
+    X(GSig, BDP_NONE, BDP_NONE, float) \
+    X(GRea, BDP_NONE, BDP_NONE, DWORD) \
+    X(GTsS, BDP_NONE, BDP_NONE, BDP_BULK) \
+    X(GTsP, BDP_NONE, BDP_NONE, DWORD) \
+    X(Purg, BDP_NONE, BDP_NONE, DWORD) \
+    X(Rele, BDP_NONE, BDP_NONE, DWORD)
+
+// コマンドの通し番号
+enum BDP_COMMAND {
+#define BDP_COMMAND_ENUM(name, p1, p2, r) BDP_CMD_##name,
+    BDP_COMMAND_LIST(BDP_COMMAND_ENUM)
+#undef BDP_COMMAND_ENUM
+    BDP_COMMAND_NUM
+};
+
+constexpr DWORD BdpFourCC(const char (&s)[5])
+{
+    return static_cast<BYTE>(s[0]) | static_cast<BYTE>(s[1]) << 8 | static_cast<BYTE>(s[2]) << 16 | static_cast<DWORD>(static_cast<BYTE>(s[3])) << 24;
+}
+
+// 通し番号から引くFourCC
+const DWORD BDP_COMMAND_FOURCC[BDP_COMMAND_NUM] = {
+#define BDP_COMMAND_FOURCC_ELEM(name, p1, p2, r) BdpFourCC(#name),
+    BDP_COMMAND_LIST(BDP_COMMAND_FOURCC_ELEM)
+#undef BDP_COMMAND_FOURCC_ELEM
+};
+
+// 応答をクライアントとサーバでそれぞれどの型で扱うか
+template<class R> struct BDP_RESULT_TYPE { typedef R Client; typedef R Server; };
+template<> struct BDP_RESULT_TYPE<BDP_STRING> { typedef WCHAR Client[256]; typedef LPCWSTR Server; };
+template<> struct BDP_RESULT_TYPE<BDP_BULK> { typedef DWORD Client; typedef DWORD Server; };
+
+template<BDP_COMMAND Cmd> struct BDP_COMMAND_TRAITS;
+#define BDP_COMMAND_TRAITS_DEF(name, p1, p2, r) \
+    template<> struct BDP_COMMAND_TRAITS<BDP_CMD_##name> { \
+        static const DWORD FOURCC = BdpFourCC(#name); \
+        typedef p1 Param1; \
+        typedef p2 Param2; \
+        typedef BDP_RESULT_TYPE<r>::Client ClientResult; \
+        typedef BDP_RESULT_TYPE<r>::Server ServerResult; \
+    };
+BDP_COMMAND_LIST(BDP_COMMAND_TRAITS_DEF)
+#undef BDP_COMMAND_TRAITS_DEF
+
+inline void BdpPutParam(BYTE *p, DWORD v) { memcpy(p, &v, 4); }
+inline void BdpPutParam(BYTE *p, BOOL v) { memcpy(p, &v, 4); }
+inline void BdpPutParam(BYTE *p, BDP_NONE) { memset(p, 0, 4); }
+
+// 12バイトのコマンドを作る。引数の型が定義と合わなければコンパイルエラーになる
+template<BDP_COMMAND Cmd>
+void BdpMakeCommand(BYTE (&buf)[12], typename BDP_COMMAND_TRAITS<Cmd>::Param1 param1, typename BDP_COMMAND_TRAITS<Cmd>::Param2 param2)
+{
+    DWORD fourcc = BDP_COMMAND_TRAITS<Cmd>::FOURCC;
+    memcpy(buf, &fourcc, 4);
+    BdpPutParam(buf + 4, param1);
+    BdpPutParam(buf + 8, param2);
+}
@@ -0,0 +1,95 @@
+﻿#pragma once
+
+// BonDriver_Dummyが出力するTSの生成と検証(BonDriver_DummyとBonDriverLocalProxyBenchとTestからインクルードする)
+// パケットの内容は通し番号とストリームのパケットに入れた時刻だけで決まるので、受け取った側で作りなおして比べられる
+
+#include <string.h>
+
+const DWORD BDP_DUMMY_PACKET_SIZE = 188;
+const DWORD BDP_DUMMY_PMT_PID = 0x1000;
+// 先頭8バイトにそのパケットを出力すべきだった時刻、続く8バイトに通し番号を入れるストリーム
+const DWORD BDP_DUMMY_STREAM_PID = 0x0100;
+// PATとPMTを挟む間隔
+const DWORD BDP_DUMMY_PSI_INTERVAL = 1000;
+
+inline DWORD CalcDummyCrc32(const BYTE *data, size_t len)
+{
+    DWORD crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < len; ++i) {
+        crc ^= static_cast<DWORD>(data[i]) << 24;
+        for (int j = 0; j < 8; ++j) {
+            crc = (crc << 1) ^ (crc & 0x80000000 ? 0x04C11DB7 : 0);
+        }
+    }
+    return crc;
+}
+
+inline DWORD GetDummyPacketPid(const BYTE *p)
+{
+    return (p[1] & 0x1F) << 8 | p[2];
+}
+
+// 通し番号indexのパケットを作る。ストリームのパケットにはdueTimeを入れる
+// 連続性指標は、それより前にある同じPIDのパケットの数から求める
+inline void MakeDummyPacket(BYTE *p, ULONGLONG index, LONGLONG dueTime)
+{
+    DWORD kind = static_cast<DWORD>(index % BDP_DUMMY_PSI_INTERVAL);
+    ULONGLONG round = index / BDP_DUMMY_PSI_INTERVAL;
+    ULONGLONG count;
+    if (kind < 2) {
+        // 番組1のみのPATと、BDP_DUMMY_STREAM_PIDを私的データとするPMT
+        static const BYTE pat[] = {
+            0x00, 0xB0, 0x0D, 0x00, 0x01, 0xC1, 0x00, 0x00,
+            0x00, 0x01, 0xE0 | (BDP_DUMMY_PMT_PID >> 8), BDP_DUMMY_PMT_PID & 0xFF
+        };
+        static const BYTE pmt[] = {
+            0x02, 0xB0, 0x12, 0x00, 0x01, 0xC1, 0x00, 0x00,
+            0xE0 | (BDP_DUMMY_STREAM_PID >> 8), BDP_DUMMY_STREAM_PID & 0xFF, 0xF0, 0x00,
+            0x06, 0xE0 | (BDP_DUMMY_STREAM_PID >> 8), BDP_DUMMY_STREAM_PID & 0xFF, 0xF0, 0x00
+        };
+        const BYTE *section = kind == 0 ? pat : pmt;
+        size_t sectionSize = kind == 0 ? sizeof(pat) : sizeof(pmt);
+        memset(p + 4, 0xFF, BDP_DUMMY_PACKET_SIZE - 4);
+        // ポインタフィールドに続けてセクションとCRC
+        p[4] = 0;
+        memcpy(p + 5, section, sectionSize);
+        DWORD crc = CalcDummyCrc32(section, sectionSize);
+        for (int i = 0; i < 4; ++i) {
+            p[5 + sectionSize + i] = static_cast<BYTE>(crc >> (24 - i * 8));
+        }
+        count = round;
+    }
+    else {
+        memcpy(p + 4, &dueTime, 8);
+        memcpy(p + 12, &index, 8);
+        for (DWORD i = 20; i < BDP_DUMMY_PACKET_SIZE; ++i) {
+            p[i] = static_cast<BYTE>(index * 31 + i);
+        }
+        count = round * (BDP_DUMMY_PSI_INTERVAL - 2) + kind - 2;
+    }
+    DWORD pid = kind == 0 ? 0 : kind == 1 ? BDP_DUMMY_PMT_PID : BDP_DUMMY_STREAM_PID;
+    p[0] = 0x47;
+    p[1] = static_cast<BYTE>((kind < 2 ? 0x40 : 0) | (pid >> 8));
+    p[2] = static_cast<BYTE>(pid);
+    p[3] = static_cast<BYTE>(0x10 | (count & 0x0F));
+}
+
+// 受け取ったパケットpを、次の通し番号がnextIndex(不明なら~0ULL)として作りなおしたものと比べる
+// 一致すればnextIndexを進め、一致しなければ不明にする。最初のストリームのパケットまでは通し番号がわからないので比べない
+inline bool VerifyDummyPacket(const BYTE *p, ULONGLONG &nextIndex)
+{
+    ULONGLONG index = nextIndex;
+    LONGLONG dueTime = 0;
+    if (GetDummyPacketPid(p) == BDP_DUMMY_STREAM_PID) {
+        memcpy(&dueTime, p + 4, 8);
+        memcpy(&index, p + 12, 8);
+    }
+    if (index == ~0ULL) {
+        return true;
+    }
+    BYTE expect[BDP_DUMMY_PACKET_SIZE];
+    MakeDummyPacket(expect, index, dueTime);
+    bool intact = (nextIndex == ~0ULL || index == nextIndex) && memcmp(p, expect, sizeof(expect)) == 0;
+    nextIndex = intact ? index + 1 : ~0ULL;
+    return intact;
+}
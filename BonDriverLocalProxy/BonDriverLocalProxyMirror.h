@@ -0,0 +1,130 @@
+﻿#pragma once
+
+// 共有リングバッファのチャンクの実体の2重マッピングと配置の計算(BonDriverLocalProxyとBonDriver_ProxyとTestからインクルードする)
+// Windowsではファイルマッピングオブジェクト、それ以外ではファイル記述子(memfdやshm_open)を2重にマップする
+
+#include <string.h>
+#ifdef _WIN32
+typedef HANDLE BDP_MAP_HANDLE;
+#else
+#include <sys/mman.h>
+typedef int BDP_MAP_HANDLE;
+#endif
+
+// 共有メモリのビューの配置単位。2重にマップする範囲の位置と大きさはこの倍数にする
+const DWORD BDP_MAP_GRANULARITY = 64 * 1024;
+
+#ifdef _WIN32
+// 2重にマップするための定数(Windows 10 1803以降)
+const ULONG BDP_MEM_PRESERVE_PLACEHOLDER = 0x00000002;
+const ULONG BDP_MEM_REPLACE_PLACEHOLDER = 0x00004000;
+const ULONG BDP_MEM_RESERVE_PLACEHOLDER = 0x00040000;
+
+typedef PVOID (WINAPI *PFN_VIRTUAL_ALLOC2)(HANDLE, PVOID, SIZE_T, ULONG, ULONG, void *, ULONG);
+typedef PVOID (WINAPI *PFN_MAP_VIEW_OF_FILE3)(HANDLE, HANDLE, PVOID, ULONG64, SIZE_T, ULONG, ULONG, void *, ULONG);
+#endif
+
+// hMapのoffsetからsizeバイトを仮想メモリ上に2回続けてマップする。非対応などで失敗すればnullptr
+inline BYTE *MapMirroredView(BDP_MAP_HANDLE hMap, ULONGLONG offset, size_t size, bool write)
+{
+#ifdef _WIN32
+    HMODULE hKernel = GetModuleHandle(L"kernelbase.dll");
+    if (!hKernel) {
+        return nullptr;
+    }
+    PFN_VIRTUAL_ALLOC2 pfnVirtualAlloc2 = reinterpret_cast<PFN_VIRTUAL_ALLOC2>(GetProcAddress(hKernel, "VirtualAlloc2"));
+    PFN_MAP_VIEW_OF_FILE3 pfnMapViewOfFile3 = reinterpret_cast<PFN_MAP_VIEW_OF_FILE3>(GetProcAddress(hKernel, "MapViewOfFile3"));
+    if (!pfnVirtualAlloc2 || !pfnMapViewOfFile3) {
+        return nullptr;
+    }
+    BYTE *p = static_cast<BYTE*>(pfnVirtualAlloc2(nullptr, nullptr, size * 2, MEM_RESERVE | BDP_MEM_RESERVE_PLACEHOLDER, PAGE_NOACCESS, nullptr, 0));
+    if (!p) {
+        return nullptr;
+    }
+    // 予約を前後2つに分けてそれぞれを置き換える
+    if (!VirtualFree(p, size, MEM_RELEASE | BDP_MEM_PRESERVE_PLACEHOLDER)) {
+        VirtualFree(p, 0, MEM_RELEASE);
+        return nullptr;
+    }
+    ULONG protect = write ? PAGE_READWRITE : PAGE_READONLY;
+    if (!pfnMapViewOfFile3(hMap, nullptr, p, offset, size, BDP_MEM_REPLACE_PLACEHOLDER, protect, nullptr, 0)) {
+        VirtualFree(p, 0, MEM_RELEASE);
+        VirtualFree(p + size, 0, MEM_RELEASE);
+        return nullptr;
+    }
+    if (!pfnMapViewOfFile3(hMap, nullptr, p + size, offset, size, BDP_MEM_REPLACE_PLACEHOLDER, protect, nullptr, 0)) {
+        UnmapViewOfFile(p);
+        VirtualFree(p + size, 0, MEM_RELEASE);
+        return nullptr;
+    }
+    return p;
+#else
+    // 2倍の範囲を予約して、前後2つをそれぞれ置き換える
+    void *reserved = mmap(nullptr, size * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (reserved == MAP_FAILED) {
+        return nullptr;
+    }
+    BYTE *p = static_cast<BYTE*>(reserved);
+    int prot = write ? PROT_READ | PROT_WRITE : PROT_READ;
+    if (mmap(p, size, prot, MAP_SHARED | MAP_FIXED, hMap, static_cast<off_t>(offset)) == MAP_FAILED ||
+        mmap(p + size, size, prot, MAP_SHARED | MAP_FIXED, hMap, static_cast<off_t>(offset)) == MAP_FAILED) {
+        munmap(p, size * 2);
+        return nullptr;
+    }
+    return p;
+#endif
+}
+
+inline void UnmapMirroredView(const BYTE *p, size_t size)
+{
+#ifdef _WIN32
+    UnmapViewOfFile(p);
+    UnmapViewOfFile(p + size);
+#else
+    munmap(const_cast<BYTE*>(p), size * 2);
+#endif
+}
+
+// 大きさbufCountのチャンクを書き込む通し位置。2重にマップしていなければ末尾をまたがないように先頭に回す
+inline ULONGLONG PlaceRingChunk(ULONGLONG writePos, DWORD dataSize, bool mirrored, DWORD bufCount)
+{
+    DWORD offset = static_cast<DWORD>(writePos % dataSize);
+    if (!mirrored && offset + bufCount > dataSize) {
+        writePos += dataSize - offset;
+    }
+    return writePos;
+}
+
+// posに書き込んだチャンクの次に書き込む通し位置(16バイト境界にそろえる)
+inline ULONGLONG GetNextRingWritePos(ULONGLONG pos, DWORD bufCount)
+{
+    return pos + ((bufCount + 15) & ~15);
+}
+
+// 通し位置posのチャンクが、writeEndまで書き込むと上書きされるか
+inline bool IsRingChunkOverwritten(ULONGLONG pos, DWORD dataSize, ULONGLONG writeEnd)
+{
+    return pos + dataSize < writeEnd;
+}
+
+// 通し位置の下位32bitがposのチャンクが、書き込み中のチャンクの終わりの下位32bitがwriteEndのときに無事か
+// dataSizeは2^31より小さいので、下位32bitどうしの差で判断できる
+inline bool IsRingChunkIntact(DWORD pos, DWORD writeEnd, DWORD dataSize)
+{
+    return writeEnd - pos <= dataSize;
+}
+
+// dataのoffsetからsizeバイトを連続して読める位置。2重にマップしていなければ末尾をまたぐものだけcopyBufにつなげる
+inline const BYTE *GetRingChunkSpan(const BYTE *data, DWORD dataSize, bool mirrored, DWORD offset, DWORD size, BYTE *copyBuf)
+{
+    if (mirrored || offset + size <= dataSize) {
+        return data + offset;
+    }
+    if (offset >= dataSize) {
+        return data + offset - dataSize;
+    }
+    DWORD n1 = dataSize - offset;
+    memcpy(copyBuf, data + offset, n1);
+    memcpy(copyBuf + n1, data, size - n1);
+    return copyBuf;
+}
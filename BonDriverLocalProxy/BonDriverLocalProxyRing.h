@@ -0,0 +1,125 @@
+﻿#pragma once
+
+// BonDriverLocalProxyのリングバッファのスロットのつなぎかた(Win32に依存しないのでTestからもインクルードする)
+
+#include <vector>
+
+// スロットを連結リストでつないだリングバッファ(伸縮のために並べ替えない)
+// スロットはmaxNum個の中から空きリストで出し入れし、配信中は確保しない。番号がないときは0xFFFFFFFF
+struct BDP_RING_LINKS {
+    DWORD maxNum;
+    // 以下の配列の大きさはmaxNum
+    // リング上の次のスロット番号、または空きリスト上の次のスロット番号
+    std::vector<DWORD> next;
+    // そのスロットを読み出し位置とする接続の数
+    std::vector<DWORD> readers;
+    // そのスロットに書き込んだときの通し番号
+    std::vector<DWORD> seq;
+    DWORD freeHead;
+    DWORD num;
+    // 次に書き込むスロットと、その通し番号
+    DWORD rear;
+    DWORD rearSeq;
+    // readersが0でないスロットのうち最も古いものか、それより前の位置(なければrear)
+    DWORD oldest;
+    // そのスロットに書き込む前までに書き込んだ総バイト数(rearのものは常にrearBytes)と、rearまでのもの
+    std::vector<ULONGLONG> byteSeq;
+    ULONGLONG rearBytes;
+    // 伸ばした回数と縮めた回数
+    DWORD expandEvents;
+    DWORD shrinkEvents;
+};
+
+inline void InitRingLinks(BDP_RING_LINKS &ring, DWORD maxNum)
+{
+    ring.maxNum = maxNum;
+    ring.next.assign(maxNum, 0);
+    ring.readers.assign(maxNum, 0);
+    ring.seq.assign(maxNum, 0);
+    ring.byteSeq.assign(maxNum, 0);
+    // 最初のスロットだけでリングを作り、残りは空きリストにつなぐ
+    ring.next[0] = 0;
+    for (DWORD i = 1; i < maxNum; ++i) {
+        ring.next[i] = i + 1 < maxNum ? i + 1 : 0xFFFFFFFF;
+    }
+    ring.freeHead = maxNum > 1 ? 1 : 0xFFFFFFFF;
+    ring.num = 1;
+    ring.rear = 0;
+    ring.rearSeq = 0;
+    ring.oldest = 0;
+    ring.rearBytes = 0;
+    ring.expandEvents = 0;
+    ring.shrinkEvents = 0;
+}
+
+// 接続の読み出し位置をfromからtoに移す
+inline void MoveRingReader(BDP_RING_LINKS &ring, DWORD from, DWORD to)
+{
+    if (from != 0xFFFFFFFF) {
+        --ring.readers[from];
+    }
+    if (to != 0xFFFFFFFF) {
+        ++ring.readers[to];
+    }
+}
+
+// 次に書き込むスロットが読まれていれば、空きリストからrearの直後に挿入する
+inline bool ExpandRingBuffer(BDP_RING_LINKS &ring)
+{
+    if (ring.readers[ring.next[ring.rear]] != 0 && ring.freeHead != 0xFFFFFFFF) {
+        DWORD i = ring.freeHead;
+        ring.freeHead = ring.next[i];
+        ring.next[i] = ring.next[ring.rear];
+        ring.next[ring.rear] = i;
+        ++ring.num;
+        ++ring.expandEvents;
+        return true;
+    }
+    return false;
+}
+
+// rearの直後が読まれていなければ外して空きリストに戻す
+inline bool ShrinkRingBuffer(BDP_RING_LINKS &ring)
+{
+    DWORD i = ring.next[ring.rear];
+    if (ring.num > 1 && ring.readers[i] == 0) {
+        if (ring.oldest == i) {
+            ring.oldest = ring.next[i];
+        }
+        ring.next[ring.rear] = ring.next[i];
+        ring.next[i] = ring.freeHead;
+        ring.freeHead = i;
+        --ring.num;
+        ++ring.shrinkEvents;
+        return true;
+    }
+    return false;
+}
+
+// oldestを接続の位置になっている最も古いスロットまで進める
+inline void AdvanceRingOldest(BDP_RING_LINKS &ring)
+{
+    while (ring.oldest != ring.rear && ring.readers[ring.oldest] == 0) {
+        ring.oldest = ring.next[ring.oldest];
+    }
+}
+
+// rearにbytesバイトのチャンクを書き込んだことを記録する(rearはまだ進めない)
+inline void CommitRingRear(BDP_RING_LINKS &ring, DWORD bytes)
+{
+    ring.seq[ring.rear] = ring.rearSeq++;
+    ring.rearBytes += bytes;
+}
+
+// 書き込み先を次のスロットに進める
+inline void AdvanceRingRear(BDP_RING_LINKS &ring)
+{
+    ring.rear = ring.next[ring.rear];
+    ring.byteSeq[ring.rear] = ring.rearBytes;
+}
+
+// frontからrearの手前までのスロットの数
+inline DWORD GetRingDistance(const BDP_RING_LINKS &ring, DWORD front)
+{
+    return front == ring.rear ? 0 : ring.rearSeq - ring.seq[front];
+}
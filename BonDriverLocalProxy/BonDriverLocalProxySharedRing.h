@@ -0,0 +1,195 @@
+﻿#pragma once
+
+// 共有メモリ上のリングバッファの配置とスロットの読み書き(BonDriverLocalProxyとBonDriver_ProxyとTestからインクルードする)
+// Windowsでは名前付きファイルマッピングオブジェクト、それ以外ではshm_open()の共有メモリに置く
+
+#include <atomic>
+#include "BonDriverLocalProxyMirror.h"
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+typedef LPCWSTR BDP_MAP_NAME;
+const BDP_MAP_HANDLE BDP_NO_MAP = nullptr;
+#else
+typedef const char *BDP_MAP_NAME;
+const BDP_MAP_HANDLE BDP_NO_MAP = -1;
+#endif
+
+// 共有メモリの先頭
+// 先頭に続いてslotNum個のBDP_RING_SLOT、dataOffsetからdataSizeバイトのチャンクの実体を置く
+// クライアントはチャンクを複写したあとでwriteEndとスロットを読みなおし、遅れすぎて上書きされたものは捨てる
+struct BDP_SHARED_RING_HEADER {
+    DWORD slotSize;
+    DWORD slotNum;
+    DWORD dataOffset;
+    DWORD dataSize;
+    // 書き込み中のチャンクの終わりの通し位置の下位32bit(書き込む前に更新する)
+    LONG writeEnd;
+    BYTE reserved[44];
+};
+
+// チャンクの位置。dataのoffsetから先頭4バイトの残り数に続けてbufCount-4バイトのデータがある
+// posは書き込んだときのdata上の通し位置の下位32bitで、クライアントが上書きされていないか確かめるのに使う
+struct BDP_RING_SLOT {
+    DWORD offset;
+    DWORD bufCount;
+    DWORD pos;
+};
+
+// nameの共有メモリをsizeバイトで作る。失敗すればBDP_NO_MAP
+inline BDP_MAP_HANDLE CreateSharedMap(BDP_MAP_NAME name, size_t size)
+{
+#ifdef _WIN32
+    return CreateFileMapping(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, static_cast<DWORD>(size), name);
+#else
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd >= 0 && ftruncate(fd, static_cast<off_t>(size)) != 0) {
+        close(fd);
+        shm_unlink(name);
+        fd = -1;
+    }
+    return fd;
+#endif
+}
+
+// nameの共有メモリを読み取り専用で開く。失敗すればBDP_NO_MAP
+inline BDP_MAP_HANDLE OpenSharedMap(BDP_MAP_NAME name)
+{
+#ifdef _WIN32
+    return OpenFileMapping(FILE_MAP_READ, FALSE, name);
+#else
+    return shm_open(name, O_RDONLY, 0);
+#endif
+}
+
+inline void CloseSharedMap(BDP_MAP_HANDLE hMap)
+{
+#ifdef _WIN32
+    CloseHandle(hMap);
+#else
+    close(hMap);
+#endif
+}
+
+// 作った共有メモリの名前を消す(Windowsでは最後のハンドルを閉じたときに消える)
+inline void RemoveSharedMap(BDP_MAP_NAME name)
+{
+#ifdef _WIN32
+    static_cast<void>(name);
+#else
+    shm_unlink(name);
+#endif
+}
+
+// 共有メモリ全体をマップして、その大きさをsizeに返す。失敗すればnullptr
+inline BYTE *MapSharedView(BDP_MAP_HANDLE hMap, bool write, size_t &size)
+{
+#ifdef _WIN32
+    BYTE *p = static_cast<BYTE*>(MapViewOfFile(hMap, write ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, 0));
+    MEMORY_BASIC_INFORMATION mbi;
+    if (p && !VirtualQuery(p, &mbi, sizeof(mbi))) {
+        UnmapViewOfFile(p);
+        p = nullptr;
+    }
+    size = p ? mbi.RegionSize : 0;
+    return p;
+#else
+    struct stat st;
+    void *p = MAP_FAILED;
+    if (fstat(hMap, &st) == 0 && st.st_size > 0) {
+        p = mmap(nullptr, static_cast<size_t>(st.st_size), write ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, hMap, 0);
+    }
+    size = p != MAP_FAILED ? static_cast<size_t>(st.st_size) : 0;
+    return p != MAP_FAILED ? static_cast<BYTE*>(p) : nullptr;
+#endif
+}
+
+inline void UnmapSharedView(const BYTE *p, size_t size)
+{
+#ifdef _WIN32
+    static_cast<void>(size);
+    UnmapViewOfFile(p);
+#else
+    munmap(const_cast<BYTE*>(p), size);
+#endif
+}
+
+// slotNum個のスロットに続くチャンクの実体の位置(2重にマップできるよう配置単位にそろえる)
+inline DWORD GetSharedRingDataOffset(DWORD slotNum)
+{
+    DWORD offset = static_cast<DWORD>(sizeof(BDP_SHARED_RING_HEADER) + sizeof(BDP_RING_SLOT) * slotNum);
+    return (offset + BDP_MAP_GRANULARITY - 1) / BDP_MAP_GRANULARITY * BDP_MAP_GRANULARITY;
+}
+
+inline void InitSharedRingHeader(BYTE *view, DWORD slotNum, DWORD dataOffset, DWORD dataSize)
+{
+    BDP_SHARED_RING_HEADER &header = *reinterpret_cast<BDP_SHARED_RING_HEADER*>(view);
+    header.slotSize = sizeof(BDP_RING_SLOT);
+    header.slotNum = slotNum;
+    header.dataOffset = dataOffset;
+    header.dataSize = dataSize;
+    header.writeEnd = 0;
+}
+
+inline BDP_RING_SLOT *GetSharedRingSlots(BYTE *view)
+{
+    return reinterpret_cast<BDP_RING_SLOT*>(view + sizeof(BDP_SHARED_RING_HEADER));
+}
+
+// 通し位置posにbufCountバイトのチャンクを書き込んで、slotをその位置にする
+// 上書きしはじめる前にwriteEndを進めて、読んでいるクライアントに知らせる
+inline void WriteSharedRingChunk(volatile LONG *writeEnd, BDP_RING_SLOT &slot, BYTE *data, DWORD dataSize, ULONGLONG pos, const BYTE *buf, DWORD bufCount)
+{
+#ifdef _WIN32
+    InterlockedExchange(writeEnd, static_cast<LONG>(pos + bufCount));
+#else
+    __atomic_store_n(writeEnd, static_cast<LONG>(pos + bufCount), __ATOMIC_SEQ_CST);
+#endif
+    DWORD offset = static_cast<DWORD>(pos % dataSize);
+    memcpy(data + offset, buf, bufCount);
+    slot.offset = offset;
+    slot.bufCount = bufCount;
+    slot.pos = static_cast<DWORD>(pos);
+}
+
+// クライアントがマップした共有メモリが、大きさviewSizeに収まるリングバッファで、チャンクがminDataSizeバイト以上か
+inline bool IsSharedRingHeaderValid(const BYTE *view, size_t viewSize, DWORD minDataSize)
+{
+    if (viewSize < sizeof(BDP_SHARED_RING_HEADER)) {
+        return false;
+    }
+    const BDP_SHARED_RING_HEADER &header = *reinterpret_cast<const BDP_SHARED_RING_HEADER*>(view);
+    return header.slotSize == sizeof(BDP_RING_SLOT) &&
+           header.dataOffset >= sizeof(header) + static_cast<ULONGLONG>(sizeof(BDP_RING_SLOT)) * header.slotNum &&
+           header.dataSize >= minDataSize &&
+           static_cast<ULONGLONG>(header.dataOffset) + header.dataSize <= viewSize;
+}
+
+// スロットnを読む。位置が範囲外か、データがmaxSizeバイトを超えていればfalse
+inline bool ReadSharedRingSlot(const BYTE *view, DWORD n, DWORD maxSize, BDP_RING_SLOT &slot)
+{
+    const BDP_SHARED_RING_HEADER &header = *reinterpret_cast<const BDP_SHARED_RING_HEADER*>(view);
+    const volatile BDP_RING_SLOT &entry = reinterpret_cast<const BDP_RING_SLOT*>(view + sizeof(header))[n];
+    slot.offset = entry.offset;
+    slot.bufCount = entry.bufCount;
+    slot.pos = entry.pos;
+    // チャンクの実体はスロットより後に読む
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return slot.offset < header.dataSize && slot.bufCount >= 4 && slot.bufCount - 4 <= maxSize;
+}
+
+// ReadSharedRingSlot()で読んだスロットnのチャンクを読み終えたときに、まだ上書きされていないか
+// 上書きしはじめていれば、スロットが変わったかwriteEndが先に進んでいる
+inline bool IsSharedRingSlotIntact(const BYTE *view, DWORD n, const BDP_RING_SLOT &slot)
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    const volatile BDP_SHARED_RING_HEADER &header = *reinterpret_cast<const BDP_SHARED_RING_HEADER*>(view);
+    const volatile BDP_RING_SLOT &entry = reinterpret_cast<const BDP_RING_SLOT*>(view + sizeof(BDP_SHARED_RING_HEADER))[n];
+    DWORD writeEnd = static_cast<DWORD>(header.writeEnd);
+    return entry.offset == slot.offset && entry.bufCount == slot.bufCount && entry.pos == slot.pos &&
+           IsRingChunkIntact(slot.pos, writeEnd, header.dataSize);
+}
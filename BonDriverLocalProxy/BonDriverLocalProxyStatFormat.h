@@ -0,0 +1,91 @@
+﻿#pragma once
+
+// BonDriverLocalProxyのStatの応答の定義(BonDriverLocalProxyStatとBonDriverLocalProxyBenchとTestからもインクルードする)
+
+// 取得から応答までの時間の分布の区間数(区間iは2^i以上2^(i+1)未満マイクロ秒、最初と最後は端を含む)
+const int BDP_LATENCY_HIST_NUM = 24;
+
+// Statの一括応答の先頭
+struct BDP_STAT_HEADER {
+    DWORD headerSize;
+    DWORD connSize;
+    DWORD connNum;
+    DWORD ringNum;
+    DWORD ringMax;
+    DWORD expandCount;
+    DWORD shrinkCount;
+    DWORD ingestChunks;
+    ULONGLONG ingestBytes;
+    DWORD dropBytes;
+    // 最後の選局から最初のチャンクを取得するまでのマイクロ秒(未計測はMAXDWORD)
+    DWORD tuneLatencyUsec;
+    // 取得スレッドがまとめたチャンクの合計バイト数と、同期を取り直して読み飛ばしたバイト数
+    ULONGLONG chunkBytes;
+    ULONGLONG resyncBytes;
+    DWORD chunkCount;
+};
+
+const DWORD BDP_STAT_FLAG_OPEN_TUNER = 0x01;
+const DWORD BDP_STAT_FLAG_FRAMED = 0x02;
+const DWORD BDP_STAT_FLAG_PUSH = 0x04;
+const DWORD BDP_STAT_FLAG_SHARED = 0x08;
+const DWORD BDP_STAT_FLAG_PID_FILTER = 0x10;
+
+// Statの一括応答でヘッダに続く接続ごとの統計
+struct BDP_STAT_CONNECTION {
+    DWORD index;
+    DWORD state;
+    DWORD priority;
+    DWORD flags;
+    // 未送信のチャンクの数
+    DWORD lag;
+    DWORD maxLag;
+    DWORD chunks;
+    DWORD dropCount;
+    ULONGLONG bytes;
+    DWORD latencyHist[BDP_LATENCY_HIST_NUM];
+    ULONGLONG dropBytes;
+};
+
+// 分布から割合rateに達する区間の上端(マイクロ秒)を求める
+inline ULONGLONG GetLatencyPercentile(const DWORD *hist, DWORD rate)
+{
+    ULONGLONG total = 0;
+    for (int i = 0; i < BDP_LATENCY_HIST_NUM; ++i) {
+        total += hist[i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+    ULONGLONG count = 0;
+    for (int i = 0; i < BDP_LATENCY_HIST_NUM; ++i) {
+        count += hist[i];
+        if (count * 100 >= total * rate) {
+            return 2ULL << i;
+        }
+    }
+    return 2ULL << (BDP_LATENCY_HIST_NUM - 1);
+}
+
+// マイクロ秒で表した時間を分布の区間に加える
+inline void AddLatencyHist(DWORD *hist, ULONGLONG usec)
+{
+    int i = 0;
+    for (; i < BDP_LATENCY_HIST_NUM - 1 && (usec >> (i + 1)) != 0; ++i);
+    ++hist[i];
+}
+
+#ifdef _WIN32
+// Statの応答をパイプから読む
+inline bool ReadAll(HANDLE hPipe, void *buf, DWORD size)
+{
+    for (DWORD n = 0; n < size;) {
+        DWORD xferred;
+        if (!ReadFile(hPipe, static_cast<BYTE*>(buf) + n, size - n, &xferred, nullptr) || xferred == 0) {
+            return false;
+        }
+        n += xferred;
+    }
+    return true;
+}
+#endif
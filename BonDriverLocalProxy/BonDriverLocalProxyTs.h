@@ -0,0 +1,74 @@
+﻿#pragma once
+
+// BonDriverLocalProxyのTSパケットを扱う処理(Win32に依存しないのでTestからもインクルードする)
+
+#include <stddef.h>
+#include <string.h>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define BDP_USE_SSE2
+#endif
+
+const int TS_PACKET_SIZE = 188;
+
+// 188バイト間隔で3つ続く同期バイトの位置をiから1バイトずつ探す(なければsize)。末尾付近では確認できる分だけ確認する
+inline size_t FindTsSyncScalar(const BYTE *buf, size_t size, size_t i = 0)
+{
+    for (; i < size; ++i) {
+        if (buf[i] == 0x47 &&
+            (i + TS_PACKET_SIZE >= size || buf[i + TS_PACKET_SIZE] == 0x47) &&
+            (i + TS_PACKET_SIZE * 2 >= size || buf[i + TS_PACKET_SIZE * 2] == 0x47)) {
+            break;
+        }
+    }
+    return i;
+}
+
+// FindTsSyncScalar()と同じ位置を探す
+inline size_t FindTsSync(const BYTE *buf, size_t size)
+{
+    size_t i = 0;
+#ifdef BDP_USE_SSE2
+    // 16箇所ずつ候補を絞る
+    const __m128i sync = _mm_set1_epi8(0x47);
+    for (; i + 16 + TS_PACKET_SIZE * 2 <= size; i += 16) {
+        __m128i a = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + i)), sync);
+        __m128i b = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + i + TS_PACKET_SIZE)), sync);
+        __m128i c = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + i + TS_PACKET_SIZE * 2)), sync);
+        if (_mm_movemask_epi8(_mm_and_si128(_mm_and_si128(a, b), c)) != 0) {
+            break;
+        }
+    }
+#endif
+    return FindTsSyncScalar(buf, size, i);
+}
+
+// 先頭から同期バイトが正しく続くパケットの数(最大num)
+inline DWORD CountSyncedPackets(const BYTE *buf, DWORD num)
+{
+    DWORD i = 0;
+    for (; i < num && buf[i * TS_PACKET_SIZE] == 0x47; ++i);
+    return i;
+}
+
+// pidMapで1のPIDのパケットだけを詰めてコピーする。コピーしたバイト数を返す
+inline DWORD FilterTsPackets(const BYTE *src, DWORD size, BYTE *dst, const BYTE *pidMap)
+{
+    DWORD n = 0;
+    for (DWORD i = 0; i + TS_PACKET_SIZE <= size;) {
+        // 通すパケットが続く範囲はまとめてコピーする
+        DWORD j = i;
+        for (; j + TS_PACKET_SIZE <= size; j += TS_PACKET_SIZE) {
+            DWORD pid = ((src[j + 1] & 0x1F) << 8) | src[j + 2];
+            if (!(pidMap[pid >> 3] & (1 << (pid & 7)))) {
+                break;
+            }
+        }
+        if (j != i) {
+            memcpy(dst + n, src + i, j - i);
+            n += j - i;
+        }
+        i = j + TS_PACKET_SIZE;
+    }
+    return n;
+}
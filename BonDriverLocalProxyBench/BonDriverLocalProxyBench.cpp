@@ -0,0 +1,474 @@
+﻿#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <shellapi.h>
+#include <stdio.h>
+#include <string.h>
+#include <wchar.h>
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include "IBonDriver3.h"
+#include "../BonDriverLocalProxy/BonDriverLocalProxyStatFormat.h"
+#include "../BonDriverLocalProxy/BonDriverLocalProxyDummyTs.h"
+
+namespace
+{
+const int TS_PACKET_SIZE = 188;
+// 複写する版のGetTsStream()に大きさを0で渡すときのバッファの大きさ(BonDriver_Proxyが受け取れるとみなす大きさ)
+const DWORD UNSPECIFIED_COPY_BUF_SIZE = 48128;
+const DWORD DEFAULT_CLIENTS = 4;
+const DWORD DEFAULT_SECONDS = 10;
+// 優先度を表すDLL名の文字
+const WCHAR PRIORITY_CHARS[] = L"0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+const DWORD MAX_CLIENTS = 36;
+
+struct BENCH_CLIENT {
+    WCHAR libPath[MAX_PATH + 64];
+    WCHAR priority;
+    HMODULE hLib;
+    CBonStruct3Adapter bon3Adapter;
+    CBonStruct2Adapter bon2Adapter;
+    IBonDriver2 *bon2;
+    HANDLE hThread;
+    // 以下は読み込みスレッドだけが書き込む
+    ULONGLONG bytes;
+    DWORD chunks;
+    DWORD syncErrors;
+    DWORD ccErrors;
+    // BonDriver_Dummyのパケットを作りなおしたものと一致しなかった数
+    DWORD mismatches;
+    DWORD latencyHist[BDP_LATENCY_HIST_NUM];
+};
+
+HANDLE g_hStopEvent;
+LONGLONG g_perfFreq;
+// 複写する版のGetTsStream()をg_copyBufSize(0は大きさを指定しない)で呼ぶ
+bool g_copy;
+DWORD g_copyBufSize;
+// 代理元でPIDを絞っているので、パケットの通し番号は連続しない
+bool g_filtered;
+
+// 代理元プロセスに統計を問い合わせる
+bool QueryStat(LPCWSTR pipeName, BDP_STAT_HEADER &header, DWORD *serverPid)
+{
+    HANDLE hPipe = CreateFile(pipeName, GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (hPipe == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    if (serverPid) {
+        ULONG pid;
+        *serverPid = GetNamedPipeServerProcessId(hPipe, &pid) ? pid : 0;
+    }
+    BYTE cmd[12] = { 'S', 't', 'a', 't' };
+    DWORD written;
+    DWORD n;
+    std::vector<BYTE> stat;
+    bool result = false;
+    if (WriteFile(hPipe, cmd, sizeof(cmd), &written, nullptr) && written == sizeof(cmd) &&
+        ReadAll(hPipe, &n, 4) && n >= sizeof(BDP_STAT_HEADER) && n <= 64 * 1024 * 1024) {
+        stat.resize(n);
+        result = ReadAll(hPipe, stat.data(), n);
+    }
+    CloseHandle(hPipe);
+    if (result) {
+        memcpy(&header, stat.data(), sizeof(header));
+    }
+    return result;
+}
+
+ULONGLONG GetProcessCpuTime(HANDLE hProcess)
+{
+    FILETIME creationTime, exitTime, kernelTime, userTime;
+    if (!hProcess || !GetProcessTimes(hProcess, &creationTime, &exitTime, &kernelTime, &userTime)) {
+        return 0;
+    }
+    return (static_cast<ULONGLONG>(kernelTime.dwHighDateTime) << 32 | kernelTime.dwLowDateTime) +
+           (static_cast<ULONGLONG>(userTime.dwHighDateTime) << 32 | userTime.dwLowDateTime);
+}
+
+DWORD WINAPI ReadThread(LPVOID param)
+{
+    BENCH_CLIENT &cl = *static_cast<BENCH_CLIENT*>(param);
+    // 0x10以上は未取得
+    BYTE lastCC = 0x10;
+    // 次に受け取るはずのパケットの通し番号(~0ULLは不明)
+    ULONGLONG nextIndex = ~0ULL;
+    DWORD copyCapacity = g_copyBufSize != 0 ? g_copyBufSize : UNSPECIFIED_COPY_BUF_SIZE;
+    std::unique_ptr<BYTE[]> copyBuf(g_copy ? new BYTE[copyCapacity] : nullptr);
+    while (WaitForSingleObject(g_hStopEvent, 0) == WAIT_TIMEOUT) {
+        BYTE *data = copyBuf.get();
+        DWORD size = g_copyBufSize;
+        DWORD remain = 0;
+        if (!(data ? cl.bon2->GetTsStream(data, &size, &remain) : cl.bon2->GetTsStream(&data, &size, &remain)) || size == 0) {
+            if (remain == 0) {
+                Sleep(5);
+            }
+            continue;
+        }
+        if (data == copyBuf.get() && size > copyCapacity) {
+            // バッファを超えた
+            ++cl.mismatches;
+            break;
+        }
+        LARGE_INTEGER now;
+        QueryPerformanceCounter(&now);
+        cl.bytes += size;
+        ++cl.chunks;
+        // チャンクはパケット境界に揃っている前提
+        bool measured = false;
+        for (DWORD i = 0; i + TS_PACKET_SIZE <= size; i += TS_PACKET_SIZE) {
+            const BYTE *p = data + i;
+            if (p[0] != 0x47) {
+                ++cl.syncErrors;
+                continue;
+            }
+            if (g_filtered) {
+                nextIndex = ~0ULL;
+            }
+            if (!VerifyDummyPacket(p, nextIndex)) {
+                ++cl.mismatches;
+            }
+            if (GetDummyPacketPid(p) == BDP_DUMMY_STREAM_PID) {
+                BYTE cc = p[3] & 0x0F;
+                if (lastCC < 0x10 && cc != ((lastCC + 1) & 0x0F)) {
+                    ++cl.ccErrors;
+                }
+                lastCC = cc;
+                if (!measured) {
+                    // チャンクの最初のパケットについて、出力すべきだった時刻から受け取るまでの時間
+                    measured = true;
+                    LONGLONG dueTime;
+                    memcpy(&dueTime, p + 4, 8);
+                    ULONGLONG usec = now.QuadPart > dueTime && g_perfFreq > 0 ?
+                                     static_cast<ULONGLONG>(now.QuadPart - dueTime) * 1000000 / g_perfFreq : 0;
+                    AddLatencyHist(cl.latencyHist, usec);
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+// DLLと同名の設定ファイルのパス
+void GetIniPath(WCHAR (&iniPath)[MAX_PATH + 64], LPCWSTR libPath)
+{
+    wcscpy_s(iniPath, libPath);
+    LPWSTR ext = wcsrchr(iniPath, L'.');
+    if (ext) {
+        wcscpy_s(ext, 5, L".ini");
+    }
+}
+
+bool OpenClient(BENCH_CLIENT &cl)
+{
+    cl.hLib = LoadLibrary(cl.libPath);
+    if (cl.hLib) {
+        const STRUCT_IBONDRIVER *(*funcCreateBonStruct)() = reinterpret_cast<const STRUCT_IBONDRIVER*(*)()>(GetProcAddress(cl.hLib, "CreateBonStruct"));
+        const STRUCT_IBONDRIVER *st = funcCreateBonStruct ? funcCreateBonStruct() : nullptr;
+        if (st) {
+            if (cl.bon3Adapter.Adapt(*st)) {
+                cl.bon2 = &cl.bon3Adapter;
+            }
+            else if (cl.bon2Adapter.Adapt(*st)) {
+                cl.bon2 = &cl.bon2Adapter;
+            }
+            else {
+                // IBonDriver2未満は対象外
+                CBonStructAdapter bonAdapter;
+                bonAdapter.Adapt(*st);
+                bonAdapter.Release();
+            }
+        }
+        if (cl.bon2) {
+            if (cl.bon2->OpenTuner() && cl.bon2->SetChannel(0, 0)) {
+                return true;
+            }
+            cl.bon2->CloseTuner();
+            cl.bon2->Release();
+            cl.bon2 = nullptr;
+        }
+        FreeLibrary(cl.hLib);
+        cl.hLib = nullptr;
+    }
+    return false;
+}
+
+// 最初のパケットを受け取るまで待つ(受け取ったものは集計しない)
+bool WaitFirstPacket(BENCH_CLIENT &cl, DWORD timeout)
+{
+    DWORD startTick = GetTickCount();
+    do {
+        BYTE *data;
+        DWORD size = 0;
+        DWORD remain = 0;
+        if (cl.bon2->GetTsStream(&data, &size, &remain) && size != 0) {
+            return true;
+        }
+        Sleep(1);
+    } while (GetTickCount() - startTick < timeout);
+    return false;
+}
+
+void CloseClient(BENCH_CLIENT &cl)
+{
+    if (cl.bon2) {
+        cl.bon2->CloseTuner();
+        cl.bon2->Release();
+        cl.bon2 = nullptr;
+    }
+    if (cl.hLib) {
+        FreeLibrary(cl.hLib);
+        cl.hLib = nullptr;
+    }
+}
+}
+
+int main()
+{
+    WCHAR origin[MAX_PATH] = {};
+    DWORD clientNum = DEFAULT_CLIENTS;
+    DWORD seconds = DEFAULT_SECONDS;
+    bool direct = false;
+    // 空でなければクライアントごとの設定ファイルでこのPIDだけに絞る
+    WCHAR allowPids[256] = {};
+    {
+        int argc;
+        LPWSTR *argv = CommandLineToArgvW(GetCommandLine(), &argc);
+        if (argv) {
+            for (int i = 1; i < argc; ++i) {
+                if (wcscmp(argv[i], L"-n") == 0 && i + 1 < argc) {
+                    clientNum = wcstoul(argv[++i], nullptr, 10);
+                }
+                else if (wcscmp(argv[i], L"-t") == 0 && i + 1 < argc) {
+                    seconds = wcstoul(argv[++i], nullptr, 10);
+                }
+                else if (wcscmp(argv[i], L"-direct") == 0) {
+                    direct = true;
+                }
+                else if (wcscmp(argv[i], L"-copy") == 0 && i + 1 < argc) {
+                    g_copy = true;
+                    g_copyBufSize = wcstoul(argv[++i], nullptr, 10) * TS_PACKET_SIZE;
+                }
+                else if (wcscmp(argv[i], L"-pid") == 0 && i + 1 < argc) {
+                    ++i;
+                    if (wcslen(argv[i]) < sizeof(allowPids) / sizeof(allowPids[0])) {
+                        wcscpy_s(allowPids, argv[i]);
+                    }
+                }
+                else if (wcslen(argv[i]) < MAX_PATH) {
+                    wcscpy_s(origin, argv[i]);
+                }
+            }
+            LocalFree(argv);
+        }
+    }
+    if (!origin[0] || clientNum < 1 || clientNum > MAX_CLIENTS || seconds < 1 || (direct && allowPids[0])) {
+        fputs("Usage: BonDriverLocalProxyBench [-n clients] [-t seconds] [-direct] [-copy packets] [-pid pids] origin\n"
+              "  origin: BonDriver_{origin}.dll (BonDriver_Dummy.dll is recommended)\n"
+              "  -n: number of BonDriver_Proxy instances, 1-36 (default 4)\n"
+              "  -t: duration in seconds (default 10)\n"
+              "  -direct: load BonDriver_{origin}.dll in-process with a single reader\n"
+              "  -copy: read with the copying GetTsStream() into a buffer of this many packets (0: size not specified)\n"
+              "  -pid: let the server filter each client's stream to these comma-separated PIDs (not with -direct)\n", stderr);
+        return 2;
+    }
+    if (direct) {
+        clientNum = 1;
+    }
+    g_filtered = allowPids[0] != L'\0';
+
+    WCHAR dir[MAX_PATH + 64];
+    {
+        DWORD len = GetModuleFileName(nullptr, dir, MAX_PATH);
+        if (!len || len >= MAX_PATH || !wcsrchr(dir, L'\\')) {
+            return 1;
+        }
+        *wcsrchr(dir, L'\\') = L'\0';
+    }
+    LARGE_INTEGER freq;
+    g_perfFreq = QueryPerformanceFrequency(&freq) ? freq.QuadPart : 0;
+
+    WCHAR pipeName[MAX_PATH + 64];
+    swprintf_s(pipeName, L"\\\\.\\pipe\\BonDriverLocalProxy_%s", origin);
+    // 代理元プロセスが起動していなければ、最初のクライアントの起動時間はその起動を含む
+    bool coldStart = !direct && !WaitNamedPipe(pipeName, 1) && GetLastError() == ERROR_FILE_NOT_FOUND;
+    ULONGLONG openUsec = 0;
+    ULONGLONG firstPacketUsec = 0;
+
+    // 値初期化でゼロクリアされる
+    std::vector<BENCH_CLIENT> clients(clientNum);
+    bool result = true;
+    for (DWORD i = 0; i < clientNum; ++i) {
+        BENCH_CLIENT &cl = clients[i];
+        if (direct) {
+            swprintf_s(cl.libPath, L"%s\\BonDriver_%s.dll", dir, origin);
+            cl.priority = L'-';
+        }
+        else {
+            // 優先度が混在するように名前を変えたコピーを作る
+            cl.priority = PRIORITY_CHARS[i * MAX_CLIENTS / clientNum];
+            WCHAR srcPath[MAX_PATH + 64];
+            swprintf_s(srcPath, L"%s\\BonDriver_Proxy.dll", dir);
+            swprintf_s(cl.libPath, L"%s\\BonDriver_Proxy%c_%s.dll", dir, cl.priority, origin);
+            if (!CopyFile(srcPath, cl.libPath, FALSE)) {
+                cl.libPath[0] = L'\0';
+                fputs("Error: cannot copy BonDriver_Proxy.dll.\n", stderr);
+                result = false;
+                break;
+            }
+            if (allowPids[0]) {
+                // コピーと同名の設定ファイルでPIDを絞る
+                WCHAR iniPath[MAX_PATH + 64];
+                GetIniPath(iniPath, cl.libPath);
+                if (!WritePrivateProfileString(L"Filter", L"AllowPids", allowPids, iniPath)) {
+                    fputs("Error: cannot write the filter setting.\n", stderr);
+                    result = false;
+                    break;
+                }
+            }
+        }
+        LARGE_INTEGER openTime;
+        QueryPerformanceCounter(&openTime);
+        if (!OpenClient(cl)) {
+            fprintf(stderr, "Error: cannot open client %lu.\n", i);
+            result = false;
+            break;
+        }
+        if (i == 0) {
+            // 読み込みからOpenTuner()とSetChannel()まで、および最初のパケットを受け取るまでの時間
+            LARGE_INTEGER now;
+            QueryPerformanceCounter(&now);
+            openUsec = g_perfFreq > 0 ? static_cast<ULONGLONG>(now.QuadPart - openTime.QuadPart) * 1000000 / g_perfFreq : 0;
+            if (WaitFirstPacket(cl, 20000)) {
+                QueryPerformanceCounter(&now);
+                firstPacketUsec = g_perfFreq > 0 ? static_cast<ULONGLONG>(now.QuadPart - openTime.QuadPart) * 1000000 / g_perfFreq : 0;
+            }
+        }
+    }
+    BDP_STAT_HEADER header;
+    DWORD serverPid = 0;
+    HANDLE hServer = nullptr;
+    if (result && !direct && QueryStat(pipeName, header, &serverPid) && serverPid) {
+        hServer = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, serverPid);
+    }
+
+    ULONGLONG elapsed = 0;
+    ULONGLONG benchCpu = 0;
+    ULONGLONG serverCpu = 0;
+    DWORD ringHighWater = 0;
+    DWORD ringMax = 0;
+    DWORD tuneLatencyUsec = MAXDWORD;
+    // 代理元が取得したバイト数(絞る前)
+    ULONGLONG ingestStart = 0;
+    ULONGLONG ingestEnd = 0;
+    if (result) {
+        g_hStopEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+        LARGE_INTEGER startTime;
+        QueryPerformanceCounter(&startTime);
+        benchCpu = GetProcessCpuTime(GetCurrentProcess());
+        serverCpu = GetProcessCpuTime(hServer);
+        if (!direct && QueryStat(pipeName, header, nullptr)) {
+            ingestStart = ingestEnd = header.ingestBytes;
+        }
+        for (DWORD i = 0; i < clientNum; ++i) {
+            clients[i].hThread = CreateThread(nullptr, 0, ReadThread, &clients[i], 0, nullptr);
+        }
+        for (;;) {
+            Sleep(100);
+            // リングバッファの使用量の最大値を記録
+            if (!direct && QueryStat(pipeName, header, nullptr)) {
+                ringHighWater = std::max(ringHighWater, header.ringNum);
+                ringMax = std::max(ringMax, header.ringMax);
+                tuneLatencyUsec = header.tuneLatencyUsec;
+                ingestEnd = header.ingestBytes;
+            }
+            LARGE_INTEGER now;
+            QueryPerformanceCounter(&now);
+            elapsed = g_perfFreq > 0 ? static_cast<ULONGLONG>(now.QuadPart - startTime.QuadPart) * 1000000 / g_perfFreq : 0;
+            if (elapsed >= seconds * 1000000ULL) {
+                break;
+            }
+        }
+        SetEvent(g_hStopEvent);
+        for (DWORD i = 0; i < clientNum; ++i) {
+            if (clients[i].hThread) {
+                WaitForSingleObject(clients[i].hThread, INFINITE);
+                CloseHandle(clients[i].hThread);
+            }
+        }
+        benchCpu = GetProcessCpuTime(GetCurrentProcess()) - benchCpu;
+        serverCpu = GetProcessCpuTime(hServer) - serverCpu;
+        CloseHandle(g_hStopEvent);
+    }
+    if (hServer) {
+        CloseHandle(hServer);
+    }
+
+    for (DWORD i = 0; i < clientNum; ++i) {
+        CloseClient(clients[i]);
+        if (!direct && clients[i].libPath[0]) {
+            DeleteFile(clients[i].libPath);
+            if (allowPids[0]) {
+                WCHAR iniPath[MAX_PATH + 64];
+                GetIniPath(iniPath, clients[i].libPath);
+                DeleteFile(iniPath);
+            }
+        }
+    }
+    if (!result || elapsed == 0) {
+        return 1;
+    }
+
+    ULONGLONG totalBytes = 0;
+    for (DWORD i = 0; i < clientNum; ++i) {
+        totalBytes += clients[i].bytes;
+    }
+    printf("mode: %s, %lu clients, %.1f seconds\n", direct ? "direct" : "proxy", clientNum, elapsed / 1000000.0);
+    if (g_copy) {
+        printf("copy: %lu bytes buffer%s\n", g_copyBufSize != 0 ? g_copyBufSize : UNSPECIFIED_COPY_BUF_SIZE,
+               g_copyBufSize != 0 ? "" : " (size not specified)");
+    }
+    printf("startup (%s): open %.1f ms, first packet %.1f ms\n", direct ? "direct" : coldStart ? "cold" : "warm",
+           openUsec / 1000.0, firstPacketUsec / 1000.0);
+    if (allowPids[0]) {
+        printf("filter: %ls\n", allowPids);
+    }
+    printf("aggregate: %.2f Mbps\n", totalBytes * 8.0 / elapsed);
+    if (!direct) {
+        // 絞る前の取得量と、クライアントあたりの平均受信量
+        printf("ingest: %.2f Mbps, delivered %.2f Mbps per client\n",
+               (ingestEnd - ingestStart) * 8.0 / elapsed, totalBytes * 8.0 / elapsed / clientNum);
+    }
+    // 遅延はドライバが出力すべきだった時刻からクライアントが受け取るまでの時間
+    printf("%5s %8s %10s %10s %8s %8s %8s %10s %10s\n",
+           "index", "priority", "Mbps", "chunks", "syncerr", "ccerr", "mismatch", "p50(us)", "p99(us)");
+    for (DWORD i = 0; i < clientNum; ++i) {
+        const BENCH_CLIENT &cl = clients[i];
+        printf("%5lu %8c %10.2f %10lu %8lu %8lu %8lu %10llu %10llu\n",
+               i, static_cast<char>(cl.priority), cl.bytes * 8.0 / elapsed, cl.chunks, cl.syncErrors, cl.ccErrors, cl.mismatches,
+               GetLatencyPercentile(cl.latencyHist, 50), GetLatencyPercentile(cl.latencyHist, 99));
+    }
+    // CPU時間は1コアあたりの割合
+    printf("cpu: bench %.1f%%", benchCpu / 10.0 / elapsed * 100);
+    if (!direct) {
+        printf(", server %.1f%%", serverCpu / 10.0 / elapsed * 100);
+    }
+    printf("\n");
+    if (!direct) {
+        printf("ring high-water: %lu/%lu slots\n", ringHighWater, ringMax);
+        if (tuneLatencyUsec != MAXDWORD) {
+            // 最初のクライアントのSetChannel()から代理元が最初のチャンクを取得するまで
+            printf("tune latency: %.1f ms\n", tuneLatencyUsec / 1000.0);
+        }
+    }
+    // 受け取れなかったか、壊れたり欠けたりしたデータを受け取ったクライアントがあれば失敗
+    bool passed = true;
+    for (DWORD i = 0; i < clientNum; ++i) {
+        if (clients[i].chunks == 0 || clients[i].syncErrors != 0 || clients[i].ccErrors != 0 || clients[i].mismatches != 0) {
+            passed = false;
+        }
+    }
+    printf("result: %s\n", passed ? "ok" : "FAILED");
+    return passed ? 0 : 1;
+}
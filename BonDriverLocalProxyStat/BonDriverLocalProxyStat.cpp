@@ -0,0 +1,105 @@
+﻿#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <shellapi.h>
+#include <stdio.h>
+#include <string.h>
+#include <wchar.h>
+#include <vector>
+#include "../BonDriverLocalProxy/BonDriverLocalProxyStatFormat.h"
+
+int main()
+{
+    WCHAR origin[MAX_PATH] = {};
+    {
+        int argc;
+        LPWSTR *argv = CommandLineToArgvW(GetCommandLine(), &argc);
+        if (argv) {
+            if (argc >= 2 && wcslen(argv[1]) < MAX_PATH) {
+                wcscpy_s(origin, argv[1]);
+            }
+            LocalFree(argv);
+        }
+    }
+    if (!origin[0]) {
+        fputs("Usage: BonDriverLocalProxyStat origin\n"
+              "  origin: BonDriver_{origin}.dll\n", stderr);
+        return 2;
+    }
+
+    WCHAR pipeName[MAX_PATH + 64];
+    wcscpy_s(pipeName, L"\\\\.\\pipe\\BonDriverLocalProxy_");
+    wcscat_s(pipeName, origin);
+    HANDLE hPipe = CreateFile(pipeName, GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (hPipe == INVALID_HANDLE_VALUE && GetLastError() == ERROR_PIPE_BUSY && WaitNamedPipe(pipeName, 1000)) {
+        hPipe = CreateFile(pipeName, GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    }
+    if (hPipe == INVALID_HANDLE_VALUE) {
+        fputs("Error: cannot connect to the proxy.\n", stderr);
+        return 1;
+    }
+
+    // 引数のないv1のコマンドとして送る
+    BYTE cmd[12] = { 'S', 't', 'a', 't' };
+    DWORD written;
+    DWORD n;
+    std::vector<BYTE> stat;
+    bool result = false;
+    if (WriteFile(hPipe, cmd, sizeof(cmd), &written, nullptr) && written == sizeof(cmd) &&
+        ReadAll(hPipe, &n, 4) && n >= sizeof(BDP_STAT_HEADER) && n <= 64 * 1024 * 1024) {
+        stat.resize(n);
+        result = ReadAll(hPipe, stat.data(), n);
+    }
+    CloseHandle(hPipe);
+    if (!result) {
+        fputs("Error: no reply.\n", stderr);
+        return 1;
+    }
+
+    BDP_STAT_HEADER header;
+    memcpy(&header, stat.data(), sizeof(header));
+    if (header.headerSize < sizeof(header) || header.headerSize > stat.size() ||
+        header.connSize < sizeof(BDP_STAT_CONNECTION) ||
+        (stat.size() - header.headerSize) / header.connSize < header.connNum) {
+        fputs("Error: unknown reply format.\n", stderr);
+        return 1;
+    }
+    printf("ring: %lu/%lu slots, expanded %lu, shrunk %lu\n",
+           header.ringNum, header.ringMax, header.expandCount, header.shrinkCount);
+    printf("ingest: %lu chunks, %llu bytes, capture dropped %lu bytes\n",
+           header.ingestChunks, header.ingestBytes, header.dropBytes);
+    // 取得スレッドが小さな取得結果をまとめた結果
+    printf("capture: %lu chunks, average %llu bytes, resync skipped %llu bytes\n",
+           header.chunkCount, header.chunkCount != 0 ? header.chunkBytes / header.chunkCount : 0, header.resyncBytes);
+    if (header.tuneLatencyUsec != MAXDWORD) {
+        // 最後の選局から最初のチャンクを取得するまでの時間
+        printf("tune: first chunk after %.1f ms\n", header.tuneLatencyUsec / 1000.0);
+    }
+    // 遅延は取得スレッドが取得しはじめてから応答に入れるまでの時間
+    printf("%5s %5s %8s %5s %6s %6s %10s %14s %10s %10s %6s %14s\n",
+           "index", "state", "priority", "flags", "lag", "maxlag", "chunks", "bytes", "p50(us)", "p99(us)", "drops", "dropbytes");
+    for (DWORD i = 0; i < header.connNum; ++i) {
+        BDP_STAT_CONNECTION sc;
+        memcpy(&sc, stat.data() + header.headerSize + header.connSize * i, sizeof(sc));
+        char flags[6] = "-----";
+        if (sc.flags & BDP_STAT_FLAG_OPEN_TUNER) {
+            flags[0] = 'O';
+        }
+        if (sc.flags & BDP_STAT_FLAG_FRAMED) {
+            flags[1] = 'F';
+        }
+        if (sc.flags & BDP_STAT_FLAG_PUSH) {
+            flags[2] = 'P';
+        }
+        if (sc.flags & BDP_STAT_FLAG_SHARED) {
+            flags[3] = 'S';
+        }
+        if (sc.flags & BDP_STAT_FLAG_PID_FILTER) {
+            flags[4] = 'X';
+        }
+        printf("%5lu %5lu %08lx %5s %6lu %6lu %10lu %14llu %10llu %10llu %6lu %14llu\n",
+               sc.index, sc.state, sc.priority, flags, sc.lag, sc.maxLag, sc.chunks, sc.bytes,
+               GetLatencyPercentile(sc.latencyHist, 50), GetLatencyPercentile(sc.latencyHist, 99), sc.dropCount, sc.dropBytes);
+    }
+    return 0;
+}
@@ -0,0 +1,243 @@
+﻿#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <wchar.h>
+#include <algorithm>
+#include <vector>
+#define BONSDK_IMPLEMENT
+#include "IBonDriver3.h"
+#include "../BonDriverLocalProxy/BonDriverLocalProxyDummyTs.h"
+
+namespace
+{
+const int TS_PACKET_SIZE = 188;
+const DWORD DEFAULT_BITRATE_KBPS = 16000;
+const DWORD DEFAULT_CHUNK_PACKETS = 256;
+const DWORD CHANNEL_NUM = 4;
+
+HINSTANCE g_hModule;
+
+// 決まったビットレートでTSを出力する計測用のドライバ
+class CDummyBonDriver : public IBonDriver3
+{
+public:
+    CDummyBonDriver();
+    STRUCT_IBONDRIVER3 &GetBonStruct3() { return m_bonStruct3; }
+    // IBonDriver3
+    const DWORD GetTotalDeviceNum() { return 1; }
+    const DWORD GetActiveDeviceNum() { return m_opened ? 1 : 0; }
+    const BOOL SetLnbPower(const BOOL bEnable) { static_cast<void>(bEnable); return TRUE; }
+    // IBonDriver2
+    LPCWSTR GetTunerName() { return L"Dummy"; }
+    const BOOL IsTunerOpening() { return m_opened; }
+    LPCWSTR EnumTuningSpace(const DWORD dwSpace) { return dwSpace == 0 ? L"Dummy" : nullptr; }
+    LPCWSTR EnumChannelName(const DWORD dwSpace, const DWORD dwChannel);
+    const BOOL SetChannel(const DWORD dwSpace, const DWORD dwChannel);
+    const DWORD GetCurSpace() { return 0; }
+    const DWORD GetCurChannel() { return m_channel; }
+    // IBonDriver
+    const BOOL OpenTuner();
+    void CloseTuner() { m_opened = FALSE; }
+    const BOOL SetChannel(const BYTE bCh) { return SetChannel(0, bCh); }
+    const float GetSignalLevel() { return m_opened ? m_bitrateKbps / 1000.0f : 0; }
+    const DWORD WaitTsStream(const DWORD dwTimeOut);
+    const DWORD GetReadyCount();
+    const BOOL GetTsStream(BYTE *pDst, DWORD *pdwSize, DWORD *pdwRemain);
+    const BOOL GetTsStream(BYTE **ppDst, DWORD *pdwSize, DWORD *pdwRemain);
+    void PurgeTsStream() { m_sentPackets = GetDuePackets(); }
+    void Release();
+private:
+    ULONGLONG GetDuePackets() const;
+    void MakePacket(BYTE *p, ULONGLONG index) const;
+    DWORD m_bitrateKbps;
+    DWORD m_chunkPackets;
+    BOOL m_opened;
+    DWORD m_channel;
+    LONGLONG m_freq;
+    LONGLONG m_startTime;
+    ULONGLONG m_sentPackets;
+    std::vector<BYTE> m_buf;
+    WCHAR m_channelName[16];
+    STRUCT_IBONDRIVER3 m_bonStruct3;
+};
+
+CDummyBonDriver *g_this;
+
+CDummyBonDriver::CDummyBonDriver()
+    : m_bitrateKbps(DEFAULT_BITRATE_KBPS)
+    , m_chunkPackets(DEFAULT_CHUNK_PACKETS)
+    , m_opened(FALSE)
+    , m_channel(0)
+    , m_startTime(0)
+    , m_sentPackets(0)
+{
+    // DLLと同名の設定ファイルから読む
+    WCHAR iniPath[MAX_PATH + 64];
+    DWORD len = GetModuleFileName(g_hModule, iniPath, MAX_PATH);
+    if (len && len < MAX_PATH && wcsrchr(iniPath, L'.')) {
+        wcscpy_s(wcsrchr(iniPath, L'.'), 5, L".ini");
+        m_bitrateKbps = GetPrivateProfileInt(L"Dummy", L"BitrateKbps", DEFAULT_BITRATE_KBPS, iniPath);
+        m_chunkPackets = GetPrivateProfileInt(L"Dummy", L"ChunkPackets", DEFAULT_CHUNK_PACKETS, iniPath);
+    }
+    m_bitrateKbps = std::min<DWORD>(std::max<DWORD>(m_bitrateKbps, 1), 1000000);
+    m_chunkPackets = std::min<DWORD>(std::max<DWORD>(m_chunkPackets, 1), 4096);
+    m_buf.resize(TS_PACKET_SIZE * m_chunkPackets);
+    LARGE_INTEGER freq;
+    m_freq = QueryPerformanceFrequency(&freq) ? freq.QuadPart : 1;
+}
+
+LPCWSTR CDummyBonDriver::EnumChannelName(const DWORD dwSpace, const DWORD dwChannel)
+{
+    if (dwSpace != 0 || dwChannel >= CHANNEL_NUM) {
+        return nullptr;
+    }
+    swprintf_s(m_channelName, L"Ch%lu", dwChannel + 1);
+    return m_channelName;
+}
+
+const BOOL CDummyBonDriver::SetChannel(const DWORD dwSpace, const DWORD dwChannel)
+{
+    if (!m_opened || dwSpace != 0 || dwChannel >= CHANNEL_NUM) {
+        return FALSE;
+    }
+    m_channel = dwChannel;
+    return TRUE;
+}
+
+const BOOL CDummyBonDriver::OpenTuner()
+{
+    if (!m_opened) {
+        LARGE_INTEGER now;
+        QueryPerformanceCounter(&now);
+        m_startTime = now.QuadPart;
+        m_sentPackets = 0;
+        m_opened = TRUE;
+    }
+    return TRUE;
+}
+
+ULONGLONG CDummyBonDriver::GetDuePackets() const
+{
+    if (!m_opened) {
+        return m_sentPackets;
+    }
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return static_cast<ULONGLONG>(static_cast<double>(now.QuadPart - m_startTime) / m_freq * m_bitrateKbps * 1000 / 8 / TS_PACKET_SIZE);
+}
+
+const DWORD CDummyBonDriver::WaitTsStream(const DWORD dwTimeOut)
+{
+    if (!m_opened) {
+        return WAIT_ABANDONED;
+    }
+    // 次のパケットを出力すべき時刻まで待つ
+    double packetMsec = 1000.0 * TS_PACKET_SIZE * 8 / (m_bitrateKbps * 1000.0);
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    double elapsedMsec = static_cast<double>(now.QuadPart - m_startTime) * 1000 / m_freq;
+    double waitMsec = (m_sentPackets + 1) * packetMsec - elapsedMsec;
+    if (waitMsec <= 0) {
+        return WAIT_OBJECT_0;
+    }
+    if (waitMsec > dwTimeOut) {
+        Sleep(dwTimeOut);
+        return WAIT_TIMEOUT;
+    }
+    Sleep(static_cast<DWORD>(waitMsec) + 1);
+    return WAIT_OBJECT_0;
+}
+
+const DWORD CDummyBonDriver::GetReadyCount()
+{
+    ULONGLONG n = GetDuePackets() - m_sentPackets;
+    return static_cast<DWORD>(std::min<ULONGLONG>((n + m_chunkPackets - 1) / m_chunkPackets, 0xFFFFFFFF));
+}
+
+const BOOL CDummyBonDriver::GetTsStream(BYTE *pDst, DWORD *pdwSize, DWORD *pdwRemain)
+{
+    if (!pDst || !pdwSize || !m_opened) {
+        return FALSE;
+    }
+    // *pdwSizeをバッファの大きさとみなし、収まるパケットだけ直接生成する(0は不明とみなしてBonDriver_Proxyと同じく48128バイトまで)
+    DWORD capacity = *pdwSize != 0 ? *pdwSize : 48128;
+    ULONGLONG due = GetDuePackets();
+    DWORD n = static_cast<DWORD>(std::min<ULONGLONG>(due - m_sentPackets, std::min<DWORD>(m_chunkPackets, capacity / TS_PACKET_SIZE)));
+    for (DWORD i = 0; i < n; ++i) {
+        MakePacket(pDst + TS_PACKET_SIZE * i, m_sentPackets++);
+    }
+    *pdwSize = TS_PACKET_SIZE * n;
+    if (pdwRemain) {
+        *pdwRemain = due > m_sentPackets ? 1 : 0;
+    }
+    return TRUE;
+}
+
+const BOOL CDummyBonDriver::GetTsStream(BYTE **ppDst, DWORD *pdwSize, DWORD *pdwRemain)
+{
+    if (!ppDst || !pdwSize || !m_opened) {
+        return FALSE;
+    }
+    ULONGLONG due = GetDuePackets();
+    DWORD n = static_cast<DWORD>(std::min<ULONGLONG>(due - m_sentPackets, m_chunkPackets));
+    for (DWORD i = 0; i < n; ++i) {
+        MakePacket(m_buf.data() + TS_PACKET_SIZE * i, m_sentPackets++);
+    }
+    *ppDst = m_buf.data();
+    *pdwSize = TS_PACKET_SIZE * n;
+    if (pdwRemain) {
+        *pdwRemain = due > m_sentPackets ? 1 : 0;
+    }
+    return TRUE;
+}
+
+void CDummyBonDriver::MakePacket(BYTE *p, ULONGLONG index) const
+{
+    // 遅延を計測できるように、ビットレートどおりに出力すべきだった時刻(QueryPerformanceCounter()の値)を入れる
+    LONGLONG t = m_startTime + static_cast<LONGLONG>(static_cast<double>(index) * TS_PACKET_SIZE * 8 / (m_bitrateKbps * 1000.0) * m_freq);
+    MakeDummyPacket(p, index, t);
+}
+
+void CDummyBonDriver::Release()
+{
+    g_this = nullptr;
+    delete this;
+}
+}
+
+BOOL APIENTRY DllMain(HINSTANCE hModule, DWORD dwReason, LPVOID lpReserved)
+{
+    static_cast<void>(lpReserved);
+    switch (dwReason) {
+    case DLL_PROCESS_ATTACH:
+        g_hModule = hModule;
+        break;
+    case DLL_PROCESS_DETACH:
+        if (g_this) {
+            OutputDebugString(L"BonDriver_Dummy::DllMain(): Driver Is Not Released!\n");
+            g_this->Release();
+        }
+        break;
+    }
+    return TRUE;
+}
+
+// CreateBonDriver()は呼出規約等がMSVC仕様なオブジェクトを返すことがほぼ前提のため、他のコンパイラではエクスポートしない
+#ifdef _MSC_VER
+extern "C" BONAPI
+#else
+static
+#endif
+IBonDriver * CreateBonDriver(void)
+{
+    if (!g_this) {
+        g_this = new CDummyBonDriver;
+    }
+    return g_this;
+}
+
+extern "C" BONAPI const STRUCT_IBONDRIVER * CreateBonStruct(void)
+{
+    CreateBonDriver();
+    return &g_this->GetBonStruct3().Initialize(g_this, nullptr);
+}
@@ -1,423 +1,1219 @@
-﻿#include "BonDriver_Proxy.h"
-#include <string.h>
-#include <wchar.h>
-
-namespace
-{
-IBonDriver *g_this;
-HINSTANCE g_hModule;
-}
-
-CProxyClient3::CProxyClient3(HANDLE hPipe)
-    : m_hPipe(hPipe)
-{
-    InitializeCriticalSection(&m_cs);
-}
-
-DWORD CProxyClient3::CreateBon(LPCWSTR param)
-{
-    DWORD priority = 0xFF00;
-    if (param) {
-        WCHAR c = param[0];
-        if (L'a' <= c && c <= L'z') {
-            c = c - L'a' + L'A';
-        }
-        priority = L'0' <= c && c <= L'4' ? 0x0200 + c - L'0' :
-                   L'5' <= c && c <= L'9' ? 0x0300 + c - L'5' :
-                   L'A' <= c && c <= L'G' ? 0x0400 + c - L'A' :
-                   L'H' <= c && c <= L'N' ? 0x0500 + c - L'H' :
-                   L'O' <= c && c <= L'T' ? 0x0600 + c - L'O' :
-                   L'U' <= c && c <= L'Z' ? 0x0700 + c - L'U' : 0x0100;
-    }
-    CBlockLock lock(&m_cs);
-    DWORD n;
-    return WriteAndRead4(&n, "Crea", &priority) ? n : 0xFFFFFFFF;
-}
-
-const DWORD CProxyClient3::GetTotalDeviceNum()
-{
-    CBlockLock lock(&m_cs);
-    DWORD n;
-    return WriteAndRead4(&n, "GTot") ? n : 0;
-}
-
-const DWORD CProxyClient3::GetActiveDeviceNum()
-{
-    CBlockLock lock(&m_cs);
-    DWORD n;
-    return WriteAndRead4(&n, "GAct") ? n : 0;
-}
-
-const BOOL CProxyClient3::SetLnbPower(const BOOL bEnable)
-{
-    CBlockLock lock(&m_cs);
-    BOOL b;
-    return WriteAndRead4(&b, "SLnb", &bEnable) ? b : FALSE;
-}
-
-LPCWSTR CProxyClient3::GetTunerName()
-{
-    CBlockLock lock(&m_cs);
-    if (WriteAndReadString(m_tunerName, "GTun")) {
-        return m_tunerName;
-    }
-    return nullptr;
-}
-
-const BOOL CProxyClient3::IsTunerOpening()
-{
-    CBlockLock lock(&m_cs);
-    BOOL b;
-    return WriteAndRead4(&b, "ITun") ? b : FALSE;
-}
-
-LPCWSTR CProxyClient3::EnumTuningSpace(const DWORD dwSpace)
-{
-    CBlockLock lock(&m_cs);
-    if (WriteAndReadString(m_tuningSpace, "ETun", &dwSpace)) {
-        return m_tuningSpace;
-    }
-    return nullptr;
-}
-
-LPCWSTR CProxyClient3::EnumChannelName(const DWORD dwSpace, const DWORD dwChannel)
-{
-    CBlockLock lock(&m_cs);
-    if (WriteAndReadString(m_channelName, "ECha", &dwSpace, &dwChannel)) {
-        return m_channelName;
-    }
-    return nullptr;
-}
-
-const BOOL CProxyClient3::SetChannel(const DWORD dwSpace, const DWORD dwChannel)
-{
-    CBlockLock lock(&m_cs);
-    BOOL b;
-    return WriteAndRead4(&b, "SCh2", &dwSpace, &dwChannel) ? b : FALSE;
-}
-
-const DWORD CProxyClient3::GetCurSpace()
-{
-    CBlockLock lock(&m_cs);
-    DWORD n;
-    return WriteAndRead4(&n, "GCSp") ? n : 0xFFFFFFFF;
-}
-
-const DWORD CProxyClient3::GetCurChannel()
-{
-    CBlockLock lock(&m_cs);
-    DWORD n;
-    return WriteAndRead4(&n, "GCCh") ? n : 0xFFFFFFFF;
-}
-
-const BOOL CProxyClient3::OpenTuner()
-{
-    CBlockLock lock(&m_cs);
-    BOOL b;
-    return WriteAndRead4(&b, "Open") ? b : FALSE;
-}
-
-void CProxyClient3::CloseTuner()
-{
-    CBlockLock lock(&m_cs);
-    DWORD n;
-    WriteAndRead4(&n, "Clos");
-}
-
-const BOOL CProxyClient3::SetChannel(const BYTE bCh)
-{
-    CBlockLock lock(&m_cs);
-    DWORD ch = bCh;
-    BOOL b;
-    return WriteAndRead4(&b, "SCha", &ch) ? b : FALSE;
-}
-
-const float CProxyClient3::GetSignalLevel()
-{
-    CBlockLock lock(&m_cs);
-    float f;
-    return WriteAndRead4(&f, "GSig") ? f : 0;
-}
-
-const DWORD CProxyClient3::WaitTsStream(const DWORD dwTimeOut)
-{
-    // 実装しない(中断用のイベントを指定できないなど使い勝手が悪く、利用例を知らないため)
-    static_cast<void>(dwTimeOut);
-    return WAIT_ABANDONED;
-}
-
-const DWORD CProxyClient3::GetReadyCount()
-{
-    CBlockLock lock(&m_cs);
-    DWORD n;
-    return WriteAndRead4(&n, "GRea") ? n : 0;
-}
-
-const BOOL CProxyClient3::GetTsStream(BYTE *pDst, DWORD *pdwSize, DWORD *pdwRemain)
-{
-    // 実装しない(仕様上、安全な利用法がおそらく無く、利用例を知らないため)
-    static_cast<void>(pDst);
-    static_cast<void>(pdwSize);
-    static_cast<void>(pdwRemain);
-    return FALSE;
-}
-
-const BOOL CProxyClient3::GetTsStream(BYTE **ppDst, DWORD *pdwSize, DWORD *pdwRemain)
-{
-    CBlockLock lock(&m_cs);
-    if (ppDst && pdwSize) {
-        DWORD tsBufSize = 0;
-        DWORD tsRemain = 0;
-        DWORD n;
-        if (WriteAndRead4(&n, "GTsS")) {
-            if (n < 4 || n - 4 > sizeof(m_tsBuf)) {
-                // 戻り値が異常
-                CloseHandle(m_hPipe);
-                m_hPipe = INVALID_HANDLE_VALUE;
-            }
-            else if (ReadAll(&tsRemain, 4) && ReadAll(m_tsBuf, n - 4)) {
-                tsBufSize = n - 4;
-            }
-        }
-        *ppDst = m_tsBuf;
-        *pdwSize = tsBufSize;
-        if (pdwRemain) {
-            *pdwRemain = tsBufSize == 0 ? 0 : tsRemain;
-        }
-        return TRUE;
-    }
-    return FALSE;
-}
-
-void CProxyClient3::PurgeTsStream()
-{
-    CBlockLock lock(&m_cs);
-    DWORD n;
-    WriteAndRead4(&n, "Purg");
-}
-
-void CProxyClient3::Release()
-{
-    DWORD n;
-    if (WriteAndRead4(&n, "Rele")) {
-        CloseHandle(m_hPipe);
-    }
-    DeleteCriticalSection(&m_cs);
-    g_this = nullptr;
-    delete this;
-}
-
-bool CProxyClient3::WriteAndRead4(void *buf, const char (&cmd)[5], const void *param1, const void *param2)
-{
-    return Write(cmd, param1, param2) && ReadAll(buf, 4);
-}
-
-bool CProxyClient3::WriteAndReadString(WCHAR (&buf)[256], const char (&cmd)[5], const void *param1, const void *param2)
-{
-    DWORD n;
-    if (WriteAndRead4(&n, cmd, param1, param2)) {
-        n %= 256;
-        if (n != 0 && ReadAll(buf, n * sizeof(WCHAR))) {
-            buf[n] = L'\0';
-            return true;
-        }
-    }
-    return false;
-}
-
-bool CProxyClient3::Write(const char (&cmd)[5], const void *param1, const void *param2)
-{
-    if (m_hPipe != INVALID_HANDLE_VALUE) {
-        BYTE buf[12] = {};
-        memcpy(buf, cmd, 4);
-        if (param1) {
-            memcpy(buf + 4, param1, 4);
-        }
-        if (param2) {
-            memcpy(buf + 8, param2, 4);
-        }
-        DWORD n;
-        if (WriteFile(m_hPipe, buf, 12, &n, nullptr) && n == 12) {
-            return true;
-        }
-        CloseHandle(m_hPipe);
-        m_hPipe = INVALID_HANDLE_VALUE;
-    }
-    return false;
-}
-
-bool CProxyClient3::ReadAll(void *buf, DWORD len)
-{
-    if (m_hPipe != INVALID_HANDLE_VALUE) {
-        for (DWORD n = 0, m; n < len; n += m) {
-            if (!ReadFile(m_hPipe, static_cast<BYTE*>(buf) + n, len - n, &m, nullptr)) {
-                CloseHandle(m_hPipe);
-                m_hPipe = INVALID_HANDLE_VALUE;
-                return false;
-            }
-        }
-        return true;
-    }
-    return false;
-}
-
-BOOL APIENTRY DllMain(HINSTANCE hModule, DWORD dwReason, LPVOID lpReserved)
-{
-    static_cast<void>(lpReserved);
-    switch (dwReason) {
-    case DLL_PROCESS_ATTACH:
-        g_hModule = hModule;
-        break;
-    case DLL_PROCESS_DETACH:
-        if (g_this) {
-            OutputDebugString(L"BonDriver_Proxy::DllMain(): Driver Is Not Released!\n");
-            g_this->Release();
-        }
-        break;
-    }
-    return TRUE;
-}
-
-// CreateBonDriver()は呼出規約等がMSVC仕様なオブジェクトを返すことがほぼ前提のため、他のコンパイラではエクスポートしない
-#ifdef _MSC_VER
-extern "C" BONAPI
-#else
-static
-#endif
-IBonDriver * CreateBonDriver(void)
-{
-    if (!g_this) {
-        WCHAR exePath[MAX_PATH + 64] = {};
-        {
-            // "BonDriverLocalProxy.exe"を探す
-            WCHAR path[MAX_PATH + 64];
-            DWORD len = GetModuleFileName(nullptr, path, MAX_PATH);
-            if (len && len < MAX_PATH && wcsrchr(path, L'\\')) {
-                *wcsrchr(path, L'\\') = L'\0';
-                if (wcsrchr(path, L'\\')) {
-                    *wcsrchr(path, L'\\') = L'\0';
-                    wcscat_s(path, L"\\BonDriverProxy\\BonDriverLocalProxy.exe");
-                    DWORD attr = GetFileAttributes(path);
-                    DWORD err = GetLastError();
-                    if (attr != INVALID_FILE_ATTRIBUTES || (err != ERROR_FILE_NOT_FOUND && err != ERROR_PATH_NOT_FOUND)) {
-                        wcscpy_s(exePath, path);
-                    }
-                }
-            }
-            if (!exePath[0]) {
-                len = GetEnvironmentVariable(L"SystemDrive", path, MAX_PATH);
-                if (len && len < MAX_PATH) {
-                    wcscat_s(path, L"\\BonDriverProxy\\BonDriverLocalProxy.exe");
-                    DWORD attr = GetFileAttributes(path);
-                    DWORD err = GetLastError();
-                    if (attr != INVALID_FILE_ATTRIBUTES || (err != ERROR_FILE_NOT_FOUND && err != ERROR_PATH_NOT_FOUND)) {
-                        wcscpy_s(exePath, path);
-                    }
-                }
-            }
-        }
-
-        WCHAR pathBuf[MAX_PATH];
-        LPWSTR param = nullptr;
-        LPWSTR origin = nullptr;
-        {
-            // DLLの名前から代理元のドライバ名とパラメータを抽出
-            WCHAR path[MAX_PATH];
-            DWORD len = GetModuleFileName(g_hModule, path, MAX_PATH);
-            if (len && len < MAX_PATH) {
-                len = GetLongPathName(path, pathBuf, MAX_PATH);
-                if (len && len < MAX_PATH && wcsrchr(pathBuf, L'\\')) {
-                    param = wcsrchr(pathBuf, L'\\') + 1;
-                    if (wcsrchr(param, L'.')) {
-                        *wcsrchr(param, L'.') = L'\0';
-                    }
-                    if (_wcsnicmp(param, L"BonDriver_Proxy", 15) == 0) {
-                        param += 15;
-                        origin = wcschr(param, L'_');
-                        if (origin) {
-                            *(origin++) = L'\0';
-                        }
-                    }
-                    else if (_wcsnicmp(param, L"BonDriver_", 10) == 0) {
-                        origin = param + 10;
-                        param = nullptr;
-                    }
-                }
-            }
-        }
-
-        if (exePath[0] && origin) {
-            // 代理元プロセスに接続(タイムアウトは20秒)
-            HANDLE hProcess = nullptr;
-            for (int retry = 0; retry < 1000; ++retry) {
-                WCHAR pipeName[MAX_PATH + 64];
-                wcscpy_s(pipeName, L"\\\\.\\pipe\\BonDriverLocalProxy_");
-                wcscat_s(pipeName, origin);
-                HANDLE hPipe = CreateFile(pipeName, GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
-                if (hPipe != INVALID_HANDLE_VALUE) {
-                    CProxyClient3 *down = new CProxyClient3(hPipe);
-                    DWORD type = down->CreateBon(param);
-                    if (type != 0xFFFFFFFF) {
-                        if (type == 0) {
-                            // 初期化に失敗
-                            down->Release();
-                        }
-                        else if (type == 1) {
-                            g_this = new CProxyClient(down);
-                        }
-                        else if (type == 2) {
-                            g_this = new CProxyClient2(down);
-                        }
-                        else {
-                            g_this = down;
-                        }
-                        break;
-                    }
-                    // 初期化中に切断
-                    down->Release();
-                }
-                if (hProcess) {
-                    if (WaitForSingleObject(hProcess, 0) == WAIT_OBJECT_0) {
-                        CloseHandle(hProcess);
-                        hProcess = nullptr;
-                    }
-                }
-                if (!hProcess) {
-                    WCHAR exeParam[MAX_PATH + 16];
-                    wcscpy_s(exeParam, L" \"");
-                    wcscat_s(exeParam, origin);
-                    wcscat_s(exeParam, L"\"");
-                    STARTUPINFO si = {};
-                    si.cb = sizeof(si);
-                    PROCESS_INFORMATION pi;
-                    if (CreateProcess(exePath, exeParam, nullptr, nullptr, FALSE, 0, nullptr, nullptr, &si, &pi)) {
-                        CloseHandle(pi.hThread);
-                        hProcess = pi.hProcess;
-                    }
-                }
-                Sleep(20);
-            }
-            if (hProcess) {
-                CloseHandle(hProcess);
-            }
-        }
-    }
-    return g_this;
-}
-
-extern "C" BONAPI const STRUCT_IBONDRIVER * CreateBonStruct(void)
-{
-    if (CreateBonDriver()) {
-        CProxyClient3 *cli3 = dynamic_cast<CProxyClient3*>(g_this);
-        if (cli3) {
-            return &cli3->GetBonStruct3().Initialize(cli3, nullptr);
-        }
-        CProxyClient2 *cli2 = dynamic_cast<CProxyClient2*>(g_this);
-        if (cli2) {
-            return &cli2->GetBonStruct2().Initialize(cli2, nullptr);
-        }
-        CProxyClient *cli = static_cast<CProxyClient*>(g_this);
-        return &cli->GetBonStruct().Initialize(cli, nullptr);
-    }
-    return nullptr;
-}
+﻿#include "BonDriver_Proxy.h"
+#include <process.h>
+#include <string.h>
+#include <wchar.h>
+
+namespace
+{
+IBonDriver *g_this;
+HINSTANCE g_hModule;
+
+// サーバに要求する機能(Creaの第2引数)
+const DWORD BDP_FEATURE_SHARED_RING = 0x01;
+const DWORD BDP_FEATURE_PUSH = 0x02;
+const DWORD BDP_FEATURE_FRAMED = 0x04;
+const DWORD BDP_FEATURE_CHANNEL_TABLE = 0x08;
+const DWORD BDP_FEATURE_PID_FILTER = 0x10;
+const DWORD BDP_FEATURE_LAG_POLICY = 0x20;
+const DWORD BDP_FEATURE_DATA_EVENT = 0x40;
+const DWORD BDP_FEATURE_TUNE_WAIT = 0x80;
+const DWORD BDP_FEATURE_STATUS_BLOCK = 0x100;
+const DWORD BDP_CHANNEL_TABLE_MAX = 1024 * 1024;
+
+// サーバがシグナルレベル等を定期的に書き込む共有メモリ(書き込み中はseqが奇数)
+struct BDP_SHARED_STATUS {
+    LONG seq;
+    DWORD intervalMsec;
+    DWORD sampleTick;
+    BOOL active;
+    float signalLevel;
+    DWORD curSpace;
+    DWORD curChannel;
+    BOOL tunerOpening;
+    BYTE reserved[32];
+};
+
+// 共有メモリの状態を読む。書き込み中でなく、サーバが書き込みを続けていればtrue
+bool ReadSharedStatus(const BYTE *view, BDP_SHARED_STATUS &status)
+{
+    if (!view) {
+        return false;
+    }
+    const volatile LONG &seq = reinterpret_cast<const BDP_SHARED_STATUS*>(view)->seq;
+    for (int retry = 0; retry < 100; ++retry) {
+        LONG before = seq;
+        if (before & 1) {
+            // 書き込みはすぐに終わる
+            Sleep(0);
+            continue;
+        }
+        MemoryBarrier();
+        memcpy(&status, view, sizeof(status));
+        MemoryBarrier();
+        if (seq == before) {
+            // 間隔の2倍と1秒を過ぎても更新されていなければ、選局等で止まっているとみなす
+            return status.active && GetTickCount() - status.sampleTick <= status.intervalMsec * 2 + 1000;
+        }
+    }
+    return false;
+}
+}
+
+CProxyClient3::CProxyClient3(HANDLE hPipe, LPCWSTR pipeName)
+    : m_hPipe(hPipe)
+    , m_features(0)
+    , m_pendingCount(0)
+    , m_hDataEvent(nullptr)
+    , m_dataWaitArmed(false)
+    , m_hRingMap(nullptr)
+    , m_ringView(nullptr)
+    , m_ringViewSize(0)
+    , m_ringData(nullptr)
+    , m_ringMirror(nullptr)
+    , m_statusView(nullptr)
+    , m_pushTried(false)
+    , m_hPushPipe(INVALID_HANDLE_VALUE)
+    , m_hPushThread(nullptr)
+    , m_hPushStopEvent(nullptr)
+    , m_hPushSpaceEvent(nullptr)
+    , m_hPushDataEvent(nullptr)
+    , m_pushHead(0)
+    , m_pushTail(0)
+    , m_pushReleased(0)
+    , m_pushHeld(false)
+    , m_tableLoaded(false)
+    , m_tableComplete(false)
+    , m_copyPendingPos(0)
+    , m_copyPendingSize(0)
+    , m_copyRemain(0)
+    , m_replyPos(0)
+    , m_replyCount(0)
+{
+    wcscpy_s(m_pipeName, pipeName);
+    InitializeCriticalSection(&m_cs);
+    InitializeCriticalSection(&m_pushCs);
+}
+
+DWORD CProxyClient3::CreateBon(LPCWSTR param)
+{
+    DWORD priority = 0xFF00;
+    if (param) {
+        WCHAR c = param[0];
+        if (L'a' <= c && c <= L'z') {
+            c = c - L'a' + L'A';
+        }
+        priority = L'0' <= c && c <= L'4' ? 0x0200 + c - L'0' :
+                   L'5' <= c && c <= L'9' ? 0x0300 + c - L'5' :
+                   L'A' <= c && c <= L'G' ? 0x0400 + c - L'A' :
+                   L'H' <= c && c <= L'N' ? 0x0500 + c - L'H' :
+                   L'O' <= c && c <= L'T' ? 0x0600 + c - L'O' :
+                   L'U' <= c && c <= L'Z' ? 0x0700 + c - L'U' : 0x0100;
+    }
+    CBlockLock lock(&m_cs);
+    DWORD features = BDP_FEATURE_SHARED_RING | BDP_FEATURE_PUSH | BDP_FEATURE_FRAMED | BDP_FEATURE_CHANNEL_TABLE |
+                     BDP_FEATURE_PID_FILTER | BDP_FEATURE_LAG_POLICY | BDP_FEATURE_DATA_EVENT | BDP_FEATURE_TUNE_WAIT |
+                     BDP_FEATURE_STATUS_BLOCK;
+    DWORD n;
+    if (!Call<BDP_CMD_Crea>(n, priority, features)) {
+        return 0xFFFFFFFF;
+    }
+    // 古いサーバは機能を返さない
+    if ((n & 0xFF) != 0) {
+        m_features = (n >> 8) & features;
+        // フィルタされたものは共有メモリからは受け取れない
+        bool filtered = (m_features & BDP_FEATURE_PID_FILTER) && SetPidFilter();
+        if (m_features & BDP_FEATURE_LAG_POLICY) {
+            SetLagPolicy();
+        }
+        if ((m_features & BDP_FEATURE_SHARED_RING) && !filtered) {
+            OpenSharedRing();
+        }
+        if ((m_features & BDP_FEATURE_CHANNEL_TABLE) && (n & 0xFF) >= 2) {
+            LoadChannelTable();
+        }
+        if (m_features & BDP_FEATURE_DATA_EVENT) {
+            OpenDataEvent();
+        }
+        if (m_features & BDP_FEATURE_STATUS_BLOCK) {
+            OpenSharedStatus();
+        }
+    }
+    return n & 0xFF;
+}
+
+const DWORD CProxyClient3::GetTotalDeviceNum()
+{
+    CBlockLock lock(&m_cs);
+    DWORD n;
+    return Call<BDP_CMD_GTot>(n) ? n : 0;
+}
+
+const DWORD CProxyClient3::GetActiveDeviceNum()
+{
+    CBlockLock lock(&m_cs);
+    DWORD n;
+    return Call<BDP_CMD_GAct>(n) ? n : 0;
+}
+
+const BOOL CProxyClient3::SetLnbPower(const BOOL bEnable)
+{
+    CBlockLock lock(&m_cs);
+    BOOL b;
+    return Call<BDP_CMD_SLnb>(b, bEnable) ? b : FALSE;
+}
+
+LPCWSTR CProxyClient3::GetTunerName()
+{
+    CBlockLock lock(&m_cs);
+    if (m_tableLoaded) {
+        return m_tableTunerName[0] ? m_tableTunerName : nullptr;
+    }
+    if (Call<BDP_CMD_GTun>(m_tunerName)) {
+        return m_tunerName;
+    }
+    return nullptr;
+}
+
+const BOOL CProxyClient3::IsTunerOpening()
+{
+    // 共有メモリから読めればサーバに問い合わせない(m_csも取らない)
+    BDP_SHARED_STATUS status;
+    if (ReadSharedStatus(m_statusView, status)) {
+        return status.tunerOpening;
+    }
+    CBlockLock lock(&m_cs);
+    BOOL b;
+    return Call<BDP_CMD_ITun>(b) ? b : FALSE;
+}
+
+LPCWSTR CProxyClient3::EnumTuningSpace(const DWORD dwSpace)
+{
+    CBlockLock lock(&m_cs);
+    if (m_tableLoaded) {
+        if (dwSpace < m_tableSpaces.size()) {
+            return m_tableSpaces[dwSpace].name;
+        }
+        if (m_tableComplete) {
+            return nullptr;
+        }
+    }
+    if (Call<BDP_CMD_ETun>(m_tuningSpace, dwSpace)) {
+        return m_tuningSpace;
+    }
+    return nullptr;
+}
+
+LPCWSTR CProxyClient3::EnumChannelName(const DWORD dwSpace, const DWORD dwChannel)
+{
+    CBlockLock lock(&m_cs);
+    if (m_tableLoaded) {
+        if (dwSpace < m_tableSpaces.size() && dwChannel < m_tableSpaces[dwSpace].channels.size()) {
+            return m_tableSpaces[dwSpace].channels[dwChannel];
+        }
+        if (m_tableComplete) {
+            return nullptr;
+        }
+    }
+    if (Call<BDP_CMD_ECha>(m_channelName, dwSpace, dwChannel)) {
+        return m_channelName;
+    }
+    return nullptr;
+}
+
+const BOOL CProxyClient3::SetChannel(const DWORD dwSpace, const DWORD dwChannel)
+{
+    CBlockLock lock(&m_cs);
+    BOOL b;
+    return Call<BDP_CMD_SCh2>(b, dwSpace, dwChannel) ? b : FALSE;
+}
+
+const BOOL CProxyClient3::SetChannelAndWait(const DWORD dwSpace, const DWORD dwChannel, DWORD *pdwLatencyUsec)
+{
+    CBlockLock lock(&m_cs);
+    BDP_TUNE_RESULT tune;
+    tune.latencyUsec = 0xFFFFFFFF;
+    if (!(m_features & BDP_FEATURE_TUNE_WAIT)) {
+        // 待てないので選局だけする
+        BOOL b;
+        tune.result = Call<BDP_CMD_SCh2>(b, dwSpace, dwChannel) ? b : FALSE;
+    }
+    else if (!Call<BDP_CMD_TnWt>(tune, dwSpace, dwChannel)) {
+        tune.result = FALSE;
+        tune.latencyUsec = 0xFFFFFFFF;
+    }
+    if (pdwLatencyUsec) {
+        *pdwLatencyUsec = tune.latencyUsec;
+    }
+    return tune.result;
+}
+
+const DWORD CProxyClient3::GetCurSpace()
+{
+    BDP_SHARED_STATUS status;
+    if (ReadSharedStatus(m_statusView, status)) {
+        return status.curSpace;
+    }
+    CBlockLock lock(&m_cs);
+    DWORD n;
+    return Call<BDP_CMD_GCSp>(n) ? n : 0xFFFFFFFF;
+}
+
+const DWORD CProxyClient3::GetCurChannel()
+{
+    BDP_SHARED_STATUS status;
+    if (ReadSharedStatus(m_statusView, status)) {
+        return status.curChannel;
+    }
+    CBlockLock lock(&m_cs);
+    DWORD n;
+    return Call<BDP_CMD_GCCh>(n) ? n : 0xFFFFFFFF;
+}
+
+const BOOL CProxyClient3::OpenTuner()
+{
+    CBlockLock lock(&m_cs);
+    BOOL b;
+    return Call<BDP_CMD_Open>(b) ? b : FALSE;
+}
+
+void CProxyClient3::CloseTuner()
+{
+    CBlockLock lock(&m_cs);
+    DWORD n;
+    Call<BDP_CMD_Clos>(n);
+}
+
+const BOOL CProxyClient3::SetChannel(const BYTE bCh)
+{
+    CBlockLock lock(&m_cs);
+    BOOL b;
+    return Call<BDP_CMD_SCha>(b, bCh) ? b : FALSE;
+}
+
+const float CProxyClient3::GetSignalLevel()
+{
+    BDP_SHARED_STATUS status;
+    if (ReadSharedStatus(m_statusView, status)) {
+        return status.signalLevel;
+    }
+    CBlockLock lock(&m_cs);
+    float f;
+    return Call<BDP_CMD_GSig>(f) ? f : 0;
+}
+
+const DWORD CProxyClient3::WaitTsStream(const DWORD dwTimeOut)
+{
+    HANDLE hEvents[2] = {};
+    {
+        CBlockLock lock(&m_cs);
+        // 保留中のPurgなどを待つ前に反映させる
+        FlushDeferred();
+        if (m_hPushThread) {
+            CBlockLock pushLock(&m_pushCs);
+            if (m_pushHead != m_pushTail) {
+                return WAIT_OBJECT_0;
+            }
+            // 受信スレッドが終了していれば中断
+            hEvents[0] = m_hPushDataEvent;
+            hEvents[1] = m_hPushThread;
+        }
+        else if (m_hDataEvent && m_hPipe != INVALID_HANDLE_VALUE) {
+            if (!m_dataWaitArmed) {
+                // 前回は取得できたので続きがあるかもしれない
+                return WAIT_OBJECT_0;
+            }
+            // サーバは空を返したあとに新しいデータが届けばセットする
+            hEvents[0] = m_hDataEvent;
+        }
+        else {
+            // 古いサーバでは実装しない
+            return WAIT_ABANDONED;
+        }
+    }
+    DWORD ret = WaitForMultipleObjects(hEvents[1] ? 2 : 1, hEvents, FALSE, dwTimeOut);
+    return ret == WAIT_OBJECT_0 ? WAIT_OBJECT_0 : ret == WAIT_TIMEOUT ? WAIT_TIMEOUT : WAIT_ABANDONED;
+}
+
+const DWORD CProxyClient3::GetReadyCount()
+{
+    CBlockLock lock(&m_cs);
+    if (m_hPushThread) {
+        CBlockLock pushLock(&m_pushCs);
+        return m_pushTail - m_pushHead;
+    }
+    DWORD n;
+    return Call<BDP_CMD_GRea>(n) ? n : 0;
+}
+
+const BOOL CProxyClient3::GetTsStream(BYTE *pDst, DWORD *pdwSize, DWORD *pdwRemain)
+{
+    if (!pDst || !pdwSize) {
+        return FALSE;
+    }
+    CBlockLock lock(&m_cs);
+    // 呼び出し側が指定した大きさ(0は不明とみなす)に収まらなかったものは次の呼び出しで返す
+    DWORD capacity = *pdwSize != 0 ? *pdwSize : sizeof(m_tsBuf);
+    DWORD copySize = 0;
+    DWORD tsRemain = 0;
+    if (m_copyPendingSize != 0) {
+        copySize = m_copyPendingSize < capacity ? m_copyPendingSize : capacity;
+        memcpy(pDst, m_copyBuf + m_copyPendingPos, copySize);
+        m_copyPendingPos += copySize;
+        m_copyPendingSize -= copySize;
+        tsRemain = m_copyRemain;
+    }
+    else if (!m_hPushThread && !m_ringView && (m_pushTried || !(m_features & BDP_FEATURE_PUSH))) {
+        // パイプから直接読み込む(応答のデータはm_replyBufを経由させない)
+        BYTE cmd[12];
+        BdpMakeCommand<BDP_CMD_GTsS>(cmd, BDP_NONE(), BDP_NONE());
+        DWORD n;
+        if (Write(cmd, 8) && ReadResult(n)) {
+            if (n < 4 || n - 4 > sizeof(m_copyBuf)) {
+                // 戻り値が異常
+                CloseHandle(m_hPipe);
+                m_hPipe = INVALID_HANDLE_VALUE;
+            }
+            else if (ReadAll(&tsRemain, 4)) {
+                DWORD size = n - 4;
+                copySize = size < capacity ? size : capacity;
+                if (ReadAll(pDst, copySize) && ReadAll(m_copyBuf, size - copySize)) {
+                    m_copyPendingPos = 0;
+                    m_copyPendingSize = size - copySize;
+                    m_copyRemain = tsRemain;
+                }
+                else {
+                    copySize = 0;
+                }
+            }
+        }
+        m_dataWaitArmed = copySize == 0;
+    }
+    else {
+        BYTE *data;
+        DWORD size;
+        if (GetTsStream(&data, &size, &tsRemain) && size != 0) {
+            copySize = size < capacity ? size : capacity;
+            memcpy(pDst, data, copySize);
+            memcpy(m_copyBuf, data + copySize, size - copySize);
+            m_copyPendingPos = 0;
+            m_copyPendingSize = size - copySize;
+            m_copyRemain = tsRemain;
+        }
+    }
+    *pdwSize = copySize;
+    if (pdwRemain) {
+        *pdwRemain = copySize == 0 ? 0 : tsRemain + (m_copyPendingSize != 0 ? 1 : 0);
+    }
+    return TRUE;
+}
+
+const BOOL CProxyClient3::GetTsStream(BYTE **ppDst, DWORD *pdwSize, DWORD *pdwRemain)
+{
+    CBlockLock lock(&m_cs);
+    if (!m_pushTried && (m_features & BDP_FEATURE_PUSH)) {
+        // 最初の呼び出しでプッシュ配信を始める
+        m_pushTried = true;
+        if (!StartPushStream()) {
+            StopPushStream();
+        }
+    }
+    if (ppDst && pdwSize && m_hPushThread) {
+        // 受信スレッドが溜めたものを返す(次の呼び出しまで保持する)
+        CBlockLock pushLock(&m_pushCs);
+        if (m_pushHeld) {
+            m_pushHeld = false;
+            ++m_pushReleased;
+            SetEvent(m_hPushSpaceEvent);
+        }
+        DWORD tsBufSize = 0;
+        DWORD tsRemain = 0;
+        if (m_pushHead != m_pushTail) {
+            const PUSH_ITEM &item = m_pushQueue[m_pushHead++ % PUSH_QUEUE_NUM];
+            m_pushHeld = true;
+            *ppDst = const_cast<BYTE*>(item.data);
+            tsBufSize = item.size;
+            tsRemain = item.remain;
+        }
+        if (tsBufSize == 0) {
+            *ppDst = m_tsBuf;
+        }
+        *pdwSize = tsBufSize;
+        if (pdwRemain) {
+            *pdwRemain = tsBufSize == 0 ? 0 : tsRemain;
+        }
+        return TRUE;
+    }
+    if (ppDst && pdwSize && m_ringView) {
+        // 共有メモリ上のスロットを直接返す(サーバは次のコマンドまで上書きしない)
+        const BDP_SHARED_RING_HEADER &header = *reinterpret_cast<const BDP_SHARED_RING_HEADER*>(m_ringView);
+        DWORD tsBufSize = 0;
+        DWORD tsRemain = 0;
+        DWORD n;
+        if (Call<BDP_CMD_GTsP>(n) && n != 0xFFFFFFFF) {
+            if (n >= header.slotNum) {
+                // 戻り値が異常
+                CloseHandle(m_hPipe);
+                m_hPipe = INVALID_HANDLE_VALUE;
+            }
+            else {
+                PUSH_ITEM chunk;
+                if (GetSharedChunk(n, m_tsBuf, false, chunk)) {
+                    tsRemain = chunk.remain;
+                    tsBufSize = chunk.size;
+                    *ppDst = const_cast<BYTE*>(chunk.data);
+                }
+            }
+        }
+        if (tsBufSize == 0) {
+            *ppDst = m_tsBuf;
+        }
+        *pdwSize = tsBufSize;
+        if (pdwRemain) {
+            *pdwRemain = tsBufSize == 0 ? 0 : tsRemain;
+        }
+        m_dataWaitArmed = tsBufSize == 0;
+        return TRUE;
+    }
+    if (ppDst && pdwSize) {
+        BYTE *data = nullptr;
+        DWORD tsBufSize = 0;
+        DWORD tsRemain = 0;
+        DWORD n;
+        if (Call<BDP_CMD_GTsS>(n)) {
+            if (n < 4 || n - 4 > sizeof(m_tsBuf)) {
+                // 戻り値が異常
+                CloseHandle(m_hPipe);
+                m_hPipe = INVALID_HANDLE_VALUE;
+            }
+            else if (ReadAll(&tsRemain, 4)) {
+                // 読み込み済みの応答を直接指す
+                data = ReadInPlace(m_tsBuf, n - 4);
+                tsBufSize = data ? n - 4 : 0;
+            }
+        }
+        *ppDst = tsBufSize != 0 ? data : m_tsBuf;
+        *pdwSize = tsBufSize;
+        if (pdwRemain) {
+            *pdwRemain = tsBufSize == 0 ? 0 : tsRemain;
+        }
+        m_dataWaitArmed = tsBufSize == 0;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+void CProxyClient3::PurgeTsStream()
+{
+    CBlockLock lock(&m_cs);
+    m_copyPendingSize = 0;
+    if (!m_hPushThread) {
+        Defer<BDP_CMD_Purg>();
+        return;
+    }
+    DWORD n;
+    Call<BDP_CMD_Purg>(n);
+    if (m_hPushThread) {
+        // 受信済みのものも捨てる
+        CBlockLock pushLock(&m_pushCs);
+        m_pushHead = m_pushTail;
+        m_pushReleased = m_pushTail;
+        m_pushHeld = false;
+        SetEvent(m_hPushSpaceEvent);
+    }
+}
+
+void CProxyClient3::Release()
+{
+    StopPushStream();
+    DWORD n;
+    if (Call<BDP_CMD_Rele>(n)) {
+        CloseHandle(m_hPipe);
+    }
+    if (m_ringMirror) {
+        const BDP_SHARED_RING_HEADER &header = *reinterpret_cast<const BDP_SHARED_RING_HEADER*>(m_ringView);
+        UnmapMirroredView(m_ringMirror, header.dataSize);
+    }
+    if (m_ringView) {
+        UnmapSharedView(m_ringView, m_ringViewSize);
+    }
+    if (m_hRingMap) {
+        CloseSharedMap(m_hRingMap);
+    }
+    if (m_statusView) {
+        UnmapViewOfFile(m_statusView);
+    }
+    if (m_hDataEvent) {
+        CloseHandle(m_hDataEvent);
+    }
+    DeleteCriticalSection(&m_pushCs);
+    DeleteCriticalSection(&m_cs);
+    g_this = nullptr;
+    delete this;
+}
+
+void CProxyClient3::OpenSharedRing()
+{
+    WCHAR ringName[256];
+    if (Call<BDP_CMD_GRng>(ringName)) {
+        m_hRingMap = OpenSharedMap(ringName);
+        if (m_hRingMap) {
+            m_ringView = MapSharedView(m_hRingMap, false, m_ringViewSize);
+            if (m_ringView) {
+                const BDP_SHARED_RING_HEADER &header = *reinterpret_cast<const BDP_SHARED_RING_HEADER*>(m_ringView);
+                if (IsSharedRingHeaderValid(m_ringView, m_ringViewSize, 4 + sizeof(m_tsBuf))) {
+                    // できればサーバと同じく2重にマップする
+                    m_ringMirror = MapMirroredView(m_hRingMap, header.dataOffset, header.dataSize, false);
+                    m_ringData = m_ringMirror ? m_ringMirror : m_ringView + header.dataOffset;
+                    return;
+                }
+                UnmapSharedView(m_ringView, m_ringViewSize);
+                m_ringView = nullptr;
+            }
+            // 開けなければ従来どおりパイプで受け取る
+            CloseSharedMap(m_hRingMap);
+            m_hRingMap = nullptr;
+        }
+    }
+}
+
+void CProxyClient3::OpenSharedStatus()
+{
+    WCHAR statusName[256];
+    if (Call<BDP_CMD_GStb>(statusName) && statusName[0]) {
+        HANDLE hMap = OpenFileMapping(FILE_MAP_READ, FALSE, statusName);
+        if (hMap) {
+            m_statusView = static_cast<const BYTE*>(MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0));
+            // ビューがあればハンドルは不要
+            CloseHandle(hMap);
+            MEMORY_BASIC_INFORMATION mbi;
+            if (m_statusView && (!VirtualQuery(m_statusView, &mbi, sizeof(mbi)) || mbi.RegionSize < sizeof(BDP_SHARED_STATUS))) {
+                UnmapViewOfFile(m_statusView);
+                m_statusView = nullptr;
+            }
+        }
+    }
+}
+
+bool CProxyClient3::SetPidFilter()
+{
+    // DLLと同名の設定ファイルから読む
+    WCHAR iniPath[MAX_PATH + 64];
+    DWORD len = GetModuleFileName(g_hModule, iniPath, MAX_PATH);
+    if (!len || len >= MAX_PATH || !wcsrchr(iniPath, L'.')) {
+        return false;
+    }
+    wcscpy_s(wcsrchr(iniPath, L'.'), 5, L".ini");
+    WCHAR pids[1024];
+    GetPrivateProfileString(L"Filter", L"AllowPids", L"", pids, sizeof(pids) / sizeof(pids[0]), iniPath);
+    bool dropNull = GetPrivateProfileInt(L"Filter", L"DropNull", 0, iniPath) != 0;
+    if (!pids[0] && !dropNull) {
+        return false;
+    }
+    // AllowPidsがあればそれ以外を、DropNullならヌルパケットを除く
+    DWORD pid = 0xFFFFFFFF;
+    BOOL b = pids[0] ? FALSE : TRUE;
+    Defer<BDP_CMD_FPid>(pid, b);
+    b = TRUE;
+    for (LPWSTR p = pids; *p;) {
+        LPWSTR endp;
+        pid = wcstoul(p, &endp, 0);
+        if (endp != p && pid < 0x2000) {
+            Defer<BDP_CMD_FPid>(pid, b);
+        }
+        p = wcschr(endp, L',');
+        if (!p) {
+            break;
+        }
+        ++p;
+    }
+    if (dropNull) {
+        pid = 0x1FFF;
+        b = FALSE;
+        Defer<BDP_CMD_FPid>(pid, b);
+    }
+    return true;
+}
+
+bool CProxyClient3::GetSharedChunk(DWORD n, BYTE *copyBuf, bool copy, PUSH_ITEM &chunk) const
+{
+    DWORD dataSize = reinterpret_cast<const BDP_SHARED_RING_HEADER*>(m_ringView)->dataSize;
+    BDP_RING_SLOT slot;
+    if (!ReadSharedRingSlot(m_ringView, n, sizeof(m_tsBuf), slot)) {
+        return false;
+    }
+    // 先頭4バイトは残り数
+    BYTE remain[4];
+    memcpy(&chunk.remain, GetRingChunkSpan(m_ringData, dataSize, m_ringMirror != nullptr, slot.offset, 4, remain), 4);
+    chunk.size = slot.bufCount - 4;
+    // 2重にマップできなかったときは、末尾をまたぐものはcopyBufにつながる
+    chunk.data = GetRingChunkSpan(m_ringData, dataSize, m_ringMirror != nullptr, slot.offset + 4, chunk.size, copyBuf);
+    if (!copy) {
+        return true;
+    }
+    if (chunk.data != copyBuf) {
+        memcpy(copyBuf, chunk.data, chunk.size);
+        chunk.data = copyBuf;
+    }
+    return IsSharedRingSlotIntact(m_ringView, n, slot);
+}
+
+void CProxyClient3::SetLagPolicy()
+{
+    // 未指定ならサーバの設定に従う
+    WCHAR iniPath[MAX_PATH + 64];
+    DWORD len = GetModuleFileName(g_hModule, iniPath, MAX_PATH);
+    if (!len || len >= MAX_PATH || !wcsrchr(iniPath, L'.')) {
+        return;
+    }
+    wcscpy_s(wcsrchr(iniPath, L'.'), 5, L".ini");
+    DWORD maxLagBytes = GetPrivateProfileInt(L"Lag", L"MaxLagBytes", -1, iniPath);
+    DWORD lagPolicy = GetPrivateProfileInt(L"Lag", L"LagPolicy", -1, iniPath);
+    if (maxLagBytes != 0xFFFFFFFF || lagPolicy != 0xFFFFFFFF) {
+        Defer<BDP_CMD_SLag>(maxLagBytes, lagPolicy);
+    }
+}
+
+void CProxyClient3::OpenDataEvent()
+{
+    WCHAR eventName[256];
+    if (Call<BDP_CMD_GEvt>(eventName)) {
+        m_hDataEvent = OpenEvent(SYNCHRONIZE, FALSE, eventName);
+        // サーバは最初から待機状態にしている
+        m_dataWaitArmed = true;
+    }
+}
+
+void CProxyClient3::LoadChannelTable()
+{
+    DWORD n;
+    if (!Call<BDP_CMD_GTbl>(n)) {
+        return;
+    }
+    if (n < 4 || n > BDP_CHANNEL_TABLE_MAX || n % sizeof(WCHAR) != 0) {
+        // 戻り値が異常
+        CloseHandle(m_hPipe);
+        m_hPipe = INVALID_HANDLE_VALUE;
+        return;
+    }
+    DWORD complete;
+    // 末尾が途切れていても必ずNUL終端させる
+    m_tableBuf.reset(new WCHAR[(n - 4) / sizeof(WCHAR) + 1]);
+    if (!ReadAll(&complete, 4) || !ReadAll(m_tableBuf.get(), n - 4)) {
+        m_tableBuf.reset();
+        return;
+    }
+    LPCWSTR p = m_tableBuf.get();
+    LPCWSTR end = p + (n - 4) / sizeof(WCHAR);
+    m_tableBuf[end - p] = L'\0';
+    m_tableTunerName = p;
+    p += p < end ? wcslen(p) + 1 : 0;
+    // 空の文字列が列の終わりを表す
+    while (p < end && *p) {
+        TABLE_SPACE space;
+        space.name = p;
+        p += wcslen(p) + 1;
+        while (p < end && *p) {
+            space.channels.push_back(p);
+            p += wcslen(p) + 1;
+        }
+        m_tableSpaces.push_back(space);
+        ++p;
+    }
+    m_tableComplete = (complete & 1) && p < end;
+    m_tableLoaded = true;
+}
+
+bool CProxyClient3::StartPushStream()
+{
+    DWORD id;
+    if (!Call<BDP_CMD_GStm>(id)) {
+        return false;
+    }
+    // 配信用にもう1つ接続する
+    m_hPushPipe = CreateFile(m_pipeName, GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, nullptr);
+    if (m_hPushPipe == INVALID_HANDLE_VALUE && GetLastError() == ERROR_PIPE_BUSY && WaitNamedPipe(m_pipeName, 1000)) {
+        m_hPushPipe = CreateFile(m_pipeName, GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, nullptr);
+    }
+    if (m_hPushPipe == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    m_hPushStopEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+    m_hPushSpaceEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+    m_hPushDataEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+    if (!m_hPushStopEvent || !m_hPushSpaceEvent || !m_hPushDataEvent) {
+        return false;
+    }
+    OVERLAPPED ol = {};
+    ol.hEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+    if (!ol.hEvent) {
+        return false;
+    }
+    BYTE buf[12];
+    BOOL b = m_ringView != nullptr;
+    BdpMakeCommand<BDP_CMD_Strm>(buf, id, b);
+    bool ret = PushTransfer(true, buf, 12, &ol) && PushTransfer(false, &b, 4, &ol) && b;
+    CloseHandle(ol.hEvent);
+    if (!ret) {
+        return false;
+    }
+    // 共有メモリのときもここに複写する
+    m_pushBuf.reset(new BYTE[PUSH_QUEUE_NUM * sizeof(m_tsBuf)]);
+    m_hPushThread = reinterpret_cast<HANDLE>(_beginthreadex(nullptr, 0, PushThread, this, 0, nullptr));
+    return m_hPushThread != nullptr;
+}
+
+void CProxyClient3::StopPushStream()
+{
+    if (m_hPushThread) {
+        SetEvent(m_hPushStopEvent);
+        WaitForSingleObject(m_hPushThread, INFINITE);
+        CloseHandle(m_hPushThread);
+        m_hPushThread = nullptr;
+    }
+    if (m_hPushPipe != INVALID_HANDLE_VALUE) {
+        CloseHandle(m_hPushPipe);
+        m_hPushPipe = INVALID_HANDLE_VALUE;
+    }
+    if (m_hPushStopEvent) {
+        CloseHandle(m_hPushStopEvent);
+        m_hPushStopEvent = nullptr;
+    }
+    if (m_hPushSpaceEvent) {
+        CloseHandle(m_hPushSpaceEvent);
+        m_hPushSpaceEvent = nullptr;
+    }
+    if (m_hPushDataEvent) {
+        CloseHandle(m_hPushDataEvent);
+        m_hPushDataEvent = nullptr;
+    }
+    m_pushBuf.reset();
+}
+
+bool CProxyClient3::PushTransfer(bool write, void *buf, DWORD len, OVERLAPPED *ol)
+{
+    for (DWORD n = 0, m; n < len; n += m) {
+        BYTE *p = static_cast<BYTE*>(buf) + n;
+        if (!(write ? WriteFile(m_hPushPipe, p, len - n, nullptr, ol) : ReadFile(m_hPushPipe, p, len - n, nullptr, ol)) &&
+            GetLastError() != ERROR_IO_PENDING) {
+            return false;
+        }
+        HANDLE hEvents[] = { ol->hEvent, m_hPushStopEvent };
+        if (WaitForMultipleObjects(2, hEvents, FALSE, INFINITE) != WAIT_OBJECT_0) {
+            // 中断
+            CancelIo(m_hPushPipe);
+            GetOverlappedResult(m_hPushPipe, ol, &m, TRUE);
+            return false;
+        }
+        if (!GetOverlappedResult(m_hPushPipe, ol, &m, FALSE)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+unsigned int __stdcall CProxyClient3::PushThread(void *param)
+{
+    CProxyClient3 &o = *static_cast<CProxyClient3*>(param);
+    OVERLAPPED ol = {};
+    ol.hEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+    if (ol.hEvent) {
+        // 受け取れる数(クレジット)を使い切ったら、空きの数だけ追加で要求する
+        DWORD granted = 0;
+        DWORD releasedSent = 0;
+        for (;;) {
+            if (granted == 0) {
+                DWORD released;
+                DWORD freeNum;
+                {
+                    CBlockLock lock(&o.m_pushCs);
+                    // 共有メモリのときも受け取った時点で複写しているので保持させない
+                    released = o.m_pushTail;
+                    freeNum = PUSH_QUEUE_NUM - (o.m_pushTail - o.m_pushReleased);
+                }
+                if (freeNum == 0) {
+                    HANDLE hEvents[] = { o.m_hPushSpaceEvent, o.m_hPushStopEvent };
+                    if (WaitForMultipleObjects(2, hEvents, FALSE, INFINITE) != WAIT_OBJECT_0) {
+                        break;
+                    }
+                    continue;
+                }
+                BYTE buf[12];
+                BdpMakeCommand<BDP_CMD_Subs>(buf, released - releasedSent, freeNum);
+                if (!o.PushTransfer(true, buf, 12, &ol)) {
+                    break;
+                }
+                releasedSent = released;
+                granted = freeNum;
+            }
+            // m_pushTailを進めるのはこのスレッドだけ
+            PUSH_ITEM &item = o.m_pushQueue[o.m_pushTail % PUSH_QUEUE_NUM];
+            // 共有メモリでなければ残り数も続けて読む
+            DWORD head[2];
+            if (!o.PushTransfer(false, head, o.m_ringView ? 4 : 8, &ol)) {
+                break;
+            }
+            DWORD n = head[0];
+            if (o.m_ringView) {
+                const BDP_SHARED_RING_HEADER &header = *reinterpret_cast<const BDP_SHARED_RING_HEADER*>(o.m_ringView);
+                if (n >= header.slotNum) {
+                    // 戻り値が異常
+                    break;
+                }
+                // 受け取ったスロットは後続の配信で解放されうるので、すぐに複写する
+                if (!o.GetSharedChunk(n, o.m_pushBuf.get() + o.m_pushTail % PUSH_QUEUE_NUM * sizeof(o.m_tsBuf), true, item)) {
+                    item.size = 0;
+                }
+            }
+            else {
+                if (n < 4 || n - 4 > sizeof(o.m_tsBuf)) {
+                    // 戻り値が異常
+                    break;
+                }
+                BYTE *data = o.m_pushBuf.get() + o.m_pushTail % PUSH_QUEUE_NUM * sizeof(o.m_tsBuf);
+                item.remain = head[1];
+                if (!o.PushTransfer(false, data, n - 4, &ol)) {
+                    break;
+                }
+                item.size = n - 4;
+                item.data = data;
+            }
+            {
+                CBlockLock lock(&o.m_pushCs);
+                ++o.m_pushTail;
+            }
+            SetEvent(o.m_hPushDataEvent);
+            --granted;
+        }
+        CloseHandle(ol.hEvent);
+    }
+    return 0;
+}
+
+bool CProxyClient3::ReadResult(WCHAR (&ret)[256])
+{
+    DWORD n;
+    if (ReadAll(&n, 4)) {
+        n %= 256;
+        if (n != 0 && ReadAll(ret, n * sizeof(WCHAR))) {
+            ret[n] = L'\0';
+            return true;
+        }
+    }
+    return false;
+}
+
+bool CProxyClient3::Write(const BYTE (&cmd)[12], DWORD replyFixedSize)
+{
+    if (m_hPipe != INVALID_HANDLE_VALUE) {
+        BYTE buf[4 + 12 * (PENDING_CMD_MAX + 1)] = {};
+        DWORD n = 0;
+        DWORD pendingCount = 0;
+        if (m_features & BDP_FEATURE_FRAMED) {
+            // 保留中のコマンドを前に付けて1つのフレームで送る
+            pendingCount = m_pendingCount;
+            m_pendingCount = 0;
+            DWORD frameSize = 12 * (pendingCount + 1);
+            memcpy(buf, &frameSize, 4);
+            memcpy(buf + 4, m_pendingCmds, 12 * pendingCount);
+            n = 4 + 12 * pendingCount;
+        }
+        memcpy(buf + n, cmd, 12);
+        n += 12;
+        DWORD written;
+        m_replyPos = 0;
+        m_replyCount = 0;
+        if (WriteFile(m_hPipe, buf, n, &written, nullptr) && written == n) {
+            if (m_features & BDP_FEATURE_FRAMED) {
+                // 応答のフレームは1つだけなので、まとめて読んでおく(収まらなければ残りはReadAll()が読む)
+                // 固定部分の大きさが指定されていればそこまでにして、続くデータは呼び出し側のバッファに直接読ませる
+                DWORD readSize = sizeof(m_replyBuf);
+                if (replyFixedSize != MAXDWORD) {
+                    readSize = 4 + 4 * pendingCount + replyFixedSize;
+                }
+                if (!ReadFile(m_hPipe, m_replyBuf, readSize, &m_replyCount, nullptr)) {
+                    m_replyCount = 0;
+                    CloseHandle(m_hPipe);
+                    m_hPipe = INVALID_HANDLE_VALUE;
+                    return false;
+                }
+                // フレーム長と保留中のコマンドの応答を読み捨てる
+                DWORD frameSize;
+                if (!ReadAll(&frameSize, 4)) {
+                    return false;
+                }
+                for (; pendingCount > 0; --pendingCount) {
+                    DWORD ret;
+                    if (!ReadAll(&ret, 4)) {
+                        return false;
+                    }
+                }
+            }
+            return true;
+        }
+        CloseHandle(m_hPipe);
+        m_hPipe = INVALID_HANDLE_VALUE;
+    }
+    return false;
+}
+
+void CProxyClient3::Defer(const BYTE (&cmd)[12])
+{
+    if (!(m_features & BDP_FEATURE_FRAMED) || m_pendingCount >= PENDING_CMD_MAX) {
+        // まとめられなければ単独で送る
+        DWORD n;
+        if (Write(cmd)) {
+            ReadAll(&n, 4);
+        }
+        return;
+    }
+    // 結果を必要としないので次のコマンドとまとめて送る
+    memcpy(m_pendingCmds + 12 * m_pendingCount++, cmd, 12);
+}
+
+void CProxyClient3::FlushDeferred()
+{
+    if (m_pendingCount != 0) {
+        // 最後のものを単独のコマンドとして、残りをその前に付けて送る
+        BYTE cmd[12];
+        memcpy(cmd, m_pendingCmds + 12 * --m_pendingCount, 12);
+        DWORD n;
+        if (Write(cmd)) {
+            ReadAll(&n, 4);
+        }
+    }
+}
+
+bool CProxyClient3::ReadAll(void *buf, DWORD len)
+{
+    // 読み込み済みの応答から取り出す
+    DWORD n = m_replyCount - m_replyPos < len ? m_replyCount - m_replyPos : len;
+    memcpy(buf, m_replyBuf + m_replyPos, n);
+    m_replyPos += n;
+    if (n == len) {
+        return true;
+    }
+    if (m_hPipe != INVALID_HANDLE_VALUE) {
+        for (DWORD m; n < len; n += m) {
+            if (!ReadFile(m_hPipe, static_cast<BYTE*>(buf) + n, len - n, &m, nullptr)) {
+                CloseHandle(m_hPipe);
+                m_hPipe = INVALID_HANDLE_VALUE;
+                return false;
+            }
+        }
+        return true;
+    }
+    return false;
+}
+
+BYTE *CProxyClient3::ReadInPlace(BYTE *buf, DWORD len)
+{
+    if (m_replyCount - m_replyPos >= len) {
+        BYTE *p = m_replyBuf + m_replyPos;
+        m_replyPos += len;
+        return p;
+    }
+    return ReadAll(buf, len) ? buf : nullptr;
+}
+
+BOOL APIENTRY DllMain(HINSTANCE hModule, DWORD dwReason, LPVOID lpReserved)
+{
+    static_cast<void>(lpReserved);
+    switch (dwReason) {
+    case DLL_PROCESS_ATTACH:
+        g_hModule = hModule;
+        break;
+    case DLL_PROCESS_DETACH:
+        if (g_this) {
+            OutputDebugString(L"BonDriver_Proxy::DllMain(): Driver Is Not Released!\n");
+            g_this->Release();
+        }
+        break;
+    }
+    return TRUE;
+}
+
+// CreateBonDriver()は呼出規約等がMSVC仕様なオブジェクトを返すことがほぼ前提のため、他のコンパイラではエクスポートしない
+#ifdef _MSC_VER
+extern "C" BONAPI
+#else
+static
+#endif
+IBonDriver * CreateBonDriver(void)
+{
+    if (!g_this) {
+        WCHAR exePath[MAX_PATH + 64] = {};
+        {
+            // "BonDriverLocalProxy.exe"を探す
+            WCHAR path[MAX_PATH + 64];
+            DWORD len = GetModuleFileName(nullptr, path, MAX_PATH);
+            if (len && len < MAX_PATH && wcsrchr(path, L'\\')) {
+                *wcsrchr(path, L'\\') = L'\0';
+                if (wcsrchr(path, L'\\')) {
+                    *wcsrchr(path, L'\\') = L'\0';
+                    wcscat_s(path, L"\\BonDriverProxy\\BonDriverLocalProxy.exe");
+                    DWORD attr = GetFileAttributes(path);
+                    DWORD err = GetLastError();
+                    if (attr != INVALID_FILE_ATTRIBUTES || (err != ERROR_FILE_NOT_FOUND && err != ERROR_PATH_NOT_FOUND)) {
+                        wcscpy_s(exePath, path);
+                    }
+                }
+            }
+            if (!exePath[0]) {
+                len = GetEnvironmentVariable(L"SystemDrive", path, MAX_PATH);
+                if (len && len < MAX_PATH) {
+                    wcscat_s(path, L"\\BonDriverProxy\\BonDriverLocalProxy.exe");
+                    DWORD attr = GetFileAttributes(path);
+                    DWORD err = GetLastError();
+                    if (attr != INVALID_FILE_ATTRIBUTES || (err != ERROR_FILE_NOT_FOUND && err != ERROR_PATH_NOT_FOUND)) {
+                        wcscpy_s(exePath, path);
+                    }
+                }
+            }
+        }
+
+        WCHAR pathBuf[MAX_PATH];
+        LPWSTR param = nullptr;
+        LPWSTR origin = nullptr;
+        {
+            // DLLの名前から代理元のドライバ名とパラメータを抽出
+            WCHAR path[MAX_PATH];
+            DWORD len = GetModuleFileName(g_hModule, path, MAX_PATH);
+            if (len && len < MAX_PATH) {
+                len = GetLongPathName(path, pathBuf, MAX_PATH);
+                if (len && len < MAX_PATH && wcsrchr(pathBuf, L'\\')) {
+                    param = wcsrchr(pathBuf, L'\\') + 1;
+                    if (wcsrchr(param, L'.')) {
+                        *wcsrchr(param, L'.') = L'\0';
+                    }
+                    if (_wcsnicmp(param, L"BonDriver_Proxy", 15) == 0) {
+                        param += 15;
+                        origin = wcschr(param, L'_');
+                        if (origin) {
+                            *(origin++) = L'\0';
+                        }
+                    }
+                    else if (_wcsnicmp(param, L"BonDriver_", 10) == 0) {
+                        origin = param + 10;
+                        param = nullptr;
+                    }
+                }
+            }
+        }
+
+        if (exePath[0] && origin) {
+            // 代理元プロセスに接続(タイムアウトは20秒)
+            WCHAR pipeName[MAX_PATH + 64];
+            wcscpy_s(pipeName, L"\\\\.\\pipe\\BonDriverLocalProxy_");
+            wcscat_s(pipeName, origin);
+            // 代理元プロセスがパイプを用意するとセットされる
+            WCHAR readyName[MAX_PATH + 64];
+            wcscpy_s(readyName, L"BonDriverLocalProxy_Ready_");
+            wcscat_s(readyName, origin);
+            HANDLE hReadyEvent = CreateEvent(nullptr, TRUE, FALSE, readyName);
+            HANDLE hProcess = nullptr;
+            DWORD startTick = GetTickCount();
+            for (;;) {
+                DWORD elapsed = GetTickCount() - startTick;
+                if (elapsed >= 20000) {
+                    break;
+                }
+                HANDLE hPipe = CreateFile(pipeName, GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+                if (hPipe == INVALID_HANDLE_VALUE && GetLastError() == ERROR_PIPE_BUSY) {
+                    // 接続待ちのパイプが用意されるまで待つ
+                    WaitNamedPipe(pipeName, 20000 - elapsed);
+                    continue;
+                }
+                if (hPipe != INVALID_HANDLE_VALUE) {
+                    CProxyClient3 *down = new CProxyClient3(hPipe, pipeName);
+                    DWORD type = down->CreateBon(param);
+                    if (type != 0xFFFFFFFF) {
+                        if (type == 0) {
+                            // 初期化に失敗
+                            down->Release();
+                        }
+                        else if (type == 1) {
+                            g_this = new CProxyClient(down);
+                        }
+                        else if (type == 2) {
+                            g_this = new CProxyClient2(down);
+                        }
+                        else {
+                            g_this = down;
+                        }
+                        break;
+                    }
+                    // 初期化中に切断
+                    down->Release();
+                }
+                if (hProcess) {
+                    if (WaitForSingleObject(hProcess, 0) == WAIT_OBJECT_0) {
+                        CloseHandle(hProcess);
+                        hProcess = nullptr;
+                    }
+                }
+                if (!hProcess) {
+                    WCHAR exeParam[MAX_PATH + 16];
+                    wcscpy_s(exeParam, L" \"");
+                    wcscat_s(exeParam, origin);
+                    wcscat_s(exeParam, L"\"");
+                    STARTUPINFO si = {};
+                    si.cb = sizeof(si);
+                    PROCESS_INFORMATION pi;
+                    if (CreateProcess(exePath, exeParam, nullptr, nullptr, FALSE, 0, nullptr, nullptr, &si, &pi)) {
+                        CloseHandle(pi.hThread);
+                        hProcess = pi.hProcess;
+                    }
+                }
+                if (hReadyEvent && hProcess && WaitForSingleObject(hReadyEvent, 0) == WAIT_TIMEOUT) {
+                    // 準備できるか終了するまで待つ(イベントに対応しない代理元のため上限を設ける)
+                    HANDLE hWaitList[] = { hReadyEvent, hProcess };
+                    WaitForMultipleObjects(2, hWaitList, FALSE, 500);
+                }
+                else {
+                    Sleep(20);
+                }
+            }
+            if (hProcess) {
+                CloseHandle(hProcess);
+            }
+            if (hReadyEvent) {
+                CloseHandle(hReadyEvent);
+            }
+        }
+    }
+    return g_this;
+}
+
+// 選局して最初のパケットが届くまで待つ(BonDriver_Proxy独自の拡張。GetProcAddress()で取得して使う)
+extern "C" BONAPI BOOL SetChannelAndWait(DWORD dwSpace, DWORD dwChannel, DWORD *pdwLatencyUsec)
+{
+    CProxyClient3 *cli3 = dynamic_cast<CProxyClient3*>(g_this);
+    CProxyClient2 *cli2 = dynamic_cast<CProxyClient2*>(g_this);
+    if (cli2) {
+        cli3 = cli2->GetDown();
+    }
+    if (cli3) {
+        return cli3->SetChannelAndWait(dwSpace, dwChannel, pdwLatencyUsec);
+    }
+    if (pdwLatencyUsec) {
+        *pdwLatencyUsec = 0xFFFFFFFF;
+    }
+    return FALSE;
+}
+
+extern "C" BONAPI const STRUCT_IBONDRIVER * CreateBonStruct(void)
+{
+    if (CreateBonDriver()) {
+        CProxyClient3 *cli3 = dynamic_cast<CProxyClient3*>(g_this);
+        if (cli3) {
+            return &cli3->GetBonStruct3().Initialize(cli3, nullptr);
+        }
+        CProxyClient2 *cli2 = dynamic_cast<CProxyClient2*>(g_this);
+        if (cli2) {
+            return &cli2->GetBonStruct2().Initialize(cli2, nullptr);
+        }
+        CProxyClient *cli = static_cast<CProxyClient*>(g_this);
+        return &cli->GetBonStruct().Initialize(cli, nullptr);
+    }
+    return nullptr;
+}
@@ -1,108 +1,214 @@
-﻿#pragma once
-
-#define WIN32_LEAN_AND_MEAN
-#include <windows.h>
-#define BONSDK_IMPLEMENT
-#include "IBonDriver3.h"
-
-class CProxyClient3 : public IBonDriver3
-{
-public:
-    CProxyClient3(HANDLE hPipe);
-    STRUCT_IBONDRIVER3 &GetBonStruct3() { return m_bonStruct3; }
-    DWORD CreateBon(LPCWSTR param);
-    // IBonDriver3
-    const DWORD GetTotalDeviceNum();
-    const DWORD GetActiveDeviceNum();
-    const BOOL SetLnbPower(const BOOL bEnable);
-    // IBonDriver2
-    LPCWSTR GetTunerName();
-    const BOOL IsTunerOpening();
-    LPCWSTR EnumTuningSpace(const DWORD dwSpace);
-    LPCWSTR EnumChannelName(const DWORD dwSpace, const DWORD dwChannel);
-    const BOOL SetChannel(const DWORD dwSpace, const DWORD dwChannel);
-    const DWORD GetCurSpace();
-    const DWORD GetCurChannel();
-    // IBonDriver
-    const BOOL OpenTuner();
-    void CloseTuner();
-    const BOOL SetChannel(const BYTE bCh);
-    const float GetSignalLevel();
-    const DWORD WaitTsStream(const DWORD dwTimeOut);
-    const DWORD GetReadyCount();
-    const BOOL GetTsStream(BYTE *pDst, DWORD *pdwSize, DWORD *pdwRemain);
-    const BOOL GetTsStream(BYTE **ppDst, DWORD *pdwSize, DWORD *pdwRemain);
-    void PurgeTsStream();
-    void Release();
-private:
-    bool WriteAndRead4(void *buf, const char (&cmd)[5], const void *param1 = nullptr, const void *param2 = nullptr);
-    bool WriteAndReadString(WCHAR (&buf)[256], const char (&cmd)[5], const void *param1 = nullptr, const void *param2 = nullptr);
-    bool Write(const char (&cmd)[5], const void *param1 = nullptr, const void *param2 = nullptr);
-    bool ReadAll(void *buf, DWORD len);
-    CRITICAL_SECTION m_cs;
-    HANDLE m_hPipe;
-    BYTE m_tsBuf[48128];
-    WCHAR m_tunerName[256];
-    WCHAR m_tuningSpace[256];
-    WCHAR m_channelName[256];
-    STRUCT_IBONDRIVER3 m_bonStruct3;
-};
-
-class CProxyClient2 : public IBonDriver2
-{
-public:
-    CProxyClient2(CProxyClient3 *down) : m_down(down) {}
-    STRUCT_IBONDRIVER2 &GetBonStruct2() { return m_down->GetBonStruct3().st2; }
-    // IBonDriver2
-    LPCWSTR GetTunerName() { return m_down->GetTunerName(); }
-    const BOOL IsTunerOpening() { return m_down->IsTunerOpening(); }
-    LPCWSTR EnumTuningSpace(const DWORD dwSpace) { return m_down->EnumTuningSpace(dwSpace); }
-    LPCWSTR EnumChannelName(const DWORD dwSpace, const DWORD dwChannel) { return m_down->EnumChannelName(dwSpace, dwChannel); }
-    const BOOL SetChannel(const DWORD dwSpace, const DWORD dwChannel) { return m_down->SetChannel(dwSpace, dwChannel); }
-    const DWORD GetCurSpace() { return m_down->GetCurSpace(); }
-    const DWORD GetCurChannel() { return m_down->GetCurChannel(); }
-    // IBonDriver
-    const BOOL OpenTuner() { return m_down->OpenTuner(); }
-    void CloseTuner() { m_down->CloseTuner(); }
-    const BOOL SetChannel(const BYTE bCh) { return m_down->SetChannel(bCh); }
-    const float GetSignalLevel() { return m_down->GetSignalLevel(); }
-    const DWORD WaitTsStream(const DWORD dwTimeOut) { return m_down->WaitTsStream(dwTimeOut); }
-    const DWORD GetReadyCount() { return m_down->GetReadyCount(); }
-    const BOOL GetTsStream(BYTE *pDst, DWORD *pdwSize, DWORD *pdwRemain) { return m_down->GetTsStream(pDst, pdwSize, pdwRemain); }
-    const BOOL GetTsStream(BYTE **ppDst, DWORD *pdwSize, DWORD *pdwRemain) { return m_down->GetTsStream(ppDst, pdwSize, pdwRemain); }
-    void PurgeTsStream() { return m_down->PurgeTsStream(); }
-    void Release() { m_down->Release(); delete this; }
-private:
-    CProxyClient3 *const m_down;
-};
-
-class CProxyClient : public IBonDriver
-{
-public:
-    CProxyClient(CProxyClient3 *down) : m_down(down) {}
-    STRUCT_IBONDRIVER &GetBonStruct() { return m_down->GetBonStruct3().st2.st; }
-    // IBonDriver
-    const BOOL OpenTuner() { return m_down->OpenTuner(); }
-    void CloseTuner() { m_down->CloseTuner(); }
-    const BOOL SetChannel(const BYTE bCh) { return m_down->SetChannel(bCh); }
-    const float GetSignalLevel() { return m_down->GetSignalLevel(); }
-    const DWORD WaitTsStream(const DWORD dwTimeOut) { return m_down->WaitTsStream(dwTimeOut); }
-    const DWORD GetReadyCount() { return m_down->GetReadyCount(); }
-    const BOOL GetTsStream(BYTE *pDst, DWORD *pdwSize, DWORD *pdwRemain) { return m_down->GetTsStream(pDst, pdwSize, pdwRemain); }
-    const BOOL GetTsStream(BYTE **ppDst, DWORD *pdwSize, DWORD *pdwRemain) { return m_down->GetTsStream(ppDst, pdwSize, pdwRemain); }
-    void PurgeTsStream() { return m_down->PurgeTsStream(); }
-    void Release() { m_down->Release(); delete this; }
-private:
-    CProxyClient3 *const m_down;
-};
-
-class CBlockLock
-{
-public:
-    CBlockLock(CRITICAL_SECTION *cs) : m_cs(cs) { EnterCriticalSection(m_cs); }
-    ~CBlockLock() { LeaveCriticalSection(m_cs); }
-private:
-    CBlockLock(const CBlockLock&);
-    CBlockLock &operator=(const CBlockLock&);
-    CRITICAL_SECTION *m_cs;
-};
+﻿#pragma once
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <memory>
+#include <vector>
+#define BONSDK_IMPLEMENT
+#include "IBonDriver3.h"
+#include "../BonDriverLocalProxy/BonDriverLocalProxyCommand.h"
+#include "../BonDriverLocalProxy/BonDriverLocalProxySharedRing.h"
+
+class CProxyClient3 : public IBonDriver3
+{
+public:
+    CProxyClient3(HANDLE hPipe, LPCWSTR pipeName);
+    STRUCT_IBONDRIVER3 &GetBonStruct3() { return m_bonStruct3; }
+    DWORD CreateBon(LPCWSTR param);
+    // IBonDriver3
+    const DWORD GetTotalDeviceNum();
+    const DWORD GetActiveDeviceNum();
+    const BOOL SetLnbPower(const BOOL bEnable);
+    // IBonDriver2
+    LPCWSTR GetTunerName();
+    const BOOL IsTunerOpening();
+    LPCWSTR EnumTuningSpace(const DWORD dwSpace);
+    LPCWSTR EnumChannelName(const DWORD dwSpace, const DWORD dwChannel);
+    const BOOL SetChannel(const DWORD dwSpace, const DWORD dwChannel);
+    const DWORD GetCurSpace();
+    const DWORD GetCurChannel();
+    // IBonDriver
+    const BOOL OpenTuner();
+    void CloseTuner();
+    const BOOL SetChannel(const BYTE bCh);
+    const float GetSignalLevel();
+    const DWORD WaitTsStream(const DWORD dwTimeOut);
+    const DWORD GetReadyCount();
+    const BOOL GetTsStream(BYTE *pDst, DWORD *pdwSize, DWORD *pdwRemain);
+    const BOOL GetTsStream(BYTE **ppDst, DWORD *pdwSize, DWORD *pdwRemain);
+    void PurgeTsStream();
+    void Release();
+    // 選局して新しい選局の最初のパケットがサーバに届くまで待つ。pdwLatencyUsecにはその時間(不明なら0xFFFFFFFF)を返す
+    const BOOL SetChannelAndWait(const DWORD dwSpace, const DWORD dwChannel, DWORD *pdwLatencyUsec);
+private:
+    // コマンドを送って応答を受け取る。引数と応答の型はBDP_COMMAND_LISTの定義に従う
+    template<BDP_COMMAND Cmd>
+    bool Call(typename BDP_COMMAND_TRAITS<Cmd>::ClientResult &ret,
+              typename BDP_COMMAND_TRAITS<Cmd>::Param1 param1 = typename BDP_COMMAND_TRAITS<Cmd>::Param1(),
+              typename BDP_COMMAND_TRAITS<Cmd>::Param2 param2 = typename BDP_COMMAND_TRAITS<Cmd>::Param2()) {
+        BYTE cmd[12];
+        BdpMakeCommand<Cmd>(cmd, param1, param2);
+        return Write(cmd) && ReadResult(ret);
+    }
+    // 結果を必要としないコマンドを次のコマンドとまとめて送る
+    template<BDP_COMMAND Cmd>
+    void Defer(typename BDP_COMMAND_TRAITS<Cmd>::Param1 param1 = typename BDP_COMMAND_TRAITS<Cmd>::Param1(),
+               typename BDP_COMMAND_TRAITS<Cmd>::Param2 param2 = typename BDP_COMMAND_TRAITS<Cmd>::Param2()) {
+        // 応答は4バイトとして読み捨てる
+        static_assert(sizeof(typename BDP_COMMAND_TRAITS<Cmd>::ClientResult) == 4, "deferred command must return 4 bytes");
+        BYTE cmd[12];
+        BdpMakeCommand<Cmd>(cmd, param1, param2);
+        Defer(cmd);
+    }
+    // replyFixedSizeを指定すると、応答のうち保留中のコマンドの分とその大きさだけを先に読む
+    bool Write(const BYTE (&cmd)[12], DWORD replyFixedSize = MAXDWORD);
+    void Defer(const BYTE (&cmd)[12]);
+    // 保留中のコマンドがあればすぐに送る
+    void FlushDeferred();
+    bool ReadResult(DWORD &ret) { return ReadAll(&ret, 4); }
+    bool ReadResult(BOOL &ret) { return ReadAll(&ret, 4); }
+    bool ReadResult(float &ret) { return ReadAll(&ret, 4); }
+    bool ReadResult(WCHAR (&ret)[256]);
+    bool ReadResult(BDP_DROP_RESULT &ret) { return ReadAll(&ret.count, 4) && ReadAll(&ret.bytes, 8); }
+    bool ReadResult(BDP_TUNE_RESULT &ret) { return ReadAll(&ret.result, 4) && ReadAll(&ret.latencyUsec, 4); }
+    bool ReadAll(void *buf, DWORD len);
+    // 読み込み済みの応答に収まっていればその位置を返し、そうでなければbufに読み込んで返す
+    BYTE *ReadInPlace(BYTE *buf, DWORD len);
+    void OpenSharedRing();
+    bool SetPidFilter();
+    void SetLagPolicy();
+    void OpenDataEvent();
+    void OpenSharedStatus();
+    void LoadChannelTable();
+    bool StartPushStream();
+    void StopPushStream();
+    bool PushTransfer(bool write, void *buf, DWORD len, OVERLAPPED *ol);
+    static unsigned int __stdcall PushThread(void *param);
+    struct PUSH_ITEM {
+        DWORD size;
+        DWORD remain;
+        const BYTE *data;
+    };
+    // 共有メモリ上のスロットnのチャンクを得る。copyならcopyBufに複写して、複写中に上書きされていればfalse
+    // そうでなければ2重にマップできずに末尾をまたぐものだけをcopyBufにつなげる
+    bool GetSharedChunk(DWORD n, BYTE *copyBuf, bool copy, PUSH_ITEM &chunk) const;
+    static const DWORD PUSH_QUEUE_NUM = 8;
+    CRITICAL_SECTION m_cs;
+    HANDLE m_hPipe;
+    WCHAR m_pipeName[MAX_PATH + 64];
+    DWORD m_features;
+    // 次のコマンドとまとめて送る、結果を必要としない4バイトの応答を返すコマンド
+    static const DWORD PENDING_CMD_MAX = 7;
+    DWORD m_pendingCount;
+    BYTE m_pendingCmds[12 * PENDING_CMD_MAX];
+    // サーバが新しいデータが届いたことを知らせるイベント(自動リセット)
+    HANDLE m_hDataEvent;
+    // 前回のGetTsStream()が空だった(サーバはイベントをセットする状態にある)
+    bool m_dataWaitArmed;
+    HANDLE m_hRingMap;
+    const BYTE *m_ringView;
+    size_t m_ringViewSize;
+    // チャンクの実体(2重にマップできればm_ringMirrorと同じ)
+    const BYTE *m_ringData;
+    BYTE *m_ringMirror;
+    // サーバがシグナルレベル等を書き込む共有メモリ(読み取り専用)
+    const BYTE *m_statusView;
+    bool m_pushTried;
+    HANDLE m_hPushPipe;
+    HANDLE m_hPushThread;
+    HANDLE m_hPushStopEvent;
+    HANDLE m_hPushSpaceEvent;
+    HANDLE m_hPushDataEvent;
+    // 以下はm_pushCsで保護する。受信スレッドがm_pushTailを進め、GetTsStream()がm_pushHeadとm_pushReleasedを進める
+    CRITICAL_SECTION m_pushCs;
+    PUSH_ITEM m_pushQueue[PUSH_QUEUE_NUM];
+    DWORD m_pushHead;
+    DWORD m_pushTail;
+    DWORD m_pushReleased;
+    bool m_pushHeld;
+    std::unique_ptr<BYTE[]> m_pushBuf;
+    // サーバから一括取得したチューナ名とチャンネル表(m_tableBuf内を指す)
+    struct TABLE_SPACE {
+        LPCWSTR name;
+        std::vector<LPCWSTR> channels;
+    };
+    bool m_tableLoaded;
+    bool m_tableComplete;
+    std::unique_ptr<WCHAR[]> m_tableBuf;
+    LPCWSTR m_tableTunerName;
+    std::vector<TABLE_SPACE> m_tableSpaces;
+    BYTE m_tsBuf[48128];
+    // 複写する版のGetTsStream()で返しきれなかったもの
+    DWORD m_copyPendingPos;
+    DWORD m_copyPendingSize;
+    DWORD m_copyRemain;
+    BYTE m_copyBuf[48128];
+    // v2で1回で読んだ応答のフレーム(m_replyPosからm_replyCountまでが未消費)
+    DWORD m_replyPos;
+    DWORD m_replyCount;
+    BYTE m_replyBuf[4 + 4 * PENDING_CMD_MAX + 8 + 48128];
+    WCHAR m_tunerName[256];
+    WCHAR m_tuningSpace[256];
+    WCHAR m_channelName[256];
+    STRUCT_IBONDRIVER3 m_bonStruct3;
+};
+
+class CProxyClient2 : public IBonDriver2
+{
+public:
+    CProxyClient2(CProxyClient3 *down) : m_down(down) {}
+    STRUCT_IBONDRIVER2 &GetBonStruct2() { return m_down->GetBonStruct3().st2; }
+    CProxyClient3 *GetDown() { return m_down; }
+    // IBonDriver2
+    LPCWSTR GetTunerName() { return m_down->GetTunerName(); }
+    const BOOL IsTunerOpening() { return m_down->IsTunerOpening(); }
+    LPCWSTR EnumTuningSpace(const DWORD dwSpace) { return m_down->EnumTuningSpace(dwSpace); }
+    LPCWSTR EnumChannelName(const DWORD dwSpace, const DWORD dwChannel) { return m_down->EnumChannelName(dwSpace, dwChannel); }
+    const BOOL SetChannel(const DWORD dwSpace, const DWORD dwChannel) { return m_down->SetChannel(dwSpace, dwChannel); }
+    const DWORD GetCurSpace() { return m_down->GetCurSpace(); }
+    const DWORD GetCurChannel() { return m_down->GetCurChannel(); }
+    // IBonDriver
+    const BOOL OpenTuner() { return m_down->OpenTuner(); }
+    void CloseTuner() { m_down->CloseTuner(); }
+    const BOOL SetChannel(const BYTE bCh) { return m_down->SetChannel(bCh); }
+    const float GetSignalLevel() { return m_down->GetSignalLevel(); }
+    const DWORD WaitTsStream(const DWORD dwTimeOut) { return m_down->WaitTsStream(dwTimeOut); }
+    const DWORD GetReadyCount() { return m_down->GetReadyCount(); }
+    const BOOL GetTsStream(BYTE *pDst, DWORD *pdwSize, DWORD *pdwRemain) { return m_down->GetTsStream(pDst, pdwSize, pdwRemain); }
+    const BOOL GetTsStream(BYTE **ppDst, DWORD *pdwSize, DWORD *pdwRemain) { return m_down->GetTsStream(ppDst, pdwSize, pdwRemain); }
+    void PurgeTsStream() { return m_down->PurgeTsStream(); }
+    void Release() { m_down->Release(); delete this; }
+private:
+    CProxyClient3 *const m_down;
+};
+
+class CProxyClient : public IBonDriver
+{
+public:
+    CProxyClient(CProxyClient3 *down) : m_down(down) {}
+    STRUCT_IBONDRIVER &GetBonStruct() { return m_down->GetBonStruct3().st2.st; }
+    // IBonDriver
+    const BOOL OpenTuner() { return m_down->OpenTuner(); }
+    void CloseTuner() { m_down->CloseTuner(); }
+    const BOOL SetChannel(const BYTE bCh) { return m_down->SetChannel(bCh); }
+    const float GetSignalLevel() { return m_down->GetSignalLevel(); }
+    const DWORD WaitTsStream(const DWORD dwTimeOut) { return m_down->WaitTsStream(dwTimeOut); }
+    const DWORD GetReadyCount() { return m_down->GetReadyCount(); }
+    const BOOL GetTsStream(BYTE *pDst, DWORD *pdwSize, DWORD *pdwRemain) { return m_down->GetTsStream(pDst, pdwSize, pdwRemain); }
+    const BOOL GetTsStream(BYTE **ppDst, DWORD *pdwSize, DWORD *pdwRemain) { return m_down->GetTsStream(ppDst, pdwSize, pdwRemain); }
+    void PurgeTsStream() { return m_down->PurgeTsStream(); }
+    void Release() { m_down->Release(); delete this; }
+private:
+    CProxyClient3 *const m_down;
+};
+
+class CBlockLock
+{
+public:
+    CBlockLock(CRITICAL_SECTION *cs) : m_cs(cs) { EnterCriticalSection(m_cs); }
+    ~CBlockLock() { LeaveCriticalSection(m_cs); }
+private:
+    CBlockLock(const CBlockLock&);
+    CBlockLock &operator=(const CBlockLock&);
+    CRITICAL_SECTION *m_cs;
+};
@@ -0,0 +1,96 @@
+﻿// BonDriverLocalProxyDummyTs.hのTSの生成と、作りなおして比べる検証を確かめる
+#include "TestCommon.h"
+#include "../BonDriverLocalProxy/BonDriverLocalProxyDummyTs.h"
+#include <vector>
+
+namespace
+{
+const DWORD PACKET_NUM = BDP_DUMMY_PSI_INTERVAL * 3;
+
+std::vector<BYTE> MakeStream(ULONGLONG first, DWORD num)
+{
+    std::vector<BYTE> buf(BDP_DUMMY_PACKET_SIZE * num);
+    for (DWORD i = 0; i < num; ++i) {
+        MakeDummyPacket(&buf[BDP_DUMMY_PACKET_SIZE * i], first + i, static_cast<LONGLONG>((first + i) * 1000));
+    }
+    return buf;
+}
+
+void TestStream()
+{
+    std::vector<BYTE> buf = MakeStream(0, PACKET_NUM);
+    // PIDごとの最後の連続性指標(0x10以上は未取得)
+    BYTE lastCC[3] = { 0x10, 0x10, 0x10 };
+    bool ccContinuous = true;
+    for (DWORD i = 0; i < PACKET_NUM; ++i) {
+        const BYTE *p = &buf[BDP_DUMMY_PACKET_SIZE * i];
+        TEST_CHECK(p[0] == 0x47);
+        DWORD pid = GetDummyPacketPid(p);
+        DWORD kind = i % BDP_DUMMY_PSI_INTERVAL;
+        TEST_CHECK(pid == (kind == 0 ? 0 : kind == 1 ? BDP_DUMMY_PMT_PID : BDP_DUMMY_STREAM_PID));
+        BYTE &last = lastCC[kind < 2 ? kind : 2];
+        BYTE cc = p[3] & 0x0F;
+        if (last < 0x10 && cc != ((last + 1) & 0x0F)) {
+            ccContinuous = false;
+        }
+        last = cc;
+        if (kind < 2) {
+            // セクションとCRCを通したCRCは0になる
+            DWORD sectionSize = 3 + ((p[6] & 0x0F) << 8 | p[7]);
+            TEST_CHECK(CalcDummyCrc32(p + 5, sectionSize) == 0);
+        }
+    }
+    TEST_CHECK(ccContinuous);
+    // 途中から作っても同じ
+    std::vector<BYTE> part = MakeStream(PACKET_NUM / 2, 10);
+    TEST_CHECK(memcmp(part.data(), &buf[BDP_DUMMY_PACKET_SIZE * (PACKET_NUM / 2)], part.size()) == 0);
+    // ストリームのパケットの中身は通し番号ごとに異なる
+    TEST_CHECK(memcmp(&buf[BDP_DUMMY_PACKET_SIZE * 2 + 20], &buf[BDP_DUMMY_PACKET_SIZE * 3 + 20], BDP_DUMMY_PACKET_SIZE - 20) != 0);
+}
+
+void TestVerify()
+{
+    std::vector<BYTE> buf = MakeStream(0, PACKET_NUM);
+    // PATから受け取りはじめると、最初のストリームのパケットまでは比べられない
+    ULONGLONG next = ~0ULL;
+    bool intact = true;
+    for (DWORD i = BDP_DUMMY_PSI_INTERVAL; i < PACKET_NUM; ++i) {
+        intact = VerifyDummyPacket(&buf[BDP_DUMMY_PACKET_SIZE * i], next) && intact;
+        if (i == BDP_DUMMY_PSI_INTERVAL + 1) {
+            TEST_CHECK(next == ~0ULL);
+        }
+    }
+    TEST_CHECK(intact);
+    TEST_CHECK(next == PACKET_NUM);
+
+    // 1バイトでも異なれば不一致で、次のストリームのパケットから比べなおす
+    std::vector<BYTE> broken = buf;
+    broken[BDP_DUMMY_PACKET_SIZE * 10 + 100] ^= 0x01;
+    next = 9;
+    TEST_CHECK(VerifyDummyPacket(&broken[BDP_DUMMY_PACKET_SIZE * 9], next));
+    TEST_CHECK(!VerifyDummyPacket(&broken[BDP_DUMMY_PACKET_SIZE * 10], next));
+    TEST_CHECK(next == ~0ULL);
+    TEST_CHECK(VerifyDummyPacket(&broken[BDP_DUMMY_PACKET_SIZE * 11], next));
+    TEST_CHECK(next == 12);
+
+    // PATやPMTも通し番号から作りなおして比べる
+    broken = buf;
+    broken[BDP_DUMMY_PACKET_SIZE * BDP_DUMMY_PSI_INTERVAL + 8] ^= 0x80;
+    next = BDP_DUMMY_PSI_INTERVAL;
+    TEST_CHECK(!VerifyDummyPacket(&broken[BDP_DUMMY_PACKET_SIZE * BDP_DUMMY_PSI_INTERVAL], next));
+
+    // 欠けていれば不一致
+    next = 20;
+    TEST_CHECK(!VerifyDummyPacket(&buf[BDP_DUMMY_PACKET_SIZE * 21], next));
+    // パケット境界がずれていても不一致
+    next = 30;
+    TEST_CHECK(!VerifyDummyPacket(&buf[BDP_DUMMY_PACKET_SIZE * 30 + 4], next));
+}
+}
+
+int main()
+{
+    TestStream();
+    TestVerify();
+    return TestResult("DummyTsTest");
+}
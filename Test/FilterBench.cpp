@@ -0,0 +1,100 @@
+﻿// BonDriverLocalProxyTs.hのFilterTsPackets()の速さを、絞り込まずにコピーする場合と比べる
+#include "TestCommon.h"
+#include "../BonDriverLocalProxy/BonDriverLocalProxyTs.h"
+#include <chrono>
+#include <random>
+#include <vector>
+
+namespace
+{
+// 代理元のチャンクと同じTSパケット256個分
+const DWORD CHUNK_SIZE = TS_PACKET_SIZE * 256;
+// キャッシュに収まりきらない程度の量を巡回する
+const DWORD CHUNK_NUM = 256;
+
+void SetPid(BYTE *pidMap, DWORD pid)
+{
+    pidMap[pid >> 3] |= 1 << (pid & 7);
+}
+
+// pickで選んだPIDのパケットを並べる
+template<class F>
+std::vector<BYTE> MakeStream(F pick)
+{
+    std::vector<BYTE> buf(static_cast<size_t>(CHUNK_SIZE) * CHUNK_NUM);
+    for (size_t i = 0; i < buf.size(); i += TS_PACKET_SIZE) {
+        DWORD pid = pick(i / TS_PACKET_SIZE);
+        buf[i] = 0x47;
+        buf[i + 1] = static_cast<BYTE>(pid >> 8);
+        buf[i + 2] = static_cast<BYTE>(pid);
+        buf[i + 3] = 0x10;
+        memset(&buf[i + 4], static_cast<int>(i), TS_PACKET_SIZE - 4);
+    }
+    return buf;
+}
+
+// 1秒以上くり返して入力の処理速度(MB/s)を返す。pidMapがなければそのままコピーする
+double Measure(const std::vector<BYTE> &src, const BYTE *pidMap, double *keepRatio)
+{
+    std::vector<BYTE> dst(CHUNK_SIZE);
+    ULONGLONG inBytes = 0;
+    ULONGLONG outBytes = 0;
+    auto start = std::chrono::steady_clock::now();
+    double sec = 0;
+    while (sec < 1) {
+        for (DWORD i = 0; i < CHUNK_NUM; ++i) {
+            const BYTE *p = &src[static_cast<size_t>(CHUNK_SIZE) * i];
+            if (pidMap) {
+                outBytes += FilterTsPackets(p, CHUNK_SIZE, dst.data(), pidMap);
+            }
+            else {
+                memcpy(dst.data(), p, CHUNK_SIZE);
+                outBytes += CHUNK_SIZE;
+            }
+            inBytes += CHUNK_SIZE;
+        }
+        sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    // 最適化で消されないよう結果を使う
+    if (dst[dst.size() / 2] == 0x5A && outBytes == 1) {
+        puts("");
+    }
+    *keepRatio = static_cast<double>(outBytes) / inBytes;
+    return inBytes / sec / 1000000;
+}
+
+void Report(const char *name, const std::vector<BYTE> &src, const BYTE *pidMap)
+{
+    double keepRatio;
+    double mbps = Measure(src, pidMap, &keepRatio);
+    printf("%-28s %8.0f MB/s  kept %5.1f%%\n", name, mbps, keepRatio * 100);
+}
+}
+
+int main()
+{
+    // 放送に近い構成。映像と音声が大半で、SIやヌルパケットが混じる
+    std::mt19937 rand(1);
+    std::vector<BYTE> broadcast = MakeStream([&](size_t) -> DWORD {
+        DWORD r = rand() % 100;
+        return r < 75 ? 0x100 : r < 85 ? 0x110 : r < 88 ? 0x0 : r < 91 ? 0x1000 : r < 94 ? 0x12 : 0x1FFF;
+    });
+    // 通すものと通さないものが交互に並ぶ最悪の場合
+    std::vector<BYTE> alternate = MakeStream([](size_t i) -> DWORD { return i % 2 ? 0x100 : 0x1FFF; });
+
+    BYTE all[8192 / 8];
+    memset(all, 0xFF, sizeof(all));
+    BYTE service[8192 / 8] = {};
+    SetPid(service, 0x0);
+    SetPid(service, 0x1000);
+    SetPid(service, 0x100);
+    SetPid(service, 0x110);
+    BYTE none[8192 / 8] = {};
+
+    Report("unfiltered copy", broadcast, nullptr);
+    Report("filter: all PIDs", broadcast, all);
+    Report("filter: one service", broadcast, service);
+    Report("filter: no PIDs", broadcast, none);
+    Report("filter: alternating packets", alternate, service);
+    return 0;
+}
@@ -0,0 +1,352 @@
+﻿// 代理元の手順で共有リングバッファに時刻入りのTSを決まったビットレートで書き込み、複数のクライアントの手順で読む
+// BonDriverLocalProxyBenchと同じく全体の転送速度、クライアントごとの遅延の目安、CPU使用率、リングバッファの最大使用量を表示する
+// TSはBonDriver_Dummyと同じもので、受け取ったパケットを通し番号から作りなおして比べる
+// 壊れたものや読み飛ばされずに欠けたものがあれば0以外で終了する
+#include "TestCommon.h"
+#include "../BonDriverLocalProxy/BonDriverLocalProxyRing.h"
+#include "../BonDriverLocalProxy/BonDriverLocalProxySharedRing.h"
+#include "../BonDriverLocalProxy/BonDriverLocalProxyStatFormat.h"
+#include "../BonDriverLocalProxy/BonDriverLocalProxyDummyTs.h"
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+namespace
+{
+const DWORD TS_PACKET_SIZE = 188;
+// 代理元のチャンクと同じTSパケット256個分
+const DWORD CHUNK_PACKETS = 256;
+const DWORD SLOT_NUM = 64;
+const DWORD DATA_SIZE = 8 * 1024 * 1024;
+const DWORD DEFAULT_CLIENTS = 4;
+const DWORD DEFAULT_SECONDS = 3;
+const DWORD DEFAULT_BITRATE_KBPS = 100000;
+const DWORD MAX_CLIENTS = 36;
+
+typedef std::chrono::steady_clock CLOCK;
+
+// 代理元の側。コマンドの処理とリングバッファへの書き込みは代理元のスレッド1つで行うのでlockで排他する
+struct SERVER {
+    std::mutex lock;
+    BDP_RING_LINKS ring;
+    // そのスロットのdata上の通し位置
+    std::vector<ULONGLONG> pos;
+    BDP_MAP_HANDLE hMap;
+    BYTE *view;
+    size_t viewSize;
+    BYTE *mirror;
+    ULONGLONG writePos;
+    // クライアントごとの読み出し位置と、遅れすぎて読み飛ばさせた回数
+    std::vector<DWORD> front;
+    std::vector<DWORD> skipCount;
+    DWORD highWater;
+};
+
+// クライアントの側
+struct CLIENT {
+    BDP_MAP_HANDLE hMap;
+    const BYTE *view;
+    size_t viewSize;
+    const BYTE *data;
+    const BYTE *mirror;
+    // 以下は読み込みスレッドだけが書き込む
+    ULONGLONG bytes;
+    DWORD chunks;
+    // 読み飛ばされた回数と、複写中に上書きされて捨てたチャンクの数
+    DWORD skips;
+    DWORD overwritten;
+    // 作りなおしたものと一致しなかったか、読み飛ばされていないのに欠けたパケットの数
+    DWORD mismatches;
+    DWORD latencyHist[BDP_LATENCY_HIST_NUM];
+};
+
+CLOCK::time_point g_startTime;
+double g_packetNsec;
+
+// スロットを位置とするクライアントを最新のチャンク(rear)まで読み飛ばさせる
+void SkipReaders(SERVER &sv, DWORD slot)
+{
+    for (size_t i = 0; i < sv.front.size(); ++i) {
+        if (sv.front[i] == slot) {
+            MoveRingReader(sv.ring, slot, sv.ring.rear);
+            sv.front[i] = sv.ring.rear;
+            ++sv.skipCount[i];
+        }
+    }
+}
+
+// 代理元と同じ手順でチャンクを書き込む
+void WriteChunk(SERVER &sv, const BYTE *buf, DWORD bufCount)
+{
+    std::lock_guard<std::mutex> lock(sv.lock);
+    BDP_RING_LINKS &ring = sv.ring;
+    BDP_SHARED_RING_HEADER &header = *reinterpret_cast<BDP_SHARED_RING_HEADER*>(sv.view);
+    BYTE *data = sv.mirror ? sv.mirror : sv.view + header.dataOffset;
+    ULONGLONG writePos = PlaceRingChunk(sv.writePos, DATA_SIZE, sv.mirror != nullptr, bufCount);
+    AdvanceRingOldest(ring);
+    while (ring.oldest != ring.rear && IsRingChunkOverwritten(sv.pos[ring.oldest], DATA_SIZE, writePos + bufCount)) {
+        SkipReaders(sv, ring.oldest);
+        AdvanceRingOldest(ring);
+    }
+    WriteSharedRingChunk(&header.writeEnd, GetSharedRingSlots(sv.view)[ring.rear], data, DATA_SIZE, writePos, buf, bufCount);
+    sv.pos[ring.rear] = writePos;
+    sv.writePos = GetNextRingWritePos(writePos, bufCount);
+    CommitRingRear(ring, bufCount - 4);
+    ExpandRingBuffer(ring);
+    if (ring.oldest != ring.rear && ring.oldest == ring.next[ring.rear]) {
+        SkipReaders(sv, ring.oldest);
+    }
+    AdvanceRingOldest(ring);
+    sv.highWater = std::max(sv.highWater, ring.num);
+    AdvanceRingRear(ring);
+}
+
+// プッシュ配信と同じく、クライアントiに次のスロット番号と読み飛ばさせた回数を返して読み出し位置を進める
+DWORD PopChunk(SERVER &sv, size_t i, DWORD &skipCount)
+{
+    std::lock_guard<std::mutex> lock(sv.lock);
+    skipCount = sv.skipCount[i];
+    DWORD n = sv.front[i];
+    if (n == sv.ring.rear) {
+        return 0xFFFFFFFF;
+    }
+    MoveRingReader(sv.ring, n, sv.ring.next[n]);
+    sv.front[i] = sv.ring.next[n];
+    return n;
+}
+
+void WriteThread(SERVER &sv, DWORD seconds, const std::atomic<bool> &stop)
+{
+    std::vector<BYTE> buf(4 + TS_PACKET_SIZE * CHUNK_PACKETS);
+    ULONGLONG sent = 0;
+    while (!stop) {
+        double elapsed = std::chrono::duration<double, std::nano>(CLOCK::now() - g_startTime).count();
+        ULONGLONG due = static_cast<ULONGLONG>(elapsed / g_packetNsec);
+        if (due == sent) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+        DWORD n = static_cast<DWORD>(std::min<ULONGLONG>(due - sent, CHUNK_PACKETS));
+        DWORD remain = due - sent > n ? 1 : 0;
+        memcpy(buf.data(), &remain, 4);
+        for (DWORD i = 0; i < n; ++i, ++sent) {
+            // 出力すべきだった時刻はg_startTimeからのナノ秒
+            MakeDummyPacket(&buf[4 + TS_PACKET_SIZE * i], sent, static_cast<LONGLONG>(sent * g_packetNsec));
+        }
+        WriteChunk(sv, buf.data(), 4 + TS_PACKET_SIZE * n);
+        if (elapsed >= seconds * 1e9) {
+            break;
+        }
+    }
+}
+
+void ReadThread(SERVER &sv, size_t index, CLIENT &cl, const std::atomic<bool> &stop)
+{
+    DWORD dataSize = reinterpret_cast<const BDP_SHARED_RING_HEADER*>(cl.view)->dataSize;
+    std::vector<BYTE> copyBuf(TS_PACKET_SIZE * CHUNK_PACKETS);
+    // 次に受け取るはずのパケットの通し番号(~0ULLは不明)
+    ULONGLONG next = ~0ULL;
+    DWORD lastSkipCount = 0;
+    while (!stop) {
+        DWORD skipCount;
+        DWORD n = PopChunk(sv, index, skipCount);
+        if (skipCount != lastSkipCount) {
+            cl.skips += skipCount - lastSkipCount;
+            lastSkipCount = skipCount;
+            next = ~0ULL;
+        }
+        if (n == 0xFFFFFFFF) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+        // クライアントと同じ手順で複写して、上書きされていれば捨てる
+        BDP_RING_SLOT slot;
+        if (!ReadSharedRingSlot(cl.view, n, static_cast<DWORD>(copyBuf.size()), slot)) {
+            ++cl.mismatches;
+            continue;
+        }
+        DWORD size = slot.bufCount - 4;
+        const BYTE *span = GetRingChunkSpan(cl.data, dataSize, cl.mirror != nullptr, slot.offset + 4, size, copyBuf.data());
+        if (span != copyBuf.data()) {
+            memcpy(copyBuf.data(), span, size);
+        }
+        if (!IsSharedRingSlotIntact(cl.view, n, slot)) {
+            ++cl.overwritten;
+            next = ~0ULL;
+            continue;
+        }
+        double now = std::chrono::duration<double, std::nano>(CLOCK::now() - g_startTime).count();
+        cl.bytes += size;
+        ++cl.chunks;
+        bool measured = false;
+        for (DWORD i = 0; i + TS_PACKET_SIZE <= size; i += TS_PACKET_SIZE) {
+            const BYTE *p = &copyBuf[i];
+            if (!VerifyDummyPacket(p, next)) {
+                ++cl.mismatches;
+            }
+            else if (!measured && GetDummyPacketPid(p) == BDP_DUMMY_STREAM_PID) {
+                // チャンクの最初のパケットについて、出力すべきだった時刻から受け取るまでの時間
+                measured = true;
+                LONGLONG dueTime;
+                memcpy(&dueTime, p + 4, 8);
+                AddLatencyHist(cl.latencyHist, now > dueTime ? static_cast<ULONGLONG>((now - dueTime) / 1000) : 0);
+            }
+        }
+    }
+}
+
+double GetCpuSeconds()
+{
+    rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) != 0) {
+        return 0;
+    }
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+}
+
+int main(int argc, char **argv)
+{
+    DWORD clientNum = DEFAULT_CLIENTS;
+    DWORD seconds = DEFAULT_SECONDS;
+    DWORD bitrateKbps = DEFAULT_BITRATE_KBPS;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            clientNum = strtoul(argv[++i], nullptr, 10);
+        }
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            seconds = strtoul(argv[++i], nullptr, 10);
+        }
+        else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            bitrateKbps = strtoul(argv[++i], nullptr, 10);
+        }
+        else {
+            clientNum = 0;
+        }
+    }
+    if (clientNum < 1 || clientNum > MAX_CLIENTS || seconds < 1 || bitrateKbps < 1 || bitrateKbps > 10000000) {
+        fputs("Usage: LoadBench [-n clients] [-t seconds] [-b kbps]\n"
+              "  -n: number of clients, 1-36 (default 4)\n"
+              "  -t: duration in seconds (default 3)\n"
+              "  -b: bitrate in kbps (default 100000)\n", stderr);
+        return 2;
+    }
+    g_packetNsec = 1e9 * TS_PACKET_SIZE * 8 / (bitrateKbps * 1000.0);
+
+    char name[64];
+    snprintf(name, sizeof(name), "/BonDriverLocalProxyLoadBench_%d", static_cast<int>(getpid()));
+    RemoveSharedMap(name);
+    SERVER sv;
+    InitRingLinks(sv.ring, SLOT_NUM);
+    sv.pos.assign(SLOT_NUM, 0);
+    DWORD dataOffset = GetSharedRingDataOffset(SLOT_NUM);
+    sv.hMap = CreateSharedMap(name, dataOffset + DATA_SIZE);
+    if (sv.hMap == BDP_NO_MAP) {
+        fputs("Error: cannot create the shared memory.\n", stderr);
+        return 1;
+    }
+    sv.view = MapSharedView(sv.hMap, true, sv.viewSize);
+    if (!sv.view) {
+        CloseSharedMap(sv.hMap);
+        RemoveSharedMap(name);
+        fputs("Error: cannot map the shared memory.\n", stderr);
+        return 1;
+    }
+    InitSharedRingHeader(sv.view, SLOT_NUM, dataOffset, DATA_SIZE);
+    sv.mirror = MapMirroredView(sv.hMap, dataOffset, DATA_SIZE, true);
+    sv.writePos = 0;
+    sv.front.assign(clientNum, sv.ring.rear);
+    sv.ring.readers[sv.ring.rear] = clientNum;
+    sv.skipCount.assign(clientNum, 0);
+    sv.highWater = 0;
+
+    // クライアントは名前で開いて、読み取り専用でマップする
+    std::vector<CLIENT> clients(clientNum, CLIENT());
+    for (CLIENT &cl : clients) {
+        cl.hMap = BDP_NO_MAP;
+    }
+    bool result = true;
+    for (CLIENT &cl : clients) {
+        cl.hMap = OpenSharedMap(name);
+        cl.view = cl.hMap != BDP_NO_MAP ? MapSharedView(cl.hMap, false, cl.viewSize) : nullptr;
+        if (!cl.view || !IsSharedRingHeaderValid(cl.view, cl.viewSize, 4 + TS_PACKET_SIZE * CHUNK_PACKETS)) {
+            fputs("Error: cannot open the shared memory.\n", stderr);
+            result = false;
+            break;
+        }
+        cl.mirror = sv.mirror ? MapMirroredView(cl.hMap, dataOffset, DATA_SIZE, false) : nullptr;
+        cl.data = cl.mirror ? cl.mirror : cl.view + dataOffset;
+    }
+
+    double elapsed = 0;
+    double cpu = 0;
+    if (result) {
+        std::atomic<bool> stop(false);
+        g_startTime = CLOCK::now();
+        cpu = GetCpuSeconds();
+        std::vector<std::thread> readers;
+        for (size_t i = 0; i < clients.size(); ++i) {
+            readers.emplace_back(ReadThread, std::ref(sv), i, std::ref(clients[i]), std::cref(stop));
+        }
+        WriteThread(sv, seconds, stop);
+        // 書き終えたものを読み尽くすまで少し待つ
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        stop = true;
+        for (std::thread &t : readers) {
+            t.join();
+        }
+        elapsed = std::chrono::duration<double>(CLOCK::now() - g_startTime).count();
+        cpu = GetCpuSeconds() - cpu;
+    }
+
+    for (CLIENT &cl : clients) {
+        if (cl.mirror) {
+            UnmapMirroredView(cl.mirror, DATA_SIZE);
+        }
+        if (cl.view) {
+            UnmapSharedView(cl.view, cl.viewSize);
+        }
+        if (cl.hMap != BDP_NO_MAP) {
+            CloseSharedMap(cl.hMap);
+        }
+    }
+    if (sv.mirror) {
+        UnmapMirroredView(sv.mirror, DATA_SIZE);
+    }
+    UnmapSharedView(sv.view, sv.viewSize);
+    CloseSharedMap(sv.hMap);
+    RemoveSharedMap(name);
+    if (!result || elapsed <= 0) {
+        return 1;
+    }
+
+    ULONGLONG totalBytes = 0;
+    for (const CLIENT &cl : clients) {
+        totalBytes += cl.bytes;
+    }
+    printf("mode: shared ring%s, %u clients, %.1f seconds, %u kbps\n", sv.mirror ? " (mirrored)" : "", clientNum, elapsed, bitrateKbps);
+    printf("aggregate: %.2f Mbps\n", totalBytes * 8 / elapsed / 1000000);
+    // 遅延は出力すべきだった時刻からクライアントが複写し終えるまでの時間
+    printf("%5s %10s %10s %8s %8s %8s %10s %10s\n",
+           "index", "Mbps", "chunks", "skips", "overwr", "mismatch", "p50(us)", "p99(us)");
+    for (size_t i = 0; i < clients.size(); ++i) {
+        const CLIENT &cl = clients[i];
+        printf("%5u %10.2f %10u %8u %8u %8u %10llu %10llu\n",
+               static_cast<DWORD>(i), cl.bytes * 8 / elapsed / 1000000, cl.chunks, cl.skips, cl.overwritten, cl.mismatches,
+               GetLatencyPercentile(cl.latencyHist, 50), GetLatencyPercentile(cl.latencyHist, 99));
+    }
+    // CPU時間は1コアあたりの割合(代理元とクライアントの合計)
+    printf("cpu: %.1f%%\n", cpu / elapsed * 100);
+    printf("ring high-water: %u/%u slots\n", sv.highWater, SLOT_NUM);
+
+    // 受け取れなかったか、壊れたデータや読み飛ばされずに欠けたデータを受け取ったクライアントがあれば失敗
+    for (const CLIENT &cl : clients) {
+        TEST_CHECK(cl.chunks != 0);
+        TEST_CHECK(cl.mismatches == 0);
+    }
+    return TestResult("LoadBench");
+}
@@ -0,0 +1,112 @@
+﻿// BonDriverLocalProxyMirror.hの2重マッピング(memfd)とチャンクの配置の計算を確かめる
+#include "TestCommon.h"
+#include "../BonDriverLocalProxy/BonDriverLocalProxyMirror.h"
+#include <unistd.h>
+#include <vector>
+
+namespace
+{
+std::vector<BYTE> MakePattern(DWORD size, DWORD seed)
+{
+    std::vector<BYTE> buf(size);
+    for (DWORD i = 0; i < size; ++i) {
+        buf[i] = static_cast<BYTE>(i * 7 + seed);
+    }
+    return buf;
+}
+
+void TestMirroredWrap()
+{
+    // 先頭にヘッダ等がある場合と同じく、配置単位1つ分ずらした位置を2重にマップする
+    const DWORD dataOffset = BDP_MAP_GRANULARITY;
+    const DWORD dataSize = BDP_MAP_GRANULARITY * 2;
+    int fd = memfd_create("BonDriverLocalProxyTest", 0);
+    TEST_CHECK(fd >= 0);
+    if (fd < 0) {
+        return;
+    }
+    TEST_CHECK(ftruncate(fd, dataOffset + dataSize) == 0);
+    BYTE *writer = MapMirroredView(fd, dataOffset, dataSize, true);
+    // クライアントは読み取り専用で別にマップする
+    const BYTE *reader = MapMirroredView(fd, dataOffset, dataSize, false);
+    TEST_CHECK(writer && reader);
+    if (writer && reader) {
+        // 末尾の300バイト前から1000バイトを書き込む
+        DWORD bufCount = 1000;
+        ULONGLONG pos = PlaceRingChunk(dataSize * 3 - 300, dataSize, true, bufCount);
+        TEST_CHECK(pos == dataSize * 3 - 300);
+        DWORD offset = static_cast<DWORD>(pos % dataSize);
+        std::vector<BYTE> chunk = MakePattern(bufCount, 1);
+        memcpy(writer + offset, chunk.data(), bufCount);
+
+        // 1つの連続した範囲として複写なしで読める
+        const BYTE *span = GetRingChunkSpan(reader, dataSize, true, offset, bufCount, nullptr);
+        TEST_CHECK(span == reader + offset);
+        TEST_CHECK(memcmp(span, chunk.data(), bufCount) == 0);
+        // またいだ部分は実体の先頭にある
+        TEST_CHECK(memcmp(reader, chunk.data() + 300, bufCount - 300) == 0);
+        TEST_CHECK(memcmp(writer + dataSize, chunk.data() + 300, bufCount - 300) == 0);
+
+        // オフセットが末尾を越えた位置から始まるものも読める
+        span = GetRingChunkSpan(reader, dataSize, true, dataSize + 4, 16, nullptr);
+        TEST_CHECK(span == reader + dataSize + 4);
+        TEST_CHECK(memcmp(span, chunk.data() + 304, 16) == 0);
+    }
+    if (writer) {
+        UnmapMirroredView(writer, dataSize);
+    }
+    if (reader) {
+        UnmapMirroredView(reader, dataSize);
+    }
+    close(fd);
+}
+
+void TestUnmirrored()
+{
+    // 2重にマップしていなければ末尾をまたがないように先頭に回す
+    const DWORD dataSize = 4096;
+    TEST_CHECK(PlaceRingChunk(dataSize - 300, dataSize, false, 1000) == dataSize);
+    TEST_CHECK(PlaceRingChunk(dataSize * 5 - 1000, dataSize, false, 1000) == dataSize * 5 - 1000);
+    TEST_CHECK(PlaceRingChunk(dataSize * 5 + 16, dataSize, false, 1000) == dataSize * 5 + 16);
+
+    // 末尾をまたぐものだけcopyBufにつなげる
+    std::vector<BYTE> data = MakePattern(dataSize, 3);
+    BYTE copyBuf[1000];
+    const BYTE *span = GetRingChunkSpan(data.data(), dataSize, false, dataSize - 300, 1000, copyBuf);
+    TEST_CHECK(span == copyBuf);
+    TEST_CHECK(memcmp(copyBuf, &data[dataSize - 300], 300) == 0);
+    TEST_CHECK(memcmp(copyBuf + 300, &data[0], 700) == 0);
+    span = GetRingChunkSpan(data.data(), dataSize, false, 100, 1000, copyBuf);
+    TEST_CHECK(span == &data[100]);
+    span = GetRingChunkSpan(data.data(), dataSize, false, dataSize + 8, 100, copyBuf);
+    TEST_CHECK(span == &data[8]);
+}
+
+void TestPositions()
+{
+    // 16バイト境界にそろえる
+    TEST_CHECK(GetNextRingWritePos(0, 1) == 16);
+    TEST_CHECK(GetNextRingWritePos(32, 16) == 48);
+    TEST_CHECK(GetNextRingWritePos(32, 17) == 64);
+
+    // 書き込みの終わりがチャンクの位置からdataSizeを超えると上書きされる
+    const DWORD dataSize = 1 << 20;
+    ULONGLONG pos = 0x1FFFFFF00ULL;
+    TEST_CHECK(!IsRingChunkOverwritten(pos, dataSize, pos + dataSize));
+    TEST_CHECK(IsRingChunkOverwritten(pos, dataSize, pos + dataSize + 1));
+
+    // クライアントは下位32bitだけで同じ判断をする(32bitの桁あふれをまたいでも)
+    DWORD pos32 = static_cast<DWORD>(pos);
+    TEST_CHECK(IsRingChunkIntact(pos32, static_cast<DWORD>(pos + 100), dataSize));
+    TEST_CHECK(IsRingChunkIntact(pos32, static_cast<DWORD>(pos + dataSize), dataSize));
+    TEST_CHECK(!IsRingChunkIntact(pos32, static_cast<DWORD>(pos + dataSize + 1), dataSize));
+}
+}
+
+int main()
+{
+    TestMirroredWrap();
+    TestUnmirrored();
+    TestPositions();
+    return TestResult("MirrorTest");
+}
@@ -0,0 +1,184 @@
+﻿// BonDriverLocalProxyRing.hのスロットのつなぎかたを確かめる
+#include "TestCommon.h"
+#include "../BonDriverLocalProxy/BonDriverLocalProxyRing.h"
+
+namespace
+{
+// リングと空きリストに全スロットがちょうど1回ずつ現れるか
+bool IsConsistent(const BDP_RING_LINKS &ring)
+{
+    std::vector<int> seen(ring.maxNum, 0);
+    DWORD i = ring.rear;
+    for (DWORD n = 0; n < ring.num; ++n) {
+        if (i >= ring.maxNum || seen[i]++) {
+            return false;
+        }
+        i = ring.next[i];
+    }
+    if (i != ring.rear) {
+        return false;
+    }
+    DWORD freeNum = 0;
+    for (i = ring.freeHead; i != 0xFFFFFFFF; i = ring.next[i]) {
+        if (i >= ring.maxNum || seen[i]++) {
+            return false;
+        }
+        ++freeNum;
+    }
+    return ring.num + freeNum == ring.maxNum;
+}
+
+// 代理元と同じ手順でrearにbytesバイトのチャンクを書き込む
+void Write(BDP_RING_LINKS &ring, DWORD bytes)
+{
+    CommitRingRear(ring, bytes);
+    ExpandRingBuffer(ring);
+    AdvanceRingOldest(ring);
+    AdvanceRingRear(ring);
+}
+
+void TestInit()
+{
+    BDP_RING_LINKS ring;
+    InitRingLinks(ring, 4);
+    TEST_CHECK(ring.num == 1);
+    TEST_CHECK(ring.rear == 0 && ring.next[0] == 0);
+    TEST_CHECK(ring.freeHead == 1);
+    TEST_CHECK(IsConsistent(ring));
+
+    InitRingLinks(ring, 1);
+    TEST_CHECK(ring.freeHead == 0xFFFFFFFF);
+    TEST_CHECK(IsConsistent(ring));
+}
+
+void TestWrap()
+{
+    BDP_RING_LINKS ring;
+    InitRingLinks(ring, 8);
+    // 読まれていなければ伸びずに同じスロットを使い続ける
+    for (int i = 0; i < 10; ++i) {
+        Write(ring, 100);
+    }
+    TEST_CHECK(ring.num == 1 && ring.rear == 0);
+    TEST_CHECK(ring.rearSeq == 10 && ring.rearBytes == 1000);
+    TEST_CHECK(ring.byteSeq[ring.rear] == 1000);
+
+    // 3つに伸ばしてから読み手を外すと、その3つを順に巡る
+    MoveRingReader(ring, 0xFFFFFFFF, ring.rear);
+    DWORD front = ring.rear;
+    Write(ring, 10);
+    Write(ring, 10);
+    TEST_CHECK(ring.num == 3);
+    TEST_CHECK(GetRingDistance(ring, front) == 2);
+    TEST_CHECK(ring.byteSeq[ring.rear] - ring.byteSeq[front] == 20);
+    MoveRingReader(ring, front, 0xFFFFFFFF);
+    DWORD order[3] = {};
+    for (int i = 0; i < 6; ++i) {
+        if (i < 3) {
+            order[i] = ring.rear;
+        }
+        else {
+            TEST_CHECK(ring.rear == order[i - 3]);
+        }
+        Write(ring, 10);
+    }
+    TEST_CHECK(ring.num == 3);
+    TEST_CHECK(ring.seq[order[2]] == ring.rearSeq - 1);
+    TEST_CHECK(GetRingDistance(ring, ring.rear) == 0);
+    TEST_CHECK(IsConsistent(ring));
+}
+
+void TestGrow()
+{
+    BDP_RING_LINKS ring;
+    InitRingLinks(ring, 5);
+    MoveRingReader(ring, 0xFFFFFFFF, 0);
+    // 読み手のいるスロットの手前に挿入していく
+    for (DWORD i = 1; i < 5; ++i) {
+        Write(ring, 1);
+        TEST_CHECK(ring.num == i + 1);
+        TEST_CHECK(ring.next[ring.rear] == 0 || ring.num == 5);
+        TEST_CHECK(IsConsistent(ring));
+    }
+    TEST_CHECK(ring.freeHead == 0xFFFFFFFF);
+    TEST_CHECK(ring.expandEvents == 4);
+    // maxNumに達すると伸ばせず、rearは読み手のいるスロットに追いつく(代理元はその前に方針に従わせる)
+    TEST_CHECK(ring.next[ring.rear] == 0);
+    TEST_CHECK(!ExpandRingBuffer(ring));
+    Write(ring, 1);
+    TEST_CHECK(ring.num == 5 && ring.rear == 0);
+    TEST_CHECK(ring.oldest == 0);
+}
+
+void TestShrink()
+{
+    BDP_RING_LINKS ring;
+    InitRingLinks(ring, 6);
+    MoveRingReader(ring, 0xFFFFFFFF, 0);
+    for (int i = 0; i < 4; ++i) {
+        Write(ring, 1);
+    }
+    TEST_CHECK(ring.num == 5);
+    // 直後が読まれていれば縮めない
+    TEST_CHECK(ring.next[ring.rear] == 0);
+    TEST_CHECK(!ShrinkRingBuffer(ring));
+    // 読み手がrearに移ると、古い順に外せる
+    MoveRingReader(ring, 0, ring.rear);
+    TEST_CHECK(ring.readers[0] == 0 && ring.readers[ring.rear] == 1);
+    AdvanceRingOldest(ring);
+    TEST_CHECK(ring.oldest == ring.rear);
+    while (ShrinkRingBuffer(ring));
+    TEST_CHECK(ring.num == 1);
+    TEST_CHECK(ring.next[ring.rear] == ring.rear);
+    TEST_CHECK(ring.shrinkEvents == 4);
+    TEST_CHECK(IsConsistent(ring));
+    // 外したスロットはまた使える
+    Write(ring, 1);
+    TEST_CHECK(ring.num == 2);
+    TEST_CHECK(IsConsistent(ring));
+}
+
+void TestReaders()
+{
+    BDP_RING_LINKS ring;
+    InitRingLinks(ring, 8);
+    // 2つの接続が同じスロットを読む
+    DWORD a = ring.rear;
+    MoveRingReader(ring, 0xFFFFFFFF, a);
+    MoveRingReader(ring, 0xFFFFFFFF, a);
+    TEST_CHECK(ring.readers[a] == 2);
+    Write(ring, 1);
+    DWORD b = ring.rear;
+    Write(ring, 1);
+    Write(ring, 1);
+    AdvanceRingOldest(ring);
+    TEST_CHECK(ring.oldest == a);
+    // 1つが進んでも、もう1つが残っているうちはoldestは動かない
+    MoveRingReader(ring, a, b);
+    AdvanceRingOldest(ring);
+    TEST_CHECK(ring.readers[a] == 1 && ring.readers[b] == 1);
+    TEST_CHECK(ring.oldest == a);
+    MoveRingReader(ring, a, b);
+    AdvanceRingOldest(ring);
+    TEST_CHECK(ring.readers[a] == 0 && ring.readers[b] == 2);
+    TEST_CHECK(ring.oldest == b);
+    // 読み手がいなくなればoldestはrearまで進む
+    MoveRingReader(ring, b, 0xFFFFFFFF);
+    MoveRingReader(ring, b, 0xFFFFFFFF);
+    AdvanceRingOldest(ring);
+    TEST_CHECK(ring.oldest == ring.rear);
+    for (DWORD i = 0; i < ring.maxNum; ++i) {
+        TEST_CHECK(ring.readers[i] == 0);
+    }
+}
+}
+
+int main()
+{
+    TestInit();
+    TestWrap();
+    TestGrow();
+    TestShrink();
+    TestReaders();
+    return TestResult("RingTest");
+}
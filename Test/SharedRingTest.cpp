@@ -0,0 +1,164 @@
+﻿// BonDriverLocalProxySharedRing.hの共有メモリ(shm_open)上のリングバッファを、代理元とクライアントの両方の手順で読み書きする
+#include "TestCommon.h"
+#include "../BonDriverLocalProxy/BonDriverLocalProxySharedRing.h"
+#include <vector>
+
+namespace
+{
+const DWORD SLOT_NUM = 8;
+const DWORD DATA_SIZE = BDP_MAP_GRANULARITY;
+const DWORD MAX_SIZE = 8192;
+
+// 代理元の側
+struct WRITER {
+    BDP_MAP_HANDLE hMap;
+    BYTE *view;
+    size_t viewSize;
+    BYTE *mirror;
+    ULONGLONG writePos;
+};
+
+// クライアントの側
+struct READER {
+    BDP_MAP_HANDLE hMap;
+    const BYTE *view;
+    size_t viewSize;
+    const BYTE *data;
+    const BYTE *mirror;
+};
+
+std::vector<BYTE> MakeChunk(DWORD size, DWORD seed)
+{
+    // 先頭4バイトは残り数
+    std::vector<BYTE> buf(4 + size);
+    memcpy(buf.data(), &seed, 4);
+    for (DWORD i = 0; i < size; ++i) {
+        buf[4 + i] = static_cast<BYTE>(seed * 31 + i);
+    }
+    return buf;
+}
+
+// 代理元と同じ手順でスロットnに書き込む
+void WriteChunk(WRITER &w, DWORD n, const std::vector<BYTE> &buf, bool mirrored)
+{
+    BDP_SHARED_RING_HEADER &header = *reinterpret_cast<BDP_SHARED_RING_HEADER*>(w.view);
+    BYTE *data = mirrored ? w.mirror : w.view + header.dataOffset;
+    DWORD bufCount = static_cast<DWORD>(buf.size());
+    ULONGLONG pos = PlaceRingChunk(w.writePos, header.dataSize, mirrored, bufCount);
+    WriteSharedRingChunk(&header.writeEnd, GetSharedRingSlots(w.view)[n], data, header.dataSize, pos, buf.data(), bufCount);
+    w.writePos = GetNextRingWritePos(pos, bufCount);
+}
+
+// クライアントと同じ手順でスロットnを読んで、expectと一致するか確かめる
+bool ReadChunk(const READER &r, DWORD n, const std::vector<BYTE> &expect)
+{
+    DWORD dataSize = reinterpret_cast<const BDP_SHARED_RING_HEADER*>(r.view)->dataSize;
+    BDP_RING_SLOT slot;
+    if (!ReadSharedRingSlot(r.view, n, MAX_SIZE, slot)) {
+        return false;
+    }
+    std::vector<BYTE> copyBuf(slot.bufCount);
+    const BYTE *span = GetRingChunkSpan(r.data, dataSize, r.mirror != nullptr, slot.offset, slot.bufCount, copyBuf.data());
+    std::vector<BYTE> got(span, span + slot.bufCount);
+    return IsSharedRingSlotIntact(r.view, n, slot) && got == expect;
+}
+
+void RunTest(bool mirrored)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "/BonDriverLocalProxyTest_%d", static_cast<int>(getpid()));
+    RemoveSharedMap(name);
+
+    DWORD dataOffset = GetSharedRingDataOffset(SLOT_NUM);
+    TEST_CHECK(dataOffset % BDP_MAP_GRANULARITY == 0);
+    TEST_CHECK(dataOffset >= sizeof(BDP_SHARED_RING_HEADER) + sizeof(BDP_RING_SLOT) * SLOT_NUM);
+    WRITER w = {};
+    w.hMap = CreateSharedMap(name, dataOffset + DATA_SIZE);
+    TEST_CHECK(w.hMap != BDP_NO_MAP);
+    if (w.hMap == BDP_NO_MAP) {
+        return;
+    }
+    // 同じ名前では作れない
+    TEST_CHECK(CreateSharedMap(name, dataOffset + DATA_SIZE) == BDP_NO_MAP);
+    w.view = MapSharedView(w.hMap, true, w.viewSize);
+    TEST_CHECK(w.view && w.viewSize == dataOffset + DATA_SIZE);
+    InitSharedRingHeader(w.view, SLOT_NUM, dataOffset, DATA_SIZE);
+    if (mirrored) {
+        w.mirror = MapMirroredView(w.hMap, dataOffset, DATA_SIZE, true);
+        TEST_CHECK(w.mirror != nullptr);
+    }
+
+    // クライアントは名前で開いて、読み取り専用でマップする
+    READER r = {};
+    r.hMap = OpenSharedMap(name);
+    TEST_CHECK(r.hMap != BDP_NO_MAP);
+    r.view = MapSharedView(r.hMap, false, r.viewSize);
+    TEST_CHECK(r.view && r.viewSize == w.viewSize);
+    TEST_CHECK(IsSharedRingHeaderValid(r.view, r.viewSize, 4 + MAX_SIZE));
+    // 大きさが足りなければ使わない
+    TEST_CHECK(!IsSharedRingHeaderValid(r.view, dataOffset, 4 + MAX_SIZE));
+    TEST_CHECK(!IsSharedRingHeaderValid(r.view, r.viewSize, DATA_SIZE + 1));
+    if (mirrored) {
+        r.mirror = MapMirroredView(r.hMap, dataOffset, DATA_SIZE, false);
+        TEST_CHECK(r.mirror != nullptr);
+    }
+    r.data = r.mirror ? r.mirror : r.view + dataOffset;
+
+    // 何周かして末尾をまたぐものも含めて読めることを確かめる
+    std::vector<std::vector<BYTE>> written(SLOT_NUM);
+    DWORD seed = 0;
+    for (int round = 0; round < 40; ++round) {
+        DWORD n = round % SLOT_NUM;
+        written[n] = MakeChunk(1000 + round * 97 % 5000, ++seed);
+        WriteChunk(w, n, written[n], mirrored);
+        TEST_CHECK(ReadChunk(r, n, written[n]));
+    }
+
+    // 読んでいる途中で上書きされたものは捨てられる。ほかのスロットへの書き込みでも、一周すれば上書きされる
+    DWORD n = 0;
+    BDP_RING_SLOT slot;
+    TEST_CHECK(ReadSharedRingSlot(r.view, n, MAX_SIZE, slot));
+    TEST_CHECK(IsSharedRingSlotIntact(r.view, n, slot));
+    for (DWORD i = 1; ; i = i % (SLOT_NUM - 1) + 1) {
+        WriteChunk(w, i, MakeChunk(MAX_SIZE, ++seed), mirrored);
+        // 代理元の判断と一致する
+        ULONGLONG writeEnd = GetSharedRingSlots(w.view)[i].pos + 4 + MAX_SIZE;
+        bool overwritten = IsRingChunkOverwritten(slot.pos, DATA_SIZE, writeEnd);
+        TEST_CHECK(IsSharedRingSlotIntact(r.view, n, slot) == !overwritten);
+        if (overwritten) {
+            break;
+        }
+    }
+    // 同じスロットに書き込みなおされたときも
+    WriteChunk(w, n, MakeChunk(16, ++seed), mirrored);
+    TEST_CHECK(!IsSharedRingSlotIntact(r.view, n, slot));
+
+    // 範囲外のスロットの内容は使わない
+    GetSharedRingSlots(w.view)[2].offset = DATA_SIZE;
+    TEST_CHECK(!ReadSharedRingSlot(r.view, 2, MAX_SIZE, slot));
+    GetSharedRingSlots(w.view)[2].offset = 0;
+    GetSharedRingSlots(w.view)[2].bufCount = 4 + MAX_SIZE + 1;
+    TEST_CHECK(!ReadSharedRingSlot(r.view, 2, MAX_SIZE, slot));
+
+    if (r.mirror) {
+        UnmapMirroredView(r.mirror, DATA_SIZE);
+    }
+    UnmapSharedView(r.view, r.viewSize);
+    CloseSharedMap(r.hMap);
+    if (w.mirror) {
+        UnmapMirroredView(w.mirror, DATA_SIZE);
+    }
+    UnmapSharedView(w.view, w.viewSize);
+    CloseSharedMap(w.hMap);
+    RemoveSharedMap(name);
+    // 名前を消したあとは開けない
+    TEST_CHECK(OpenSharedMap(name) == BDP_NO_MAP);
+}
+}
+
+int main()
+{
+    RunTest(true);
+    RunTest(false);
+    return TestResult("SharedRingTest");
+}
@@ -0,0 +1,24 @@
+﻿#pragma once
+
+// Testのテストで共通に使う定義(Win32なしでBonDriverLocalProxy/*.hをインクルードするため)
+
+#include <stdio.h>
+
+typedef unsigned char BYTE;
+typedef unsigned int DWORD;
+typedef int LONG;
+typedef long long LONGLONG;
+typedef unsigned long long ULONGLONG;
+
+// 失敗した検査の数
+static int g_testFailures = 0;
+
+#define TEST_CHECK(cond) \
+    ((cond) ? (void)0 : (void)(++g_testFailures, fprintf(stderr, "%s:%d: failed: %s\n", __FILE__, __LINE__, #cond)))
+
+// 失敗がなければ0を返す
+inline int TestResult(const char *name)
+{
+    printf("%s: %s\n", name, g_testFailures == 0 ? "ok" : "FAILED");
+    return g_testFailures == 0 ? 0 : 1;
+}
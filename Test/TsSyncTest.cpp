@@ -0,0 +1,134 @@
+﻿// BonDriverLocalProxyTs.hの同期バイトの探索をSSE2の経路と1バイトずつの経路で比べる
+#include "TestCommon.h"
+#include "../BonDriverLocalProxy/BonDriverLocalProxyTs.h"
+#include <algorithm>
+#include <random>
+#include <vector>
+
+namespace
+{
+std::mt19937 g_rand(1);
+
+// 同期したTSをsizeバイト作る
+std::vector<BYTE> MakeTs(size_t size)
+{
+    std::vector<BYTE> buf(size);
+    for (size_t i = 0; i < size; ++i) {
+        buf[i] = i % TS_PACKET_SIZE == 0 ? 0x47 : static_cast<BYTE>(g_rand());
+    }
+    return buf;
+}
+
+// 両方の経路が同じ位置を返すか
+void CheckFind(const std::vector<BYTE> &buf)
+{
+    // 末尾を越えて読まないよう、ちょうどの大きさで渡す
+    std::vector<BYTE> exact(buf);
+    const BYTE *p = exact.empty() ? nullptr : exact.data();
+    size_t a = FindTsSync(p, exact.size());
+    size_t b = FindTsSyncScalar(p, exact.size());
+    TEST_CHECK(a == b);
+    if (a != b) {
+        fprintf(stderr, "  size=%d simd=%d scalar=%d\n", static_cast<int>(exact.size()), static_cast<int>(a), static_cast<int>(b));
+    }
+}
+
+// 先頭から同期バイトが続くパケットの数を素直に数える
+DWORD CountSyncedPacketsReference(const std::vector<BYTE> &buf, DWORD num)
+{
+    for (DWORD i = 0; i < num; ++i) {
+        if (buf[i * TS_PACKET_SIZE] != 0x47) {
+            return i;
+        }
+    }
+    return num;
+}
+
+void TestRandom()
+{
+    for (int n = 0; n < 2000; ++n) {
+        std::vector<BYTE> buf(g_rand() % 4096);
+        for (size_t i = 0; i < buf.size(); ++i) {
+            // 同期バイトを多めに混ぜて部分一致を起こりやすくする
+            buf[i] = g_rand() % 4 == 0 ? 0x47 : static_cast<BYTE>(g_rand());
+        }
+        CheckFind(buf);
+    }
+}
+
+void TestCorrupted()
+{
+    for (int n = 0; n < 2000; ++n) {
+        std::vector<BYTE> buf = MakeTs(TS_PACKET_SIZE * (1 + g_rand() % 20));
+        // 先頭にごみを挟む、同期バイトを壊す、途中を削る
+        int kind = g_rand() % 3;
+        if (kind == 0) {
+            buf.insert(buf.begin(), g_rand() % (TS_PACKET_SIZE * 2), 0);
+        }
+        else if (kind == 1) {
+            for (int i = g_rand() % 4; i >= 0; --i) {
+                buf[(g_rand() % (buf.size() / TS_PACKET_SIZE)) * TS_PACKET_SIZE] = 0x00;
+            }
+        }
+        else {
+            size_t at = g_rand() % buf.size();
+            buf.erase(buf.begin() + at, buf.begin() + std::min(buf.size(), at + 1 + g_rand() % 300));
+        }
+        CheckFind(buf);
+
+        DWORD num = static_cast<DWORD>(buf.size() / TS_PACKET_SIZE);
+        TEST_CHECK(CountSyncedPackets(buf.data(), num) == CountSyncedPacketsReference(buf, num));
+    }
+}
+
+void TestEdgeSizes()
+{
+    // 3パケット未満では確認できる分だけ確認する
+    for (size_t size = 0; size < TS_PACKET_SIZE * 3 + 32; ++size) {
+        std::vector<BYTE> buf(size, 0);
+        CheckFind(buf);
+        if (size != 0) {
+            // 同期バイトを1つだけ末尾付近のいろいろな位置に置く
+            for (size_t at = size > 40 ? size - 40 : 0; at < size; ++at) {
+                buf.assign(size, 0);
+                buf[at] = 0x47;
+                CheckFind(buf);
+                TEST_CHECK(FindTsSync(buf.data(), size) == (at + TS_PACKET_SIZE >= size ? at : size));
+            }
+        }
+        buf = MakeTs(size);
+        CheckFind(buf);
+        TEST_CHECK(FindTsSync(buf.data(), size) == 0 || size == 0);
+    }
+    // SSE2の経路が最後に見る位置の前後で同期が始まる
+    for (size_t size = TS_PACKET_SIZE * 3; size < TS_PACKET_SIZE * 3 + 64; ++size) {
+        for (size_t at = 0; at < 40; ++at) {
+            std::vector<BYTE> buf(size, 0);
+            for (size_t i = at; i < size; i += TS_PACKET_SIZE) {
+                buf[i] = 0x47;
+            }
+            CheckFind(buf);
+            TEST_CHECK(FindTsSync(buf.data(), size) == at);
+        }
+    }
+    std::vector<BYTE> buf = MakeTs(TS_PACKET_SIZE * 4);
+    TEST_CHECK(CountSyncedPackets(buf.data(), 0) == 0);
+    TEST_CHECK(CountSyncedPackets(buf.data(), 4) == 4);
+    buf[TS_PACKET_SIZE * 3] = 0;
+    TEST_CHECK(CountSyncedPackets(buf.data(), 4) == 3);
+    TEST_CHECK(CountSyncedPackets(buf.data(), 2) == 2);
+}
+}
+
+int main()
+{
+#ifdef BDP_USE_SSE2
+    puts("TsSyncTest: comparing SSE2 and scalar paths");
+#else
+    puts("TsSyncTest: SSE2 is not available, testing the scalar path only");
+#endif
+    TestRandom();
+    TestCorrupted();
+    TestEdgeSizes();
+    return TestResult("TsSyncTest");
+}